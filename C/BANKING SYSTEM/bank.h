@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Constants and type definitions
+#define CHARBUFFER 50
+#define ADDRBUFFER 150
+#define BUFFER 256
+#define IBAN_LENGTH 8
+#define PESEL_LENGTH 11
+#define ID_LEN 4
+#define BALANCE_SIZE_C 12
+#define DEBT_SIZE_C 12
+#define PRECISION 2
+#define LINE_LENGTH 120
+#define DATA_FILE "accounts.dat"
+#define HOT_FILE "accounts.hot"
+#define WAL_FILE "accounts.wal"
+#define INDEX_FILE "accounts.idx"
+#define SOCKET_FILE "bank.sock"
+#define JOURNAL_FILE "accounts.jnl"
+#define JOURNAL_HEADS_FILE "accounts.jhd"
+#define METRICS_FILE "metrics.prom"
+#define SNAPSHOT_FILE "accounts.snap"
+#define COUNTRY "PL"
+#define BANK_CODE "1234"
+// Amounts are in grosze
+#define CASH_MIN 0
+#define CASH_MAX 99999999
+#define LOAN_MAX 5000000
+#define MONTHS_OF_PAYMENT 12
+
+typedef enum {
+    INPUT_SUCCESS = 0,
+    INPUT_GO_BACK = 1,
+    INPUT_ERROR = 2
+} InputStatus_t;
+
+typedef char Fixed_string[CHARBUFFER];
+typedef char Address[ADDRBUFFER];
+typedef char PESEL[PESEL_LENGTH + 1];
+typedef char IBAN[IBAN_LENGTH + 1];
+
+// Money is counted in grosze (hundredths of a złoty) so that sums and limit
+// checks are exact
+typedef int64_t Money_t;
+
+typedef struct
+{
+    uint32_t id;
+    IBAN account_number;
+    Fixed_string first_name;
+    Fixed_string last_name;
+    Address address;
+    PESEL pesel_number;
+    // Where the debt's repayment schedule stands, see applyMonthEnd
+    uint16_t instalments_paid;
+    uint16_t charged_month;
+    Money_t balance;
+    Money_t debt;
+} Account_t;
@@ -0,0 +1,338 @@
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "batch.h"
+#include "bank.h"
+#include "metrics.h"
+#include "money.h"
+#include "operations.h"
+#include "store.h"
+#include "util.h"
+
+#define BATCH_MAX_FIELDS 8
+#define BATCH_GROUP_OPS 4096
+#define BATCH_READ_BUFFER (1 << 20)
+
+typedef struct
+{
+    const char *name;
+    int fields;
+    // How many leading fields are account ids to lock while applying
+    int accounts;
+    bool (*apply)(char **fields, char *error_msg);
+    atomic_ulong applied;
+    atomic_ulong rejected;
+} BatchOp_t;
+
+static char *trim(char *field)
+{
+    while (*field == ' ' || *field == '\t')
+        field++;
+    char *end = field + strlen(field);
+    while (end > field && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n'))
+        end--;
+    *end = '\0';
+    return field;
+}
+
+static bool parseRate(const char *field, double *value, char *error_msg)
+{
+    char *endptr;
+    *value = strtod(field, &endptr);
+    if (*endptr != '\0' || endptr == field || !isfinite(*value))
+    {
+        sprintf(error_msg, "Invalid number format '%.*s'", CHARBUFFER, field);
+        return false;
+    }
+    return true;
+}
+
+// Returns 0 for anything that is not a valid id
+static uint32_t parseID(const char *field)
+{
+    char *endptr;
+    unsigned long id = strtoul(field, &endptr, 10);
+    return *endptr != '\0' || endptr == field || id > UINT32_MAX ? 0 : (uint32_t)id;
+}
+
+static bool loadAccount(const char *field, Account_t *account, char *error_msg)
+{
+    uint32_t id = parseID(field);
+    if (id == 0)
+    {
+        sprintf(error_msg, "Invalid account ID '%.*s'", CHARBUFFER, field);
+        return false;
+    }
+    if (!storeGet(id, account))
+    {
+        sprintf(error_msg, "Account %u was not found", id);
+        return false;
+    }
+    return true;
+}
+
+static bool saved(bool written, char *error_msg)
+{
+    if (!written)
+        strcpy(error_msg, "Error writing to file");
+    return written;
+}
+
+static bool batchCreate(char **fields, char *error_msg)
+{
+    Account_t new;
+    memset(&new, 0, sizeof(Account_t));
+    if (!copyField(new.first_name, CHARBUFFER, fields[0], "First name", error_msg) ||
+        !copyField(new.last_name, CHARBUFFER, fields[1], "Last name", error_msg) ||
+        !copyField(new.pesel_number, PESEL_LENGTH + 1, fields[2], "PESEL", error_msg) ||
+        !copyField(new.address, ADDRBUFFER, fields[3], "Address", error_msg) ||
+        !parseAmount(fields[4], &new.balance, error_msg) ||
+        !parseAmount(fields[5], &new.debt, error_msg) ||
+        !validateAccount(&new, error_msg))
+        return false;
+
+    // The id, number and PESEL are only free until the append, so nothing
+    // else may create accounts in between
+    uint64_t start = metricStart();
+    storeLock();
+    new.id = storeLastID() + 1;
+    bool created = checkPESELUnique(new.pesel_number, error_msg);
+    if (created && !generateIBAN(&new))
+    {
+        strcpy(error_msg, "No free account numbers left");
+        created = false;
+    }
+    created = created && saved(storeAppend(&new), error_msg);
+    storeUnlock();
+    metricEnd(METRIC_CREATE_ACCOUNT, start, created);
+    return created;
+}
+
+static bool batchDeposit(char **fields, char *error_msg)
+{
+    Account_t acc;
+    Money_t amount;
+    if (!loadAccount(fields[0], &acc, error_msg) || !parseAmount(fields[1], &amount, error_msg) ||
+        !applyDeposit(&acc, amount, error_msg))
+        return false;
+    return saved(storeUpdate(&acc), error_msg);
+}
+
+static bool batchWithdraw(char **fields, char *error_msg)
+{
+    Account_t acc;
+    Money_t amount;
+    if (!loadAccount(fields[0], &acc, error_msg) || !parseAmount(fields[1], &amount, error_msg) ||
+        !applyWithdrawal(&acc, amount, error_msg))
+        return false;
+    return saved(storeUpdate(&acc), error_msg);
+}
+
+static bool batchTransfer(char **fields, char *error_msg)
+{
+    Account_t source, destination;
+    Money_t amount;
+    if (!loadAccount(fields[0], &source, error_msg) || !loadAccount(fields[1], &destination, error_msg) ||
+        !parseAmount(fields[2], &amount, error_msg) ||
+        !applyTransfer(&source, &destination, amount, error_msg))
+        return false;
+    return saved(storeTransfer(&source, &destination), error_msg);
+}
+
+static bool batchLoan(char **fields, char *error_msg)
+{
+    Account_t acc;
+    Money_t amount;
+    double interest_rate;
+    if (!loadAccount(fields[0], &acc, error_msg) || !parseAmount(fields[1], &amount, error_msg) ||
+        !parseRate(fields[2], &interest_rate, error_msg) ||
+        !applyLoan(&acc, amount, interest_rate, error_msg))
+        return false;
+    return saved(storeUpdate(&acc), error_msg);
+}
+
+static bool batchPayDebt(char **fields, char *error_msg)
+{
+    Account_t acc;
+    Money_t amount;
+    if (!loadAccount(fields[0], &acc, error_msg) || !parseAmount(fields[1], &amount, error_msg) ||
+        !applyDebtPayment(&acc, amount, error_msg))
+        return false;
+    return saved(storeUpdate(&acc), error_msg);
+}
+
+static BatchOp_t operations[] = {
+    { "create", 6, 0, batchCreate, 0, 0 },
+    { "deposit", 2, 1, batchDeposit, 0, 0 },
+    { "withdraw", 2, 1, batchWithdraw, 0, 0 },
+    { "transfer", 3, 2, batchTransfer, 0, 0 },
+    { "loan", 3, 1, batchLoan, 0, 0 },
+    { "paydebt", 2, 1, batchPayDebt, 0, 0 },
+};
+
+#define OPERATIONS_COUNT (sizeof(operations) / sizeof(operations[0]))
+
+static atomic_ulong unknown_ops;
+
+// Counts rejections; the caller counts op as applied once that is durable
+static bool applyLine(char *line, char *error_msg, BatchOp_t **applied_op)
+{
+    char *fields[BATCH_MAX_FIELDS];
+    int count = 0;
+    for (char *next = line; next != NULL && count < BATCH_MAX_FIELDS; count++)
+    {
+        fields[count] = next;
+        next = strchr(next, ';');
+        if (next != NULL)
+            *next++ = '\0';
+        fields[count] = trim(fields[count]);
+    }
+
+    for (size_t i = 0; i < OPERATIONS_COUNT; i++)
+    {
+        BatchOp_t *op = &operations[i];
+        if (strcmp(fields[0], op->name) != 0)
+            continue;
+
+        bool applied = false;
+        if (count - 1 != op->fields)
+        {
+            sprintf(error_msg, "'%s' takes %d fields, got %d", op->name, op->fields, count - 1);
+        }
+        else
+        {
+            uint32_t first = op->accounts > 0 ? parseID(fields[1]) : 0;
+            uint32_t second = op->accounts > 1 ? parseID(fields[2]) : 0;
+            storeLockAccounts(first, second);
+            applied = op->apply(fields + 1, error_msg);
+            storeUnlockAccounts(first, second);
+        }
+
+        if (applied)
+            *applied_op = op;
+        else
+            op->rejected++;
+        return applied;
+    }
+    sprintf(error_msg, "Unknown operation '%.*s'", CHARBUFFER, fields[0]);
+    unknown_ops++;
+    return false;
+}
+
+static bool applyMeasured(char *line, char *error_msg, BatchOp_t **applied_op)
+{
+    uint64_t start = metricStart();
+    bool applied = applyLine(line, error_msg, applied_op);
+    metricEnd(METRIC_BATCH_LINE, start, applied);
+    return applied;
+}
+
+bool batchApplyLine(char *line, char *error_msg)
+{
+    BatchOp_t *op;
+    if (!applyMeasured(line, error_msg, &op))
+        return false;
+    op->applied++;
+    return true;
+}
+
+static void printSummary(unsigned long lines, double seconds)
+{
+    unsigned long applied = 0, rejected = atomic_load(&unknown_ops);
+    printf("%-10s %12s %12s\n", "Operation", "Applied", "Rejected");
+    for (size_t i = 0; i < OPERATIONS_COUNT; i++)
+    {
+        unsigned long op_applied = atomic_load(&operations[i].applied);
+        unsigned long op_rejected = atomic_load(&operations[i].rejected);
+        printf("%-10s %12lu %12lu\n", operations[i].name, op_applied, op_rejected);
+        applied += op_applied;
+        rejected += op_rejected;
+    }
+    printf("%-10s %12s %12lu\n", "unknown", "", atomic_load(&unknown_ops));
+    printf("%-10s %12lu %12lu\n", "total", applied, rejected);
+    printf("%lu lines in %.3f s, %.0f ops/sec\n", lines, seconds, seconds > 0 ? (applied + rejected) / seconds : 0.0);
+}
+
+static void countCommitted(unsigned long *uncounted)
+{
+    for (size_t i = 0; i < OPERATIONS_COUNT; i++)
+    {
+        operations[i].applied += uncounted[i];
+        uncounted[i] = 0;
+    }
+}
+
+int runBatch(int argc, char *argv[])
+{
+    FILE *input = stdin;
+    if (argc > 1 && strcmp(argv[1], "-") != 0)
+    {
+        input = fopen(argv[1], "r");
+        if (input == NULL)
+        {
+            fprintf(stderr, "Cannot open %s\n", argv[1]);
+            return 1;
+        }
+    }
+    setvbuf(input, NULL, _IOFBF, BATCH_READ_BUFFER);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    storeSetAutocommit(false);
+
+    char *line = NULL;
+    size_t capacity = 0;
+    unsigned long lines = 0, uncommitted = 0;
+    // Applied operations count once their group commit succeeds
+    unsigned long uncounted[OPERATIONS_COUNT] = { 0 };
+    bool failed = false;
+    while (getline(&line, &capacity, input) != -1)
+    {
+        lines++;
+        char *text = trim(line);
+        if (*text == '\0' || *text == '#')
+            continue;
+
+        char error_msg[BUFFER];
+        BatchOp_t *op;
+        if (!applyMeasured(text, error_msg, &op))
+        {
+            fprintf(stderr, "line %lu: %s\n", lines, error_msg);
+            continue;
+        }
+        uncounted[op - operations]++;
+
+        // Accepted operations are synced in groups, one fdatasync each
+        if (++uncommitted == BATCH_GROUP_OPS)
+        {
+            if (!storeCommit())
+            {
+                failed = true;
+                break;
+            }
+            countCommitted(uncounted);
+            uncommitted = 0;
+        }
+    }
+    if (!failed && !storeCommit())
+        failed = true;
+    if (!failed)
+        countCommitted(uncounted);
+    storeSetAutocommit(true);
+
+    free(line);
+    if (input != stdin)
+        fclose(input);
+
+    printSummary(lines, elapsedSince(&start));
+    if (failed)
+    {
+        fprintf(stderr, "Commit failed, the last %lu applied operations were rolled back\n", uncommitted);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Applies a stream of operations without the menus, one per line, fields
+// separated by ';' (blank lines and lines starting with '#' are skipped):
+//   create;FIRST NAME;LAST NAME;PESEL;ADDRESS;BALANCE;DEBT
+//   deposit;ID;AMOUNT
+//   withdraw;ID;AMOUNT
+//   transfer;SOURCE ID;DESTINATION ID;AMOUNT
+//   loan;ID;AMOUNT;INTEREST RATE
+//   paydebt;ID;AMOUNT
+// argv[1] names the input file, stdin is used when it is missing or "-".
+int runBatch(int argc, char *argv[]);
+
+// Applies one such line (already trimmed) through the store, committed or
+// staged as the store's autocommit setting says. A rejected line leaves the
+// store untouched and the reason in error_msg. Threads may apply lines
+// concurrently: the accounts a line names stay locked from read to change.
+bool batchApplyLine(char *line, char *error_msg);
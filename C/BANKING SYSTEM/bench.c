@@ -0,0 +1,455 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bank.h"
+#include "batch.h"
+#include "bench.h"
+#include "histogram.h"
+#include "index.h"
+#include "operations.h"
+#include "scratch.h"
+#include "store.h"
+
+#define BENCH_DEFAULT_ACCOUNTS 100000
+#define BENCH_DEFAULT_OPERATIONS 100000
+#define BENCH_MAX_ACCOUNTS 100000000
+#define BENCH_MAX_THREADS 64
+#define BENCH_LOAD_GROUP (1u << 20)
+#define BENCH_SEED 0x9E3779B97F4A7C15ull
+// Birth dates run from 1940-01-01 over this many days (to 2005-12-31); a
+// stride coprime to it spreads consecutive accounts over all of them, and
+// with 5000 serials per day every account gets its own PESEL
+#define BIRTH_FIRST_DAY (-10957)
+#define BIRTH_DAYS 24107
+#define BIRTH_STRIDE 7919
+
+typedef enum {
+    BENCH_LOOKUP,
+    BENCH_DEPOSIT,
+    BENCH_TRANSFER,
+    BENCH_SEARCH,
+    BENCH_KINDS
+} BenchKind_t;
+
+static const char *kind_names[BENCH_KINDS] = { "lookup", "deposit", "transfer", "search" };
+
+typedef struct
+{
+    const char *text;
+    unsigned weight;
+} Weighted_t;
+
+typedef struct
+{
+    const char *male;
+    const char *female;
+    unsigned weight;
+} Surname_t;
+
+typedef struct
+{
+    const char *name;
+    const char *postal_prefix;
+    unsigned weight;
+} City_t;
+
+// Rough frequencies from the Polish registry, transliterated to ASCII since
+// names may only hold letters and spaces
+static const Weighted_t male_names[] = {
+    { "Piotr", 690 }, { "Krzysztof", 650 }, { "Andrzej", 600 }, { "Tomasz", 560 }, { "Jan", 550 },
+    { "Pawel", 530 }, { "Michal", 510 }, { "Marcin", 480 }, { "Jakub", 400 }, { "Adam", 390 },
+    { "Lukasz", 380 }, { "Marek", 370 }, { "Grzegorz", 350 }, { "Mateusz", 330 }, { "Wojciech", 320 },
+    { "Mariusz", 290 }, { "Dariusz", 280 }, { "Zbigniew", 260 }, { "Rafal", 250 }, { "Kamil", 240 },
+    { "Jerzy", 220 }, { "Robert", 210 }, { "Tadeusz", 190 }, { "Jacek", 180 }, { "Szymon", 170 },
+};
+
+static const Weighted_t female_names[] = {
+    { "Anna", 1000 }, { "Maria", 720 }, { "Katarzyna", 640 }, { "Malgorzata", 620 }, { "Agnieszka", 580 },
+    { "Barbara", 500 }, { "Ewa", 490 }, { "Krystyna", 430 }, { "Magdalena", 420 }, { "Elzbieta", 410 },
+    { "Joanna", 400 }, { "Aleksandra", 330 }, { "Monika", 320 }, { "Zofia", 300 }, { "Teresa", 290 },
+    { "Danuta", 270 }, { "Natalia", 260 }, { "Julia", 250 }, { "Karolina", 240 }, { "Marta", 230 },
+    { "Beata", 220 }, { "Dorota", 210 }, { "Halina", 200 }, { "Jadwiga", 190 }, { "Janina", 180 },
+};
+
+static const Surname_t surnames[] = {
+    { "Nowak", "Nowak", 1000 }, { "Kowalski", "Kowalska", 690 }, { "Wisniewski", "Wisniewska", 540 },
+    { "Wojcik", "Wojcik", 500 }, { "Kowalczyk", "Kowalczyk", 490 }, { "Kaminski", "Kaminska", 470 },
+    { "Lewandowski", "Lewandowska", 460 }, { "Zielinski", "Zielinska", 450 }, { "Szymanski", "Szymanska", 440 },
+    { "Wozniak", "Wozniak", 430 }, { "Dabrowski", "Dabrowska", 420 }, { "Kozlowski", "Kozlowska", 370 },
+    { "Jankowski", "Jankowska", 340 }, { "Mazur", "Mazur", 330 }, { "Wojciechowski", "Wojciechowska", 320 },
+    { "Kwiatkowski", "Kwiatkowska", 320 }, { "Krawczyk", "Krawczyk", 310 }, { "Kaczmarek", "Kaczmarek", 300 },
+    { "Piotrowski", "Piotrowska", 300 }, { "Grabowski", "Grabowska", 290 }, { "Zajac", "Zajac", 280 },
+    { "Pawlowski", "Pawlowska", 270 }, { "Michalski", "Michalska", 270 }, { "Krol", "Krol", 260 },
+    { "Nowakowski", "Nowakowska", 250 }, { "Wieczorek", "Wieczorek", 250 }, { "Jablonski", "Jablonska", 240 },
+    { "Wrobel", "Wrobel", 240 }, { "Majewski", "Majewska", 230 }, { "Olszewski", "Olszewska", 220 },
+};
+
+// Population in thousands; the small towns at the end stand in for the rest
+// of the country
+static const City_t cities[] = {
+    { "Warszawa", "0", 1860 }, { "Krakow", "3", 800 }, { "Wroclaw", "5", 674 }, { "Lodz", "9", 658 },
+    { "Poznan", "6", 540 }, { "Gdansk", "8", 486 }, { "Szczecin", "7", 391 }, { "Lublin", "2", 334 },
+    { "Bydgoszcz", "8", 330 }, { "Bialystok", "1", 294 }, { "Katowice", "4", 286 }, { "Gdynia", "8", 243 },
+    { "Czestochowa", "4", 209 }, { "Radom", "2", 201 }, { "Rzeszow", "3", 198 }, { "Torun", "8", 196 },
+    { "Kielce", "2", 184 }, { "Gliwice", "4", 173 }, { "Olsztyn", "1", 170 }, { "Opole", "4", 126 },
+    { "Pruszkow", "0", 2000 }, { "Wieliczka", "3", 1500 }, { "Swarzedz", "6", 1500 }, { "Legionowo", "0", 1500 },
+    { "Zakopane", "3", 1000 }, { "Sopot", "8", 1000 }, { "Otwock", "0", 1000 }, { "Zywiec", "3", 1000 },
+};
+
+static const char *streets[] = {
+    "Polna", "Lesna", "Sloneczna", "Krotka", "Szkolna", "Ogrodowa", "Lipowa", "Brzozowa", "Lakowa",
+    "Kwiatowa", "Mickiewicza", "Kosciuszki", "Sienkiewicza", "Dluga", "Kolejowa", "Jana Pawla II",
+    "Parkowa", "Sportowa", "Zielona", "Wiejska", "Marszalkowska", "Pilsudskiego", "Reymonta", "Chopina",
+};
+
+#define COUNT_OF(table) (sizeof(table) / sizeof(table[0]))
+
+typedef struct
+{
+    uint32_t accounts;
+    unsigned long operations;
+    const unsigned *mix;
+    unsigned mix_total;
+    // Whether syncs should wait for other workers to join the group
+    bool shared;
+    uint64_t random;
+    unsigned long rejected[BENCH_KINDS];
+} BenchWorker_t;
+
+static Histogram_t latency[BENCH_KINDS];
+
+// xorshift64*, one state per thread
+static uint64_t nextRandom(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ull;
+}
+
+static uint32_t randomBelow(uint64_t *state, uint32_t limit)
+{
+    return (uint32_t)((nextRandom(state) >> 32) * limit >> 32);
+}
+
+static double randomUnit(uint64_t *state)
+{
+    return ((nextRandom(state) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+// Tables are short, a linear walk over the weights is enough
+static unsigned pickWeighted(uint64_t *state, const unsigned *weights, size_t count, size_t stride)
+{
+    unsigned total = 0;
+    for (size_t i = 0; i < count; i++)
+        total += *(const unsigned *)((const char *)weights + i * stride);
+    unsigned pick = randomBelow(state, total);
+    size_t i = 0;
+    for (;; i++)
+    {
+        unsigned weight = *(const unsigned *)((const char *)weights + i * stride);
+        if (pick < weight)
+            break;
+        pick -= weight;
+    }
+    return (unsigned)i;
+}
+
+#define PICK(state, table) pickWeighted(state, &table[0].weight, COUNT_OF(table), sizeof(table[0]))
+
+// Amounts are log-normal around median zł, clamped to [0, limit]
+static Money_t randomAmount(uint64_t *state, double median, double sigma, Money_t limit)
+{
+    double normal = sqrt(-2.0 * log(randomUnit(state))) * cos(2.0 * M_PI * randomUnit(state));
+    double amount = median * exp(sigma * normal) * 100.0;
+    return amount < (double)limit ? llround(amount) : limit;
+}
+
+static void civilFromDays(int64_t days, int *year, int *month, int *day)
+{
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    unsigned day_of_era = (unsigned)(days - era * 146097);
+    unsigned year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    unsigned day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    unsigned shifted_month = (5 * day_of_year + 2) / 153;
+    *day = (int)(day_of_year - (153 * shifted_month + 2) / 5 + 1);
+    *month = (int)(shifted_month < 10 ? shifted_month + 3 : shifted_month - 9);
+    *year = (int)(year_of_era + era * 400 + (*month <= 2));
+}
+
+static bool isFemale(uint32_t index)
+{
+    return ((index * 2654435761u) >> 16) & 1;
+}
+
+// A valid PESEL for the index-th account: birth date, serial, sex digit
+// (even for women) and check digit
+static void makePESEL(uint32_t index, char *pesel)
+{
+    static const int weights[10] = { 1, 3, 7, 9, 1, 3, 7, 9, 1, 3 };
+    int year, month, day;
+    civilFromDays(BIRTH_FIRST_DAY + (int64_t)index * BIRTH_STRIDE % BIRTH_DAYS, &year, &month, &day);
+    uint32_t serial = index / BIRTH_DAYS;
+    unsigned sex_digit = (serial % 5) * 2 + !isFemale(index);
+    snprintf(pesel, PESEL_LENGTH + 1, "%02d%02d%02d%03u%u", year % 100, month + (year >= 2000 ? 20 : 0), day,
+             serial / 5 % 1000, sex_digit);
+    int sum = 0;
+    for (int i = 0; i < 10; i++)
+        sum += (pesel[i] - '0') * weights[i];
+    pesel[10] = (char)('0' + (10 - sum % 10) % 10);
+    pesel[11] = '\0';
+}
+
+static void makeAccount(uint32_t index, uint64_t *state, Account_t *account)
+{
+    memset(account, 0, sizeof(Account_t));
+    bool female = isFemale(index);
+    const Surname_t *surname = &surnames[PICK(state, surnames)];
+    strcpy(account->first_name, female ? female_names[PICK(state, female_names)].text
+                                       : male_names[PICK(state, male_names)].text);
+    strcpy(account->last_name, female ? surname->female : surname->male);
+    makePESEL(index, account->pesel_number);
+
+    const City_t *city = &cities[PICK(state, cities)];
+    const char *street = streets[randomBelow(state, COUNT_OF(streets))];
+    unsigned house = 1 + randomBelow(state, 120);
+    if (randomBelow(state, 3) == 0)
+        snprintf(account->address, ADDRBUFFER, "ul. %s %u/%u, %s%u-%03u %s", street, house,
+                 1 + randomBelow(state, 80), city->postal_prefix, randomBelow(state, 10), randomBelow(state, 1000),
+                 city->name);
+    else
+        snprintf(account->address, ADDRBUFFER, "ul. %s %u, %s%u-%03u %s", street, house, city->postal_prefix,
+                 randomBelow(state, 10), randomBelow(state, 1000), city->name);
+
+    account->balance = randomAmount(state, 4000.0, 1.3, CASH_MAX);
+    account->debt = randomBelow(state, 4) == 0 ? randomAmount(state, 8000.0, 1.0, LOAN_MAX) : 0;
+}
+
+static bool generateAccounts(uint32_t count)
+{
+    uint64_t state = BENCH_SEED;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        Account_t account;
+        makeAccount(i, &state, &account);
+        account.id = storeLastID() + 1;
+        if (!generateIBAN(&account) || !storeLoad(&account) ||
+            (((i + 1) % BENCH_LOAD_GROUP == 0 || storeLoadFull()) && !storeLoadCommit()))
+            return false;
+    }
+    return storeLoadCommit();
+}
+
+static uint64_t nowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+// Reads every match back, as the search listing does before printing
+static bool searchAccounts(SearchField_t field, const char *key)
+{
+    SlotList_t matches = { 0 };
+    storeLock();
+    bool answered = indexSearch(field, key, &matches);
+    for (size_t i = 0; i < matches.count; i++)
+    {
+        Account_t account;
+        storeRead(matches.slots[i], &account);
+    }
+    storeUnlock();
+    slotListFree(&matches);
+    return answered;
+}
+
+static bool runOperation(BenchKind_t kind, BenchWorker_t *worker)
+{
+    char line[BUFFER], error_msg[BUFFER];
+    uint64_t *state = &worker->random;
+    uint32_t id = 1 + randomBelow(state, worker->accounts);
+    Money_t amount = 1 + randomBelow(state, 20000);
+    switch (kind)
+    {
+    case BENCH_LOOKUP:
+    {
+        Account_t account;
+        return storeGet(id, &account);
+    }
+    case BENCH_DEPOSIT:
+        snprintf(line, sizeof(line), "deposit;%u;%ld.%02ld", id, (long)(amount / 100), (long)(amount % 100));
+        return batchApplyLine(line, error_msg) && storeSync(worker->shared);
+    case BENCH_TRANSFER:
+    {
+        uint32_t destination = 1 + randomBelow(state, worker->accounts - 1);
+        if (destination >= id)
+            destination++;
+        snprintf(line, sizeof(line), "transfer;%u;%u;%ld.%02ld", id, destination, (long)(amount / 100),
+                 (long)(amount % 100));
+        return batchApplyLine(line, error_msg) && storeSync(worker->shared);
+    }
+    case BENCH_SEARCH:
+    default:
+    {
+        if (randomBelow(state, 2) == 0)
+        {
+            makePESEL(id - 1, line);
+            return searchAccounts(SEARCH_PESEL, line);
+        }
+        const Surname_t *surname = &surnames[PICK(state, surnames)];
+        snprintf(line, sizeof(line), "%.4s*", randomBelow(state, 2) ? surname->female : surname->male);
+        return searchAccounts(SEARCH_SURNAME, line);
+    }
+    }
+}
+
+static void *workerMain(void *argument)
+{
+    BenchWorker_t *worker = argument;
+    for (unsigned long i = 0; i < worker->operations; i++)
+    {
+        unsigned pick = randomBelow(&worker->random, worker->mix_total);
+        BenchKind_t kind = BENCH_LOOKUP;
+        while (pick >= worker->mix[kind])
+            pick -= worker->mix[kind++];
+
+        uint64_t start = nowNs();
+        if (!runOperation(kind, worker))
+            worker->rejected[kind]++;
+        histogramRecord(&latency[kind], nowNs() - start);
+    }
+    return NULL;
+}
+
+static bool parseMix(const char *text, unsigned *mix, unsigned *total)
+{
+    char *end;
+    *total = 0;
+    for (int kind = 0; kind < BENCH_KINDS; kind++)
+    {
+        long weight = strtol(text, &end, 10);
+        if (end == text || weight < 0 || weight > 1000000 || *end != (kind + 1 < BENCH_KINDS ? ':' : '\0'))
+            return false;
+        mix[kind] = (unsigned)weight;
+        *total += mix[kind];
+        text = end + 1;
+    }
+    return *total > 0;
+}
+
+static void printLatencyRow(const char *name, const Histogram_t *histogram, unsigned long rejected)
+{
+    printf("%-9s %10lu %9lu %10.1f %10.1f %10.1f %10.1f\n", name, (unsigned long)histogram->count, rejected,
+           histogramPercentile(histogram, 50.0) / 1e3, histogramPercentile(histogram, 99.0) / 1e3,
+           histogramPercentile(histogram, 99.9) / 1e3, histogram->max / 1e3);
+}
+
+static bool runWorkload(uint32_t accounts, unsigned long operations, const unsigned *mix, unsigned mix_total,
+                        int threads)
+{
+    pthread_t ids[BENCH_MAX_THREADS];
+    BenchWorker_t workers[BENCH_MAX_THREADS];
+    storeSetAutocommit(false);
+    uint64_t start = nowNs();
+    int started = 0;
+    for (; started < threads; started++)
+    {
+        BenchWorker_t *worker = &workers[started];
+        memset(worker, 0, sizeof(*worker));
+        worker->accounts = accounts;
+        worker->operations = operations / threads + (started < (int)(operations % threads));
+        worker->mix = mix;
+        worker->mix_total = mix_total;
+        worker->shared = threads > 1;
+        worker->random = BENCH_SEED ^ ((uint64_t)(started + 1) << 32);
+        if (pthread_create(&ids[started], NULL, workerMain, worker) != 0)
+            break;
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(ids[i], NULL);
+    double seconds = (nowNs() - start) / 1e9;
+    storeSetAutocommit(true);
+    if (started < threads)
+    {
+        fprintf(stderr, "Could not start %d threads\n", threads);
+        return false;
+    }
+
+    Histogram_t *all = calloc(1, sizeof(Histogram_t));
+    if (all == NULL)
+        return false;
+    unsigned long rejected_total = 0, done = 0;
+    printf("%-9s %10s %9s %10s %10s %10s %10s\n", "Operation", "Count", "Rejected", "p50 us", "p99 us",
+           "p99.9 us", "max us");
+    for (int kind = 0; kind < BENCH_KINDS; kind++)
+    {
+        unsigned long rejected = 0;
+        for (int i = 0; i < threads; i++)
+            rejected += workers[i].rejected[kind];
+        printLatencyRow(kind_names[kind], &latency[kind], rejected);
+        for (uint32_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+            all->counts[bucket] += latency[kind].counts[bucket];
+        all->count += latency[kind].count;
+        all->max = latency[kind].max > all->max ? latency[kind].max : all->max;
+        rejected_total += rejected;
+        done += latency[kind].count;
+    }
+    printLatencyRow("all", all, rejected_total);
+    free(all);
+    printf("\n%lu operations in %.3f s with %d thread%s: %.0f ops/s\n", done, seconds, threads,
+           threads == 1 ? "" : "s", seconds > 0 ? done / seconds : 0.0);
+    return true;
+}
+
+int runBench(int argc, char *argv[])
+{
+    long accounts = argc > 1 ? atol(argv[1]) : BENCH_DEFAULT_ACCOUNTS;
+    long operations = argc > 2 ? atol(argv[2]) : BENCH_DEFAULT_OPERATIONS;
+    unsigned mix[BENCH_KINDS] = { 60, 20, 15, 5 }, mix_total = 100;
+    int threads = argc > 4 ? atoi(argv[4]) : 1;
+    if (accounts < 2 || accounts > BENCH_MAX_ACCOUNTS || operations < 1 ||
+        (argc > 3 && !parseMix(argv[3], mix, &mix_total)) || threads < 1 || threads > BENCH_MAX_THREADS)
+    {
+        fprintf(stderr, "Usage: bench [ACCOUNTS (2-%d) [OPERATIONS [LOOKUP:DEPOSIT:TRANSFER:SEARCH [THREADS]]]]\n",
+                BENCH_MAX_ACCOUNTS);
+        return 1;
+    }
+
+    ScratchFiles_t files;
+    if (!scratchCreate(&files, "bench"))
+    {
+        fprintf(stderr, "Cannot create a scratch directory\n");
+        return 1;
+    }
+    if (!storeOpen(files.data, files.hot, files.wal, files.snapshot))
+    {
+        fprintf(stderr, "Error opening %s\n", files.data);
+        scratchRemove(&files);
+        return 1;
+    }
+
+    uint64_t start = nowNs();
+    bool ok = generateAccounts((uint32_t)accounts);
+    if (!ok)
+        fprintf(stderr, "Error generating the accounts\n");
+    else
+        printf("Generated %ld accounts in %.3f s\n", accounts, (nowNs() - start) / 1e9);
+
+    start = nowNs();
+    ok = ok && indexOpen(files.index);
+    if (ok)
+    {
+        printf("Indexed them in %.3f s\n\n", (nowNs() - start) / 1e9);
+        ok = runWorkload((uint32_t)accounts, (unsigned long)operations, mix, mix_total, threads);
+    }
+    indexClose();
+    storeClose();
+    scratchRemove(&files);
+    return ok ? 0 : 1;
+}
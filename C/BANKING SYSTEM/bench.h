@@ -0,0 +1,15 @@
+#pragma once
+
+// Synthetic workload benchmark on a scratch store. It generates accounts
+// with realistic Polish names, addresses and valid PESELs, then replays a
+// random mix of
+//   lookup   - an account by id, as the menus find one
+//   deposit  - a deposit through the batch code path, synced
+//   transfer - a transfer between two random accounts, synced
+//   search   - a surname prefix or exact PESEL through the indexes, with
+//              every match read back as the search listing does
+// and reports throughput and p50/p99/p99.9 latency per operation.
+// argv[1] is the number of accounts, argv[2] the number of operations,
+// argv[3] the mix as LOOKUP:DEPOSIT:TRANSFER:SEARCH weights and argv[4]
+// the number of threads sharing the operations.
+int runBench(int argc, char *argv[]);
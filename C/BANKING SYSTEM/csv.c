@@ -0,0 +1,555 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bank.h"
+#include "csv.h"
+#include "money.h"
+#include "operations.h"
+#include "store.h"
+#include "util.h"
+
+#define CSV_COLUMNS 6
+#define CSV_MAX_FIELDS 32
+#define CSV_MAX_LINE 4096
+#define CSV_MAX_THREADS 64
+// Bytes parsed per round, split between the threads
+#define CSV_WINDOW (64u << 20)
+// Most accounts loaded per sequential write of the store files; fewer when
+// they use up the store's memory budget first
+#define CSV_LOAD_GROUP (1u << 20)
+#define CSV_WRITE_BUFFER (1 << 20)
+
+enum
+{
+    COLUMN_FIRST_NAME,
+    COLUMN_LAST_NAME,
+    COLUMN_PESEL,
+    COLUMN_ADDRESS,
+    COLUMN_BALANCE,
+    COLUMN_DEBT
+};
+
+static const char *column_names[CSV_COLUMNS] = { "first_name", "last_name", "pesel", "address", "balance", "debt" };
+
+typedef struct
+{
+    unsigned long line;
+    char message[BUFFER];
+} ImportError_t;
+
+// One thread's share of a window: whole lines, parsed into accounts in file
+// order. Line numbers are counted from the start of the chunk.
+typedef struct
+{
+    const char *begin;
+    const char *end;
+    const int *columns;
+    int width;
+    unsigned long lines;
+    Account_t *accounts;
+    size_t count;
+    size_t capacity;
+    ImportError_t *errors;
+    size_t error_count;
+    size_t error_capacity;
+    bool out_of_memory;
+} Chunk_t;
+
+typedef struct
+{
+    int fd;
+    char *data;
+    size_t used;
+    bool failed;
+} Output_t;
+
+// Splits one line into fields, unquoting them into buffer (CSV_MAX_LINE +
+// CSV_MAX_FIELDS bytes). Returns the field count, or -1 for a malformed line
+static int splitRow(const char *line, size_t length, char *buffer, char **fields)
+{
+    if (length >= CSV_MAX_LINE)
+        return -1;
+    const char *pos = line, *end = line + length;
+    char *out = buffer;
+    int count = 0;
+    while (true)
+    {
+        if (count == CSV_MAX_FIELDS)
+            return -1;
+        fields[count++] = out;
+        if (pos < end && *pos == '"')
+        {
+            for (pos++;; pos++)
+            {
+                if (pos == end)
+                    return -1;
+                if (*pos == '"')
+                {
+                    if (pos + 1 == end || pos[1] != '"')
+                        break;
+                    pos++;
+                }
+                *out++ = *pos;
+            }
+            if (++pos < end && *pos != ',')
+                return -1;
+        }
+        else
+        {
+            while (pos < end && *pos != ',')
+                *out++ = *pos++;
+        }
+        *out++ = '\0';
+        if (pos == end)
+            return count;
+        pos++;
+    }
+}
+
+// The same checks as a created account, id and account number come later
+static bool parseRow(char **fields, const int *columns, Account_t *account, char *error_msg)
+{
+    memset(account, 0, sizeof(Account_t));
+    return copyField(account->first_name, CHARBUFFER, fields[columns[COLUMN_FIRST_NAME]], "First name", error_msg) &&
+           copyField(account->last_name, CHARBUFFER, fields[columns[COLUMN_LAST_NAME]], "Last name", error_msg) &&
+           copyField(account->pesel_number, PESEL_LENGTH + 1, fields[columns[COLUMN_PESEL]], "PESEL", error_msg) &&
+           copyField(account->address, ADDRBUFFER, fields[columns[COLUMN_ADDRESS]], "Address", error_msg) &&
+           parseAmount(fields[columns[COLUMN_BALANCE]], &account->balance, error_msg) &&
+           parseAmount(fields[columns[COLUMN_DEBT]], &account->debt, error_msg) &&
+           validateAccount(account, error_msg);
+}
+
+static void addAccount(Chunk_t *chunk, const Account_t *account)
+{
+    if (chunk->count == chunk->capacity)
+    {
+        size_t new_capacity = chunk->capacity ? chunk->capacity * 2 : 4096;
+        Account_t *accounts = realloc(chunk->accounts, new_capacity * sizeof(Account_t));
+        if (accounts == NULL)
+        {
+            chunk->out_of_memory = true;
+            return;
+        }
+        chunk->accounts = accounts;
+        chunk->capacity = new_capacity;
+    }
+    chunk->accounts[chunk->count++] = *account;
+}
+
+static void addError(Chunk_t *chunk, const char *message)
+{
+    if (chunk->error_count == chunk->error_capacity)
+    {
+        size_t new_capacity = chunk->error_capacity ? chunk->error_capacity * 2 : 64;
+        ImportError_t *errors = realloc(chunk->errors, new_capacity * sizeof(ImportError_t));
+        if (errors == NULL)
+        {
+            chunk->out_of_memory = true;
+            return;
+        }
+        chunk->errors = errors;
+        chunk->error_capacity = new_capacity;
+    }
+    ImportError_t *error = &chunk->errors[chunk->error_count++];
+    error->line = chunk->lines;
+    strcpy(error->message, message);
+}
+
+static void *parseChunk(void *argument)
+{
+    Chunk_t *chunk = argument;
+    char buffer[CSV_MAX_LINE + CSV_MAX_FIELDS], error_msg[BUFFER];
+    char *fields[CSV_MAX_FIELDS];
+    const char *line = chunk->begin;
+    while (line < chunk->end && !chunk->out_of_memory)
+    {
+        const char *newline = memchr(line, '\n', chunk->end - line);
+        const char *next = newline != NULL ? newline + 1 : chunk->end;
+        size_t length = (newline != NULL ? newline : chunk->end) - line;
+        if (length > 0 && line[length - 1] == '\r')
+            length--;
+        chunk->lines++;
+
+        Account_t account;
+        int count = length > 0 ? splitRow(line, length, buffer, fields) : 0;
+        if (count < 0)
+        {
+            addError(chunk, "Malformed or too long line");
+        }
+        else if (count > 0 && count != chunk->width)
+        {
+            sprintf(error_msg, "Expected %d fields, got %d", chunk->width, count);
+            addError(chunk, error_msg);
+        }
+        else if (count > 0)
+        {
+            // Ids are handed out when loading; until then the id is the line
+            if (parseRow(fields, chunk->columns, &account, error_msg))
+            {
+                account.id = (uint32_t)chunk->lines;
+                addAccount(chunk, &account);
+            }
+            else
+                addError(chunk, error_msg);
+        }
+        line = next;
+    }
+    return NULL;
+}
+
+// A first line naming any known column is a header, and then it must name
+// them all. Returns false only for an incomplete header.
+static bool readColumns(const char *data, size_t size, int *columns, int *width, bool *header)
+{
+    char buffer[CSV_MAX_LINE + CSV_MAX_FIELDS];
+    char *fields[CSV_MAX_FIELDS];
+    const char *newline = memchr(data, '\n', size);
+    size_t length = newline != NULL ? (size_t)(newline - data) : size;
+    if (length > 0 && data[length - 1] == '\r')
+        length--;
+
+    for (int c = 0; c < CSV_COLUMNS; c++)
+        columns[c] = -1;
+    int count = splitRow(data, length, buffer, fields);
+    for (int f = 0; f < count; f++)
+    {
+        for (int c = 0; c < CSV_COLUMNS; c++)
+        {
+            if (strcasecmp(fields[f], column_names[c]) == 0)
+                columns[c] = f;
+        }
+    }
+
+    *header = false;
+    for (int c = 0; c < CSV_COLUMNS; c++)
+        *header = *header || columns[c] >= 0;
+    if (!*header)
+    {
+        for (int c = 0; c < CSV_COLUMNS; c++)
+            columns[c] = c;
+        *width = CSV_COLUMNS;
+        return true;
+    }
+
+    *width = count;
+    for (int c = 0; c < CSV_COLUMNS; c++)
+    {
+        if (columns[c] < 0)
+        {
+            fprintf(stderr, "The header has no '%s' column\n", column_names[c]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Cuts [begin, end) into one run of whole lines per thread
+static void splitWindow(const char *begin, const char *end, Chunk_t *chunks, int threads)
+{
+    const char *pos = begin;
+    for (int t = 0; t < threads; t++)
+    {
+        const char *limit = t + 1 == threads ? end : pos + (end - pos) / (threads - t);
+        if (limit < end)
+        {
+            const char *newline = memchr(limit, '\n', end - limit);
+            limit = newline != NULL ? newline + 1 : end;
+        }
+        chunks[t].begin = pos;
+        chunks[t].end = limit;
+        chunks[t].lines = 0;
+        chunks[t].count = 0;
+        chunks[t].error_count = 0;
+        pos = limit;
+    }
+}
+
+static void parseWindow(Chunk_t *chunks, int threads)
+{
+    pthread_t ids[CSV_MAX_THREADS];
+    bool started[CSV_MAX_THREADS] = { false };
+    for (int t = 1; t < threads; t++)
+        started[t] = pthread_create(&ids[t], NULL, parseChunk, &chunks[t]) == 0;
+    parseChunk(&chunks[0]);
+    for (int t = 1; t < threads; t++)
+    {
+        if (started[t])
+            pthread_join(ids[t], NULL);
+        else
+            parseChunk(&chunks[t]);
+    }
+}
+
+// Ids and account numbers are handed out in file order, one thread at a
+// time. Rows whose PESEL an account or an earlier row already has are
+// refused by the store and reported here. Loaded rows are pending until
+// their group commits, and only then count as loaded.
+static bool loadChunk(const Chunk_t *chunk, unsigned long first_line, unsigned long *pending, unsigned long *loaded,
+                      unsigned long *skipped)
+{
+    char error_msg[BUFFER];
+    size_t e = 0;
+    *skipped += chunk->error_count;
+    for (size_t i = 0; i < chunk->count; i++)
+    {
+        Account_t *account = &chunk->accounts[i];
+        for (; e < chunk->error_count && chunk->errors[e].line < account->id; e++)
+            fprintf(stderr, "line %lu: %s\n", first_line + chunk->errors[e].line, chunk->errors[e].message);
+
+        unsigned long line = first_line + account->id;
+        account->id = storeLastID() + 1;
+        if (!generateIBAN(account))
+        {
+            fprintf(stderr, "No free account numbers left\n");
+            return false;
+        }
+        if (!storeLoad(account))
+        {
+            if (checkPESELUnique(account->pesel_number, error_msg))
+            {
+                fprintf(stderr, "Out of memory\n");
+                return false;
+            }
+            fprintf(stderr, "line %lu: %s\n", line, error_msg);
+            ++*skipped;
+            continue;
+        }
+        if (++*pending == CSV_LOAD_GROUP || storeLoadFull())
+        {
+            if (!storeLoadCommit())
+            {
+                fprintf(stderr, "Error writing to file\n");
+                *pending = 0;
+                return false;
+            }
+            *loaded += *pending;
+            *pending = 0;
+        }
+    }
+    for (; e < chunk->error_count; e++)
+        fprintf(stderr, "line %lu: %s\n", first_line + chunk->errors[e].line, chunk->errors[e].message);
+    return true;
+}
+
+int runImport(int argc, char *argv[])
+{
+    long threads = argc > 2 ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc < 2 || threads < 1 || (argc > 2 && threads > CSV_MAX_THREADS))
+    {
+        fprintf(stderr, "Usage: import FILE [THREADS (1-%d)]\n", CSV_MAX_THREADS);
+        return 1;
+    }
+    if (threads > CSV_MAX_THREADS)
+        threads = CSV_MAX_THREADS;
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+        fprintf(stderr, "Cannot open %s\n", argv[1]);
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    size_t size = (size_t)info.st_size;
+    const char *data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map %s\n", argv[1]);
+        return 1;
+    }
+    if (size == 0)
+    {
+        printf("Imported 0 accounts\n");
+        return 0;
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int columns[CSV_COLUMNS], width;
+    bool header;
+    if (!readColumns(data, size, columns, &width, &header) || !storeCommit())
+    {
+        munmap((void *)data, size);
+        return 1;
+    }
+
+    Chunk_t chunks[CSV_MAX_THREADS];
+    memset(chunks, 0, sizeof(chunks));
+    for (int t = 0; t < threads; t++)
+    {
+        chunks[t].columns = columns;
+        chunks[t].width = width;
+    }
+
+    const char *pos = data, *end = data + size;
+    unsigned long line = 0, pending = 0, loaded = 0, skipped = 0;
+    if (header)
+    {
+        const char *newline = memchr(data, '\n', size);
+        pos = newline != NULL ? newline + 1 : end;
+        line = 1;
+    }
+    bool ok = true;
+    while (ok && pos < end)
+    {
+        const char *limit = (size_t)(end - pos) > CSV_WINDOW ? pos + CSV_WINDOW : end;
+        const char *newline = limit < end ? memchr(limit, '\n', end - limit) : NULL;
+        if (limit < end)
+            limit = newline != NULL ? newline + 1 : end;
+
+        splitWindow(pos, limit, chunks, (int)threads);
+        parseWindow(chunks, (int)threads);
+        for (int t = 0; ok && t < threads; t++)
+        {
+            if (chunks[t].out_of_memory)
+            {
+                fprintf(stderr, "Out of memory\n");
+                ok = false;
+                break;
+            }
+            ok = loadChunk(&chunks[t], line, &pending, &loaded, &skipped);
+            line += chunks[t].lines;
+        }
+        pos = limit;
+    }
+    // A failed group is dropped whole; the groups before it stay imported
+    if (storeLoadCommit())
+    {
+        loaded += pending;
+    }
+    else
+    {
+        fprintf(stderr, "Error writing to file\n");
+        ok = false;
+    }
+
+    for (int t = 0; t < threads; t++)
+    {
+        free(chunks[t].accounts);
+        free(chunks[t].errors);
+    }
+    munmap((void *)data, size);
+    double seconds = elapsedSince(&start);
+    printf("Imported %lu accounts, skipped %lu lines, in %.3f s (%.0f rows/s)\n", loaded, skipped, seconds,
+           seconds > 0 ? (loaded + skipped) / seconds : 0.0);
+    return ok ? 0 : 1;
+}
+
+static void outputFlush(Output_t *out)
+{
+    const char *pos = out->data;
+    while (!out->failed && out->used > 0)
+    {
+        ssize_t put = write(out->fd, pos, out->used);
+        if (put <= 0)
+            out->failed = true;
+        else
+        {
+            pos += put;
+            out->used -= put;
+        }
+    }
+    out->used = 0;
+}
+
+static void outputText(Output_t *out, const char *text, size_t length)
+{
+    if (out->used + length > CSV_WRITE_BUFFER)
+        outputFlush(out);
+    memcpy(out->data + out->used, text, length);
+    out->used += length;
+}
+
+// Quotes the field only when it holds a separator or a quote
+static void outputField(Output_t *out, const char *text, char separator)
+{
+    if (strpbrk(text, ",\"") == NULL)
+    {
+        outputText(out, text, strlen(text));
+    }
+    else
+    {
+        outputText(out, "\"", 1);
+        for (const char *quote; (quote = strchr(text, '"')) != NULL; text = quote + 1)
+        {
+            outputText(out, text, quote - text + 1);
+            outputText(out, "\"", 1);
+        }
+        outputText(out, text, strlen(text));
+        outputText(out, "\"", 1);
+    }
+    outputText(out, &separator, 1);
+}
+
+int runExport(int argc, char *argv[])
+{
+    int fd = STDOUT_FILENO;
+    if (argc > 1 && strcmp(argv[1], "-") != 0)
+    {
+        fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            fprintf(stderr, "Cannot open %s\n", argv[1]);
+            return 1;
+        }
+    }
+    Output_t out = { fd, malloc(CSV_WRITE_BUFFER), 0, false };
+    if (out.data == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        if (fd != STDOUT_FILENO)
+            close(fd);
+        return 1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    static const char header[] = "id,account_number,first_name,last_name,pesel,address,balance,debt\n";
+    outputText(&out, header, sizeof(header) - 1);
+
+    uint32_t exported = 0;
+    char number[MONEY_BUFFER];
+    storeLock();
+    for (uint32_t slot = 0; slot < storeSlots() && !out.failed; slot++)
+    {
+        const AccountHot_t *hot = storeHot(slot);
+        const AccountCold_t *cold = storeCold(slot);
+        if (hot == NULL)
+            continue;
+        snprintf(number, sizeof(number), "%u", hot->id);
+        outputField(&out, number, ',');
+        outputField(&out, cold->account_number, ',');
+        outputField(&out, cold->first_name, ',');
+        outputField(&out, cold->last_name, ',');
+        outputField(&out, cold->pesel_number, ',');
+        outputField(&out, cold->address, ',');
+        formatMoney(hot->balance, number);
+        outputField(&out, number, ',');
+        formatMoney(hot->debt, number);
+        outputField(&out, number, '\n');
+        exported++;
+    }
+    storeUnlock();
+    outputFlush(&out);
+    free(out.data);
+
+    bool ok = !out.failed && (fd == STDOUT_FILENO || fdatasync(fd) == 0);
+    if (fd != STDOUT_FILENO && close(fd) != 0)
+        ok = false;
+    if (!ok)
+        fprintf(stderr, "Error writing the export\n");
+    else
+        fprintf(stderr, "Exported %u accounts in %.3f s\n", exported, elapsedSince(&start));
+    return ok ? 0 : 1;
+}
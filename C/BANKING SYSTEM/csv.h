@@ -0,0 +1,20 @@
+#pragma once
+
+// Bulk transfer of accounts as CSV, one account per line, fields separated
+// by ',' and quoted with '"' when they hold a comma or a quote (a quoted
+// field cannot span lines).
+//
+// import FILE [THREADS] maps FILE and parses it in parallel chunks. If the
+// first line names the columns, they are matched by name and unknown ones
+// are ignored; otherwise the columns are
+//   first_name,last_name,pesel,address,balance,debt
+// Every row is checked like a created account, gets the next id and a fresh
+// account number, and reaches the files in large sequential writes. Bad
+// rows, and rows with a PESEL an account or an earlier row already has,
+// are reported with their line numbers and skipped.
+int runImport(int argc, char *argv[]);
+
+// export [FILE] writes every account to FILE (stdout by default) as
+//   id,account_number,first_name,last_name,pesel,address,balance,debt
+// with that header line, so an export can be imported elsewhere.
+int runExport(int argc, char *argv[]);
@@ -0,0 +1,52 @@
+#include "histogram.h"
+
+static uint32_t bucketOf(uint64_t value)
+{
+    if (value < (1u << HISTOGRAM_SUB_BITS))
+        return (uint32_t)value;
+    uint32_t shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (shift << HISTOGRAM_SUB_BITS) + (uint32_t)(value >> shift);
+}
+
+void histogramRecord(Histogram_t *histogram, uint64_t value)
+{
+    atomic_fetch_add_explicit(&histogram->counts[bucketOf(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+    uint_fast64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (value > max &&
+           !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value, memory_order_relaxed,
+                                                  memory_order_relaxed))
+        ;
+}
+
+uint64_t histogramBucketLimit(uint32_t bucket)
+{
+    if (bucket < (1u << HISTOGRAM_SUB_BITS))
+        return bucket;
+    uint32_t shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t mantissa = bucket - ((uint64_t)shift << HISTOGRAM_SUB_BITS);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+uint64_t histogramPercentile(const Histogram_t *histogram, double percentile)
+{
+    uint64_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    if (count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(percentile / 100.0 * count + 0.999999);
+    if (rank == 0)
+        rank = 1;
+
+    uint64_t seen = 0, max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    for (uint32_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+    {
+        seen += atomic_load_explicit(&histogram->counts[bucket], memory_order_relaxed);
+        if (seen >= rank)
+        {
+            uint64_t limit = histogramBucketLimit(bucket);
+            return limit < max ? limit : max;
+        }
+    }
+    return max;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Log-linear histogram in the style of HdrHistogram, for latencies in
+// nanoseconds. Values below 2^HISTOGRAM_SUB_BITS get a bucket each; larger
+// ones share a bucket with the values that agree in their top
+// HISTOGRAM_SUB_BITS + 1 bits, so a bucket is at most about 3% wide.
+// Recording is a few relaxed atomic adds, threads may share a histogram.
+// A zeroed histogram is empty.
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_BUCKETS ((65 - HISTOGRAM_SUB_BITS) << HISTOGRAM_SUB_BITS)
+
+typedef struct
+{
+    atomic_uint_fast64_t counts[HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+} Histogram_t;
+
+void histogramRecord(Histogram_t *histogram, uint64_t value);
+// The largest value that falls into bucket
+uint64_t histogramBucketLimit(uint32_t bucket);
+// The value below which percentile percent of the recorded values fall,
+// rounded up to its bucket limit; 0 when nothing was recorded
+uint64_t histogramPercentile(const Histogram_t *histogram, double percentile);
@@ -0,0 +1,188 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bank.h"
+#include "ibanset.h"
+#include "util.h"
+
+#define IBAN_HASH_MIN_CAPACITY 1024
+#define IBAN_BITSET_WORDS ((IBAN_SPACE + 63) / 64)
+
+typedef struct
+{
+    uint32_t *keys;
+    uint32_t capacity;
+    uint32_t count;
+    uint64_t *bits;
+} IbanSet_t;
+
+typedef struct
+{
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t bitset;
+    uint32_t reserved;
+} IbanSetHeader_t;
+
+static IbanSet_t set;
+
+static bool ibanValue(const char *iban, uint32_t *value)
+{
+    uint32_t result = 0;
+    for (int i = 0; i < IBAN_LENGTH; i++)
+    {
+        if (!isdigit((unsigned char)iban[i]))
+            return false;
+        result = result * 10 + (iban[i] - '0');
+    }
+    if (iban[IBAN_LENGTH] != '\0')
+        return false;
+    *value = result;
+    return true;
+}
+
+// Hash keys are stored as value + 1 so that 0 marks an empty bucket
+static uint32_t *probe(uint32_t *keys, uint32_t capacity, uint32_t key)
+{
+    uint32_t pos = (key * 2654435761u) & (capacity - 1);
+    while (keys[pos] != 0 && keys[pos] != key)
+        pos = (pos + 1) & (capacity - 1);
+    return &keys[pos];
+}
+
+static bool toBitset()
+{
+    uint64_t *bits = calloc(IBAN_BITSET_WORDS, sizeof(uint64_t));
+    if (bits == NULL)
+        return false;
+    for (uint32_t i = 0; i < set.capacity; i++)
+    {
+        if (set.keys[i] != 0)
+        {
+            uint32_t value = set.keys[i] - 1;
+            bits[value / 64] |= (uint64_t)1 << (value % 64);
+        }
+    }
+    free(set.keys);
+    set.keys = NULL;
+    set.capacity = 0;
+    set.bits = bits;
+    return true;
+}
+
+static bool grow()
+{
+    uint32_t new_capacity = set.capacity ? set.capacity * 2 : IBAN_HASH_MIN_CAPACITY;
+    if ((uint64_t)new_capacity * sizeof(uint32_t) >= IBAN_BITSET_WORDS * sizeof(uint64_t))
+        return toBitset();
+
+    uint32_t *keys = calloc(new_capacity, sizeof(uint32_t));
+    if (keys == NULL)
+        return false;
+    for (uint32_t i = 0; i < set.capacity; i++)
+    {
+        if (set.keys[i] != 0)
+            *probe(keys, new_capacity, set.keys[i]) = set.keys[i];
+    }
+    free(set.keys);
+    set.keys = keys;
+    set.capacity = new_capacity;
+    return true;
+}
+
+// Makes room for one more number, so the following ibanSetAdd cannot fail
+bool ibanSetReserve()
+{
+    if (set.bits != NULL || (set.count + 1) * 2 <= set.capacity)
+        return true;
+    return grow();
+}
+
+bool ibanSetAdd(const char *iban)
+{
+    uint32_t value;
+    if (!ibanValue(iban, &value))
+        return true;
+    if (!ibanSetReserve())
+        return false;
+
+    if (set.bits != NULL)
+    {
+        uint64_t mask = (uint64_t)1 << (value % 64);
+        if (!(set.bits[value / 64] & mask))
+            set.count++;
+        set.bits[value / 64] |= mask;
+        return true;
+    }
+
+    uint32_t *bucket = probe(set.keys, set.capacity, value + 1);
+    if (*bucket == 0)
+        set.count++;
+    *bucket = value + 1;
+    return true;
+}
+
+bool ibanSetContains(const char *iban)
+{
+    uint32_t value;
+    if (!ibanValue(iban, &value))
+        return false;
+    if (set.bits != NULL)
+        return (set.bits[value / 64] >> (value % 64)) & 1;
+    if (set.capacity == 0)
+        return false;
+    return *probe(set.keys, set.capacity, value + 1) != 0;
+}
+
+uint32_t ibanSetCount()
+{
+    return set.count;
+}
+
+void ibanSetFree()
+{
+    free(set.keys);
+    free(set.bits);
+    memset(&set, 0, sizeof(set));
+}
+
+bool ibanSetSave(int fd)
+{
+    IbanSetHeader_t header = { set.capacity, set.count, set.bits != NULL, 0 };
+    if (!writeFully(fd, &header, sizeof(header)))
+        return false;
+    if (set.bits != NULL)
+        return writeFully(fd, set.bits, IBAN_BITSET_WORDS * sizeof(uint64_t));
+    return writeFully(fd, set.keys, (size_t)set.capacity * sizeof(uint32_t));
+}
+
+bool ibanSetLoad(int fd)
+{
+    IbanSetHeader_t header;
+    ibanSetFree();
+    if (!readFully(fd, &header, sizeof(header)) || header.bitset > 1 ||
+        (header.capacity & (header.capacity - 1)) != 0 || (!header.bitset && header.count * 2 > header.capacity) ||
+        (header.bitset && header.capacity != 0))
+        return false;
+
+    bool ok;
+    if (header.bitset)
+    {
+        set.bits = malloc(IBAN_BITSET_WORDS * sizeof(uint64_t));
+        ok = set.bits != NULL && readFully(fd, set.bits, IBAN_BITSET_WORDS * sizeof(uint64_t));
+    }
+    else
+    {
+        set.keys = malloc(header.capacity ? (size_t)header.capacity * sizeof(uint32_t) : 1);
+        ok = set.keys != NULL && readFully(fd, set.keys, (size_t)header.capacity * sizeof(uint32_t));
+    }
+    if (!ok)
+    {
+        ibanSetFree();
+        return false;
+    }
+    set.capacity = header.capacity;
+    set.count = header.count;
+    return true;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Set of the account numbers in use, for constant-time uniqueness checks
+// when a new one is drawn. Small stores use a hash set; once that would
+// outgrow a bitset over the whole 10^8 number space (12.5 MB) the set
+// switches to the bitset.
+#define IBAN_SPACE 100000000u
+
+bool ibanSetReserve();
+bool ibanSetAdd(const char *iban);
+bool ibanSetContains(const char *iban);
+uint32_t ibanSetCount();
+void ibanSetFree();
+
+// The whole set as one block at the descriptor's position, for snapshots.
+// Saving makes nothing but write calls, so a child forked from a threaded
+// process may do it; loading replaces the set
+bool ibanSetSave(int fd);
+bool ibanSetLoad(int fd);
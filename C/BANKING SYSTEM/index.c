@@ -0,0 +1,884 @@
+#include <ctype.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bank.h"
+#include "index.h"
+#include "metrics.h"
+#include "store.h"
+#include "trigram.h"
+
+#define INDEX_MAGIC 0x58444E49u
+#define INDEX_VERSION 4
+#define INDEX_DELTA_MAX 4096
+#define HASH_MIN_CAPACITY 1024
+#define PESEL_SHARED_MAX 64
+// Names per front-coded block, each block starting with a whole name
+#define NAME_BLOCK 16
+
+// Slots sorted by (name, slot). New slots go to a small sorted delta that
+// is merged into the main array once it fills up, so appends stay cheap.
+//
+// The distinct names of the sorted array are kept front coded: each is
+// stored as the length it shares with the name before it (0 at the start
+// of a block), the length of the rest and the rest itself. Each name also
+// has the position of its first slot in sorted, so the slots of a name or
+// of a whole prefix are found from the names alone, a binary search over
+// the blocks and a short decode, without reading the records. With names
+// repeating as much as they do, that costs a few bytes per account on top
+// of the slot itself.
+typedef struct
+{
+    size_t offset;
+    uint32_t *sorted;
+    size_t count;
+    uint32_t *delta;
+    size_t delta_count;
+    unsigned char *names;
+    size_t names_size;
+    size_t names_count;
+    // names_count + 1 entries, the last being count
+    uint32_t *starts;
+    // Where each block starts in names
+    uint32_t *blocks;
+} NameIndex_t;
+
+// Decodes the names of a NameIndex_t one after another
+typedef struct
+{
+    const NameIndex_t *index;
+    // The name held in text, and where the next one starts
+    size_t name;
+    size_t next;
+    Fixed_string text;
+} NameCursor_t;
+
+typedef struct
+{
+    uint64_t key;
+    uint32_t slot;
+    uint32_t reserved;
+} DigitEntry_t;
+
+// Open-addressing multimap from a digit string (stored as its value + 1, so
+// that 0 marks an empty bucket) to slots
+typedef struct
+{
+    size_t offset;
+    size_t length;
+    DigitEntry_t *entries;
+    uint32_t capacity;
+    uint32_t used;
+} DigitIndex_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t covered;
+    uint64_t fingerprint;
+    uint64_t first_name_count;
+    uint64_t last_name_count;
+    uint64_t first_name_names;
+    uint64_t first_name_bytes;
+    uint64_t last_name_names;
+    uint64_t last_name_bytes;
+    uint32_t iban_capacity;
+    uint32_t reserved;
+} IndexHeader_t;
+
+typedef struct
+{
+    char *path;
+    uint32_t covered;
+    // The file holds the indexes as they are, so closing need not rewrite it
+    bool saved;
+    NameIndex_t first_name;
+    NameIndex_t last_name;
+    DigitIndex_t iban;
+} Indexes_t;
+
+static Indexes_t indexes = {
+    .first_name = { .offset = offsetof(AccountCold_t, first_name) },
+    .last_name = { .offset = offsetof(AccountCold_t, last_name) },
+    .iban = { .offset = offsetof(AccountCold_t, account_number), .length = IBAN_LENGTH },
+};
+
+bool slotListAppend(SlotList_t *list, uint32_t slot)
+{
+    if (list->count == list->capacity)
+    {
+        size_t new_capacity = list->capacity ? list->capacity * 2 : 64;
+        uint32_t *slots = realloc(list->slots, new_capacity * sizeof(uint32_t));
+        if (slots == NULL)
+            return false;
+        list->slots = slots;
+        list->capacity = new_capacity;
+    }
+    list->slots[list->count++] = slot;
+    return true;
+}
+
+void slotListFree(SlotList_t *list)
+{
+    free(list->slots);
+    memset(list, 0, sizeof(SlotList_t));
+}
+
+static const char *fieldOf(uint32_t slot, size_t offset)
+{
+    const AccountCold_t *account = storeCold(slot);
+    return account != NULL ? (const char *)account + offset : "";
+}
+
+// Name indexes
+
+static int compareSlots(const NameIndex_t *index, uint32_t a, uint32_t b)
+{
+    int order = strcmp(fieldOf(a, index->offset), fieldOf(b, index->offset));
+    if (order != 0)
+        return order;
+    return (a > b) - (a < b);
+}
+
+static const NameIndex_t *sorting;
+
+static int compareForSort(const void *a, const void *b)
+{
+    return compareSlots(sorting, *(const uint32_t *)a, *(const uint32_t *)b);
+}
+
+static void sortSlots(NameIndex_t *index, uint32_t *slots, size_t count)
+{
+    sorting = index;
+    qsort(slots, count, sizeof(uint32_t), compareForSort);
+}
+
+// Distinct names
+
+static bool appendName(NameIndex_t *index, size_t *capacity, const char *name, const char *previous)
+{
+    size_t shared = 0, length = strlen(name);
+    if (index->names_count % NAME_BLOCK != 0)
+        while (shared < length && name[shared] == previous[shared])
+            shared++;
+    if (index->names_size + 2 + length - shared > *capacity)
+    {
+        size_t new_capacity = *capacity ? *capacity * 2 : 4096;
+        unsigned char *names = realloc(index->names, new_capacity);
+        if (names == NULL)
+            return false;
+        index->names = names;
+        *capacity = new_capacity;
+    }
+    unsigned char *pos = index->names + index->names_size;
+    pos[0] = (unsigned char)shared;
+    pos[1] = (unsigned char)(length - shared);
+    memcpy(pos + 2, name + shared, length - shared);
+    index->names_size += 2 + length - shared;
+    return true;
+}
+
+// Finds where the blocks start, checking that the names decode within
+// their buffer, as they may come from a file
+static bool findBlocks(NameIndex_t *index)
+{
+    free(index->blocks);
+    index->blocks = malloc(((index->names_count + NAME_BLOCK - 1) / NAME_BLOCK + 1) * sizeof(uint32_t));
+    if (index->blocks == NULL)
+        return false;
+    size_t pos = 0, length = 0;
+    for (size_t name = 0; name < index->names_count; name++)
+    {
+        if (name % NAME_BLOCK == 0)
+            index->blocks[name / NAME_BLOCK] = (uint32_t)pos;
+        if (pos + 2 > index->names_size || index->names[pos] > (name % NAME_BLOCK ? length : 0))
+            return false;
+        length = index->names[pos] + index->names[pos + 1];
+        pos += 2 + index->names[pos + 1];
+        if (pos > index->names_size || length >= CHARBUFFER)
+            return false;
+    }
+    return pos == index->names_size && index->starts[index->names_count] == index->count;
+}
+
+// Rebuilds the names from the sorted array, after it changed
+static bool buildNames(NameIndex_t *index)
+{
+    size_t capacity = index->names_size = 0;
+    index->names_count = 0;
+    free(index->starts);
+    index->starts = malloc((index->count + 1) * sizeof(uint32_t));
+    if (index->starts == NULL)
+        return false;
+    const char *previous = "";
+    for (size_t i = 0; i < index->count; i++)
+    {
+        const char *name = fieldOf(index->sorted[i], index->offset);
+        if (i > 0 && strcmp(name, previous) == 0)
+            continue;
+        if (!appendName(index, &capacity, name, previous))
+        {
+            // Without names the sorted slots cannot be found, so lookups
+            // come back empty rather than wrong
+            index->names_count = index->names_size = 0;
+            return false;
+        }
+        index->starts[index->names_count++] = (uint32_t)i;
+        previous = name;
+    }
+    index->starts[index->names_count] = (uint32_t)index->count;
+    // Keeps the starts only as long as needed
+    uint32_t *starts = realloc(index->starts, (index->names_count + 1) * sizeof(uint32_t));
+    if (starts != NULL)
+        index->starts = starts;
+    return findBlocks(index);
+}
+
+static void cursorSeek(NameCursor_t *cursor, const NameIndex_t *index, size_t block)
+{
+    cursor->index = index;
+    cursor->name = block * NAME_BLOCK - 1;
+    cursor->next = block * NAME_BLOCK < index->names_count ? index->blocks[block] : index->names_size;
+    cursor->text[0] = '\0';
+}
+
+// Moves to the next name; false past the last
+static bool cursorNext(NameCursor_t *cursor)
+{
+    const NameIndex_t *index = cursor->index;
+    if (cursor->name + 1 >= index->names_count)
+    {
+        cursor->name = index->names_count;
+        return false;
+    }
+    const unsigned char *pos = index->names + cursor->next;
+    memcpy(cursor->text + pos[0], pos + 2, pos[1]);
+    cursor->text[pos[0] + pos[1]] = '\0';
+    cursor->next += 2 + pos[1];
+    cursor->name++;
+    return true;
+}
+
+// The first name not below key, left in cursor; names_count when none is
+static size_t namesLowerBound(const NameIndex_t *index, const char *key, NameCursor_t *cursor)
+{
+    size_t low = 0, high = (index->names_count + NAME_BLOCK - 1) / NAME_BLOCK, length = strlen(key);
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        const unsigned char *head = index->names + index->blocks[mid];
+        int order = memcmp(head + 2, key, head[1] < length ? head[1] : length);
+        if (order < 0 || (order == 0 && head[1] < length))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    // Only the block before the first one whose head is not below key can
+    // hold names below it
+    cursorSeek(cursor, index, low > 0 ? low - 1 : 0);
+    while (cursorNext(cursor) && strcmp(cursor->text, key) < 0)
+        ;
+    return cursor->name;
+}
+
+// The names that are key, or start with it, as the range [*first, *end)
+// of names
+static void namesRange(const NameIndex_t *index, const char *key, bool prefix, size_t *first, size_t *end)
+{
+    NameCursor_t cursor;
+    *first = namesLowerBound(index, key, &cursor);
+    if (!prefix)
+    {
+        *end = *first + (*first < index->names_count && strcmp(cursor.text, key) == 0);
+        return;
+    }
+
+    // The first name past the prefix is the lower bound of the smallest
+    // string above every name starting with it
+    Fixed_string above;
+    size_t length = snprintf(above, sizeof(above), "%s", key);
+    while (length > 0 && (unsigned char)above[length - 1] == 0xFF)
+        length--;
+    if (length == 0)
+    {
+        *end = index->names_count;
+        return;
+    }
+    above[length - 1]++;
+    above[length] = '\0';
+    *end = namesLowerBound(index, above, &cursor);
+}
+
+static bool mergeInto(NameIndex_t *index, const uint32_t *slots, size_t count)
+{
+    uint32_t *merged = malloc((index->count + count + 1) * sizeof(uint32_t));
+    if (merged == NULL)
+        return false;
+
+    size_t i = 0, j = 0, k = 0;
+    while (i < index->count && j < count)
+        merged[k++] = compareSlots(index, index->sorted[i], slots[j]) <= 0 ? index->sorted[i++] : slots[j++];
+    while (i < index->count)
+        merged[k++] = index->sorted[i++];
+    while (j < count)
+        merged[k++] = slots[j++];
+
+    free(index->sorted);
+    index->sorted = merged;
+    index->count = k;
+    return buildNames(index);
+}
+
+static bool flushDelta(NameIndex_t *index)
+{
+    if (index->delta_count == 0)
+        return true;
+    if (!mergeInto(index, index->delta, index->delta_count))
+        return false;
+    index->delta_count = 0;
+    return true;
+}
+
+// First position in slots[0, count) whose name is not below key
+static size_t lowerBound(const NameIndex_t *index, const uint32_t *slots, size_t count, const char *key)
+{
+    size_t low = 0, high = count;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (strcmp(fieldOf(slots[mid], index->offset), key) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+static bool nameInsert(NameIndex_t *index, uint32_t slot)
+{
+    if (index->delta == NULL)
+    {
+        index->delta = malloc(INDEX_DELTA_MAX * sizeof(uint32_t));
+        if (index->delta == NULL)
+            return false;
+    }
+    if (index->delta_count == INDEX_DELTA_MAX && !flushDelta(index))
+        return false;
+
+    size_t low = 0, high = index->delta_count;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (compareSlots(index, index->delta[mid], slot) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    memmove(&index->delta[low + 1], &index->delta[low], (index->delta_count - low) * sizeof(uint32_t));
+    index->delta[low] = slot;
+    index->delta_count++;
+    return true;
+}
+
+static bool nameInsertMany(NameIndex_t *index, uint32_t *slots, size_t count)
+{
+    if (count <= INDEX_DELTA_MAX - index->delta_count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!nameInsert(index, slots[i]))
+                return false;
+        }
+        return true;
+    }
+    sortSlots(index, slots, count);
+    return flushDelta(index) && mergeInto(index, slots, count);
+}
+
+static bool matchesName(const char *name, const char *key, size_t length, bool prefix)
+{
+    return prefix ? strncmp(name, key, length) == 0 : strcmp(name, key) == 0;
+}
+
+// The positions in sorted of the slots whose name is key or starts with it
+static void slotsRange(const NameIndex_t *index, const char *key, bool prefix, size_t *first, size_t *end)
+{
+    size_t first_name, end_name;
+    namesRange(index, key, prefix, &first_name, &end_name);
+    *first = first_name < index->names_count ? index->starts[first_name] : index->count;
+    *end = end_name < index->names_count ? index->starts[end_name] : index->count;
+    if (index->names_count == 0)
+        *first = *end = 0;
+}
+
+// How many slots of sorted[first, end) come before the delta's slot
+static size_t rankInRange(const NameIndex_t *index, size_t first, size_t end, uint32_t slot)
+{
+    size_t low = first, high = end;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (compareSlots(index, index->sorted[mid], slot) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low - first;
+}
+
+// Collects up to limit matches from position offset of the name order,
+// merging the sorted range with the delta's matches, and counts them all.
+// Only the delta is searched by reading records.
+static bool namePage(const NameIndex_t *index, const char *key, bool prefix, size_t offset, size_t limit,
+                     SlotList_t *matches, size_t *total)
+{
+    size_t length = strlen(key), first, end;
+    slotsRange(index, key, prefix, &first, &end);
+    size_t delta_first = lowerBound(index, index->delta, index->delta_count, key), delta_end = delta_first;
+    while (delta_end < index->delta_count &&
+           matchesName(fieldOf(index->delta[delta_end], index->offset), key, length, prefix))
+        delta_end++;
+    *total = (end - first) + (delta_end - delta_first);
+
+    // A delta match sits at its rank in the range plus the delta matches
+    // before it, which only grows along the delta, so the first one at or
+    // past offset is found by bisection
+    size_t low = delta_first, high = delta_end;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (rankInRange(index, first, end, index->delta[mid]) + (mid - delta_first) < offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    size_t j = low, i = offset < *total ? first + offset - (j - delta_first) : end;
+    for (size_t taken = 0; taken < limit && (i < end || j < delta_end); taken++)
+    {
+        bool from_delta = j < delta_end && (i >= end || compareSlots(index, index->delta[j], index->sorted[i]) < 0);
+        if (!slotListAppend(matches, from_delta ? index->delta[j++] : index->sorted[i++]))
+            return false;
+    }
+    return true;
+}
+
+static bool nameLookup(const NameIndex_t *index, const char *key, bool prefix, SlotList_t *matches)
+{
+    size_t total;
+    return namePage(index, key, prefix, 0, SIZE_MAX, matches, &total);
+}
+
+// The first limit distinct names starting with prefix and their counts.
+// The delta's names are merged into those of the sorted range, which can
+// only push later ones out.
+static bool nameCompletions(const NameIndex_t *index, const char *prefix, NameCount_t *names, size_t limit,
+                            size_t *found)
+{
+    size_t first, end;
+    NameCursor_t cursor;
+    namesRange(index, prefix, true, &first, &end);
+    *found = 0;
+    if (first < end)
+    {
+        namesLowerBound(index, prefix, &cursor);
+        do
+        {
+            snprintf(names[*found].name, sizeof(names[*found].name), "%s", cursor.text);
+            names[*found].count = index->starts[cursor.name + 1] - index->starts[cursor.name];
+            (*found)++;
+        } while (*found < limit && cursor.name + 1 < end && cursorNext(&cursor));
+    }
+
+    size_t length = strlen(prefix);
+    for (size_t j = lowerBound(index, index->delta, index->delta_count, prefix);
+         j < index->delta_count && matchesName(fieldOf(index->delta[j], index->offset), prefix, length, true); j++)
+    {
+        const char *name = fieldOf(index->delta[j], index->offset);
+        size_t at = 0;
+        while (at < *found && strcmp(names[at].name, name) < 0)
+            at++;
+        if (at < *found && strcmp(names[at].name, name) == 0)
+        {
+            names[at].count++;
+            continue;
+        }
+        if (at == limit)
+            continue;
+        if (*found == limit)
+            (*found)--;
+        memmove(&names[at + 1], &names[at], (*found - at) * sizeof(NameCount_t));
+        snprintf(names[at].name, sizeof(names[at].name), "%s", name);
+        names[at].count = 1;
+        (*found)++;
+    }
+    return true;
+}
+
+static bool nameSearch(const NameIndex_t *index, const char *key, SlotList_t *matches)
+{
+    size_t length = strlen(key);
+    if (key[0] == '=')
+        return nameLookup(index, key + 1, false, matches);
+    if (length > 0 && key[length - 1] == '*')
+    {
+        Fixed_string prefix;
+        snprintf(prefix, sizeof(prefix), "%.*s", (int)(length - 1), key);
+        return nameLookup(index, prefix, true, matches);
+    }
+    return false;
+}
+
+static void nameFree(NameIndex_t *index)
+{
+    free(index->sorted);
+    free(index->delta);
+    free(index->names);
+    free(index->starts);
+    free(index->blocks);
+    index->sorted = index->delta = index->starts = index->blocks = NULL;
+    index->names = NULL;
+    index->count = index->delta_count = index->names_size = index->names_count = 0;
+}
+
+// Digit indexes
+
+static bool digitKey(const char *text, size_t length, uint64_t *key)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (!isdigit((unsigned char)text[i]))
+            return false;
+        value = value * 10 + (text[i] - '0');
+    }
+    if (text[length] != '\0')
+        return false;
+    *key = value + 1;
+    return true;
+}
+
+static uint32_t digitBucket(const DigitIndex_t *index, uint64_t key)
+{
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (index->capacity - 1);
+}
+
+static void digitPlace(DigitIndex_t *index, uint64_t key, uint32_t slot)
+{
+    uint32_t pos = digitBucket(index, key);
+    while (index->entries[pos].key != 0)
+        pos = (pos + 1) & (index->capacity - 1);
+    index->entries[pos].key = key;
+    index->entries[pos].slot = slot;
+}
+
+static bool digitGrow(DigitIndex_t *index)
+{
+    DigitIndex_t grown = *index;
+    grown.capacity = index->capacity ? index->capacity * 2 : HASH_MIN_CAPACITY;
+    grown.entries = calloc(grown.capacity, sizeof(DigitEntry_t));
+    if (grown.entries == NULL)
+        return false;
+    for (uint32_t i = 0; i < index->capacity; i++)
+    {
+        if (index->entries[i].key != 0)
+            digitPlace(&grown, index->entries[i].key, index->entries[i].slot);
+    }
+    free(index->entries);
+    *index = grown;
+    return true;
+}
+
+static bool digitInsert(DigitIndex_t *index, uint32_t slot)
+{
+    uint64_t key;
+    if (!digitKey(fieldOf(slot, index->offset), index->length, &key))
+        return true;
+    if ((index->used + 1) * 2 > index->capacity && !digitGrow(index))
+        return false;
+    digitPlace(index, key, slot);
+    index->used++;
+    return true;
+}
+
+static bool digitSearch(const DigitIndex_t *index, const char *key, SlotList_t *matches)
+{
+    uint64_t wanted;
+    if (!digitKey(key, index->length, &wanted))
+        return false;
+    if (index->capacity == 0)
+        return true;
+
+    for (uint32_t pos = digitBucket(index, wanted); index->entries[pos].key != 0; pos = (pos + 1) & (index->capacity - 1))
+    {
+        if (index->entries[pos].key == wanted && !slotListAppend(matches, index->entries[pos].slot))
+            return false;
+    }
+    return true;
+}
+
+// The store's own map answers PESELs, accounts not yet synced included.
+// Only stores from before PESELs were unique have more than a few sharing one.
+static bool peselSearch(const char *key, SlotList_t *matches)
+{
+    uint32_t slots[PESEL_SHARED_MAX];
+    uint64_t value;
+    if (!digitKey(key, PESEL_LENGTH, &value))
+        return false;
+    uint32_t found = storeFindPESEL(key, slots, PESEL_SHARED_MAX);
+    if (found > PESEL_SHARED_MAX)
+        return false;
+    for (uint32_t i = 0; i < found; i++)
+    {
+        if (!slotListAppend(matches, slots[i]))
+            return false;
+    }
+    return true;
+}
+
+static void digitFree(DigitIndex_t *index)
+{
+    free(index->entries);
+    index->entries = NULL;
+    index->capacity = index->used = 0;
+}
+
+// Whole set
+
+// Indexes every committed record appended since the last call
+static bool indexSync()
+{
+    uint32_t end = storeCommittedSlots();
+    if (indexes.covered >= end)
+        return true;
+
+    SlotList_t added = { 0 };
+    for (uint32_t slot = indexes.covered; slot < end; slot++)
+    {
+        if (storeHot(slot) != NULL && !slotListAppend(&added, slot))
+        {
+            slotListFree(&added);
+            return false;
+        }
+    }
+
+    bool ok = nameInsertMany(&indexes.first_name, added.slots, added.count) &&
+              nameInsertMany(&indexes.last_name, added.slots, added.count);
+    for (size_t i = 0; ok && i < added.count; i++)
+        ok = digitInsert(&indexes.iban, added.slots[i]);
+    slotListFree(&added);
+
+    if (ok)
+    {
+        indexes.covered = end;
+        indexes.saved = false;
+    }
+    return ok;
+}
+
+static void freeIndexes()
+{
+    nameFree(&indexes.first_name);
+    nameFree(&indexes.last_name);
+    digitFree(&indexes.iban);
+    indexes.covered = 0;
+    indexes.saved = false;
+}
+
+static bool readArray(FILE *file, void **array, size_t count, size_t size)
+{
+    *array = malloc(count ? count * size : 1);
+    if (*array == NULL || fread(*array, size, count, file) != count)
+        return false;
+    metricRead(METRIC_INDEX_OPEN, count * size);
+    return true;
+}
+
+static bool loadIndexes(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+
+    IndexHeader_t header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+              header.magic == INDEX_MAGIC && header.version == INDEX_VERSION &&
+              header.record_size == sizeof(Account_t) && header.covered <= storeCommittedSlots() &&
+              header.fingerprint == storeFingerprint(header.covered);
+    if (ok)
+        metricRead(METRIC_INDEX_OPEN, sizeof(header));
+
+    ok = ok && readArray(file, (void **)&indexes.first_name.sorted, header.first_name_count, sizeof(uint32_t)) &&
+         readArray(file, (void **)&indexes.last_name.sorted, header.last_name_count, sizeof(uint32_t)) &&
+         readArray(file, (void **)&indexes.iban.entries, header.iban_capacity, sizeof(DigitEntry_t)) &&
+         readArray(file, (void **)&indexes.first_name.names, header.first_name_bytes, 1) &&
+         readArray(file, (void **)&indexes.first_name.starts, header.first_name_names + 1, sizeof(uint32_t)) &&
+         readArray(file, (void **)&indexes.last_name.names, header.last_name_bytes, 1) &&
+         readArray(file, (void **)&indexes.last_name.starts, header.last_name_names + 1, sizeof(uint32_t));
+    fclose(file);
+
+    indexes.first_name.count = header.first_name_count;
+    indexes.last_name.count = header.last_name_count;
+    indexes.first_name.names_size = header.first_name_bytes;
+    indexes.first_name.names_count = header.first_name_names;
+    indexes.last_name.names_size = header.last_name_bytes;
+    indexes.last_name.names_count = header.last_name_names;
+    ok = ok && findBlocks(&indexes.first_name) && findBlocks(&indexes.last_name);
+    if (!ok)
+    {
+        freeIndexes();
+        return false;
+    }
+
+    indexes.covered = header.covered;
+    indexes.saved = true;
+    indexes.iban.capacity = header.iban_capacity;
+    for (uint32_t i = 0; i < indexes.iban.capacity; i++)
+        indexes.iban.used += indexes.iban.entries[i].key != 0;
+    return true;
+}
+
+bool indexOpen(const char *path)
+{
+    indexes.path = strdup(path);
+    if (indexes.path == NULL)
+        return false;
+
+    // A missing or foreign index file is rebuilt from the store; a stale one
+    // only needs the records appended after it was saved
+    uint64_t start = metricStart();
+    loadIndexes(path);
+    bool synced = indexSync();
+    metricEnd(METRIC_INDEX_OPEN, start, synced);
+    return synced;
+}
+
+static bool writeNames(const NameIndex_t *index, FILE *file)
+{
+    size_t starts = index->names_count + 1;
+    uint32_t none = 0;
+    return fwrite(index->names, 1, index->names_size, file) == index->names_size &&
+           (index->starts != NULL ? fwrite(index->starts, sizeof(uint32_t), starts, file) == starts
+                                  : fwrite(&none, sizeof(none), 1, file) == 1);
+}
+
+static bool saveIndexes()
+{
+    if (!indexSync())
+        return false;
+    if (indexes.saved)
+        return true;
+    if (!flushDelta(&indexes.first_name) || !flushDelta(&indexes.last_name))
+        return false;
+
+    char tmp_path[BUFFER];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", indexes.path);
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL)
+        return false;
+
+    IndexHeader_t header = {
+        INDEX_MAGIC, INDEX_VERSION, sizeof(Account_t), indexes.covered, storeFingerprint(indexes.covered),
+        indexes.first_name.count, indexes.last_name.count, indexes.first_name.names_count,
+        indexes.first_name.names_size, indexes.last_name.names_count, indexes.last_name.names_size,
+        indexes.iban.capacity, 0
+    };
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(indexes.first_name.sorted, sizeof(uint32_t), indexes.first_name.count, file) == indexes.first_name.count &&
+              fwrite(indexes.last_name.sorted, sizeof(uint32_t), indexes.last_name.count, file) == indexes.last_name.count &&
+              fwrite(indexes.iban.entries, sizeof(DigitEntry_t), indexes.iban.capacity, file) == indexes.iban.capacity &&
+              writeNames(&indexes.first_name, file) && writeNames(&indexes.last_name, file);
+    long written = ftell(file);
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(tmp_path, indexes.path) != 0)
+    {
+        remove(tmp_path);
+        return false;
+    }
+    metricWritten(METRIC_INDEX_SAVE, written);
+    indexes.saved = true;
+    return true;
+}
+
+bool indexSave()
+{
+    if (indexes.path == NULL)
+        return false;
+    uint64_t start = metricStart();
+    bool saved = saveIndexes();
+    metricEnd(METRIC_INDEX_SAVE, start, saved);
+    return saved;
+}
+
+void indexClose()
+{
+    if (indexes.path != NULL && !indexSave())
+        fprintf(stderr, "Could not save %s, it will be rebuilt on next start\n", indexes.path);
+    freeIndexes();
+    trigramClose();
+    free(indexes.path);
+    indexes.path = NULL;
+}
+
+static bool searchIndexes(SearchField_t field, const char *key, SlotList_t *matches)
+{
+    if (!indexSync())
+        return false;
+
+    switch (field)
+    {
+    case SEARCH_NAME:
+        return nameSearch(&indexes.first_name, key, matches) || trigramSearch(field, key, matches);
+    case SEARCH_SURNAME:
+        return nameSearch(&indexes.last_name, key, matches) || trigramSearch(field, key, matches);
+    case SEARCH_ADDRESS:
+        return trigramSearch(field, key, matches);
+    case SEARCH_PESEL:
+        return peselSearch(key, matches);
+    case SEARCH_ACCOUNT:
+        return digitSearch(&indexes.iban, key, matches);
+    default:
+        return false;
+    }
+}
+
+// Queries the indexes cannot answer count as failures
+bool indexSearch(SearchField_t field, const char *key, SlotList_t *matches)
+{
+    uint64_t start = metricStart();
+    bool answered = searchIndexes(field, key, matches);
+    metricEnd(METRIC_INDEX_SEARCH, start, answered);
+    return answered;
+}
+
+static const NameIndex_t *nameIndexOf(SearchField_t field)
+{
+    return field == SEARCH_NAME ? &indexes.first_name : field == SEARCH_SURNAME ? &indexes.last_name : NULL;
+}
+
+bool indexNamePage(SearchField_t field, const char *key, size_t offset, size_t limit, SlotList_t *page,
+                   size_t *total)
+{
+    const NameIndex_t *index = nameIndexOf(field);
+    uint64_t start = metricStart();
+    bool exact = key[0] == '=';
+    Fixed_string name;
+    snprintf(name, sizeof(name), "%s", exact ? key + 1 : key);
+    bool answered = index != NULL && indexSync() && namePage(index, name, !exact, offset, limit, page, total);
+    metricEnd(METRIC_INDEX_SEARCH, start, answered);
+    return answered;
+}
+
+bool indexCompletions(SearchField_t field, const char *prefix, NameCount_t *names, size_t limit, size_t *found)
+{
+    const NameIndex_t *index = nameIndexOf(field);
+    uint64_t start = metricStart();
+    *found = 0;
+    bool answered = index != NULL && indexSync() && nameCompletions(index, prefix, names, limit, found);
+    metricEnd(METRIC_INDEX_SEARCH, start, answered);
+    return answered;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bank.h"
+
+// Secondary indexes over the account store, kept in a side file so a
+// restart only has to index the records appended since the last save.
+// First and last names are sorted arrays of slots, with a front-coded list
+// of the distinct names pointing into them, so exact and prefix lookups,
+// pages of them and completions never read the records; account numbers,
+// being fixed-length digit strings, are a hash index answering exact
+// lookups. Exact PESELs are answered by the store, which keeps them unique.
+typedef enum {
+    SEARCH_ACCOUNT,
+    SEARCH_NAME,
+    SEARCH_SURNAME,
+    SEARCH_ADDRESS,
+    SEARCH_PESEL
+} SearchField_t;
+
+typedef struct {
+    uint32_t *slots;
+    size_t count;
+    size_t capacity;
+} SlotList_t;
+
+bool indexOpen(const char *path);
+bool indexSave();
+// Saves the indexes and releases them
+void indexClose();
+
+// Collects the slots matching key into matches. Name keys ending in '*'
+// are prefix queries and keys starting with '=' exact ones; any other name
+// or address key is a substring query answered by the trigram index. A
+// PESEL or account number of full length is an exact query. Returns false
+// when the indexes cannot answer (substrings shorter than three characters
+// or partial digit strings), so the caller has to scan.
+bool indexSearch(SearchField_t field, const char *key, SlotList_t *matches);
+
+typedef struct {
+    Fixed_string name;
+    size_t count;
+} NameCount_t;
+
+// A page of the accounts whose first (SEARCH_NAME) or last (SEARCH_SURNAME)
+// name starts with key, or is key when it starts with '=', in name order:
+// up to limit of them from position offset on, and the count of them all
+bool indexNamePage(SearchField_t field, const char *key, size_t offset, size_t limit, SlotList_t *page,
+                   size_t *total);
+// The first limit distinct names starting with prefix, in order, with the
+// number of accounts carrying each, for autocompletion
+bool indexCompletions(SearchField_t field, const char *prefix, NameCount_t *names, size_t limit, size_t *found);
+
+bool slotListAppend(SlotList_t *list, uint32_t slot);
+void slotListFree(SlotList_t *list);
@@ -0,0 +1,580 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "money.h"
+
+#define JOURNAL_MAGIC 0x4C4E524Au
+#define JOURNAL_HEADS_MAGIC 0x53444548u
+#define JOURNAL_VERSION 1
+// Entries read at a time when scanning the tail on open
+#define JOURNAL_SCAN_CHUNK 4096
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t reserved;
+} JournalHeader_t;
+
+// The heads file covers the journal up to covered bytes; the checksum of
+// the entry just before that point ties it to this journal
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t covered;
+    uint32_t count;
+    uint32_t last_checksum;
+} HeadsHeader_t;
+
+// Where an account's newest queued entry is, so the entries of a group
+// chain up without searching the queue. Buckets of earlier groups are told
+// apart by their generation instead of being cleared
+typedef struct
+{
+    uint32_t account;
+    uint32_t generation;
+    uint32_t index;
+} QueuedAt_t;
+
+static struct
+{
+    pthread_mutex_t lock;
+    int fd;
+    char *heads_path;
+    // Bytes of intact entries, header included
+    uint64_t size;
+    // File offset of every account's newest entry, by id - 1
+    uint64_t *heads;
+    uint32_t head_capacity;
+    uint64_t last_lsn;
+    JournalEntry_t *queued;
+    size_t queued_count;
+    size_t queued_capacity;
+    // Twice the queue's capacity
+    QueuedAt_t *queued_at;
+    uint32_t generation;
+    bool failed;
+} journal = { PTHREAD_MUTEX_INITIALIZER, -1, .generation = 1 };
+
+static const char *kind_names[] = {
+    "", "opening", "deposit", "withdrawal", "transfer in", "transfer out", "loan", "repayment",
+};
+
+static uint32_t entryChecksum(const JournalEntry_t *entry)
+{
+    JournalEntry_t copy = *entry;
+    copy.checksum = 0;
+    const unsigned char *bytes = (const unsigned char *)&copy;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(copy); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool entryIntact(const JournalEntry_t *entry)
+{
+    return entry->account != 0 && entry->checksum == entryChecksum(entry);
+}
+
+static bool reserveHeads(uint32_t id)
+{
+    if (id <= journal.head_capacity)
+        return true;
+    uint32_t new_capacity = journal.head_capacity ? journal.head_capacity : 1024;
+    while (new_capacity < id)
+        new_capacity = new_capacity > UINT32_MAX / 2 ? UINT32_MAX : new_capacity * 2;
+    uint64_t *heads = realloc(journal.heads, (size_t)new_capacity * sizeof(uint64_t));
+    if (heads == NULL)
+        return false;
+    memset(heads + journal.head_capacity, 0, (size_t)(new_capacity - journal.head_capacity) * sizeof(uint64_t));
+    journal.heads = heads;
+    journal.head_capacity = new_capacity;
+    return true;
+}
+
+static QueuedAt_t *queuedProbe(QueuedAt_t *buckets, size_t capacity, uint32_t account)
+{
+    size_t pos = (account * 2654435761u) & (capacity - 1);
+    while (buckets[pos].generation == journal.generation && buckets[pos].account != account)
+        pos = (pos + 1) & (capacity - 1);
+    return &buckets[pos];
+}
+
+static bool growQueue()
+{
+    size_t new_capacity = journal.queued_capacity ? journal.queued_capacity * 2 : 16;
+    JournalEntry_t *queued = realloc(journal.queued, new_capacity * sizeof(JournalEntry_t));
+    if (queued == NULL)
+        return false;
+    journal.queued = queued;
+    QueuedAt_t *queued_at = calloc(new_capacity * 2, sizeof(QueuedAt_t));
+    if (queued_at == NULL)
+        return false;
+    for (size_t i = 0; i < journal.queued_capacity * 2; i++)
+    {
+        if (journal.queued_at[i].generation == journal.generation)
+            *queuedProbe(queued_at, new_capacity * 2, journal.queued_at[i].account) = journal.queued_at[i];
+    }
+    free(journal.queued_at);
+    journal.queued_at = queued_at;
+    journal.queued_capacity = new_capacity;
+    return true;
+}
+
+static void emptyQueue()
+{
+    journal.queued_count = 0;
+    if (++journal.generation == 0)
+    {
+        memset(journal.queued_at, 0, journal.queued_capacity * 2 * sizeof(QueuedAt_t));
+        journal.generation = 1;
+    }
+}
+
+static uint64_t headOf(uint32_t id)
+{
+    return id != 0 && id <= journal.head_capacity ? journal.heads[id - 1] : 0;
+}
+
+static bool readEntry(uint64_t offset, JournalEntry_t *entry)
+{
+    return pread(journal.fd, entry, sizeof(*entry), offset) == sizeof(*entry) && entryIntact(entry);
+}
+
+// Loading
+
+static uint64_t loadHeads(const char *heads_path)
+{
+    FILE *file = fopen(heads_path, "rb");
+    if (file == NULL)
+        return sizeof(JournalHeader_t);
+
+    HeadsHeader_t header;
+    JournalEntry_t last;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == JOURNAL_HEADS_MAGIC &&
+              header.version == JOURNAL_VERSION && header.covered >= sizeof(JournalHeader_t) &&
+              header.covered <= journal.size &&
+              (header.covered - sizeof(JournalHeader_t)) % sizeof(JournalEntry_t) == 0;
+    if (ok && header.covered > sizeof(JournalHeader_t))
+        ok = readEntry(header.covered - sizeof(JournalEntry_t), &last) && last.checksum == header.last_checksum;
+    ok = ok && reserveHeads(header.count) &&
+         fread(journal.heads, sizeof(uint64_t), header.count, file) == header.count;
+    fclose(file);
+    if (!ok)
+    {
+        memset(journal.heads, 0, (size_t)journal.head_capacity * sizeof(uint64_t));
+        return sizeof(JournalHeader_t);
+    }
+    return header.covered;
+}
+
+// Follows the entries the heads file does not cover; a torn entry at the
+// tail is cut off so new entries are not appended after it
+static bool scanTail(uint64_t offset)
+{
+    JournalEntry_t *chunk = malloc(JOURNAL_SCAN_CHUNK * sizeof(JournalEntry_t));
+    if (chunk == NULL)
+        return false;
+    uint64_t end = journal.size;
+    bool ok = true;
+    while (ok && offset < end)
+    {
+        size_t count = (end - offset) / sizeof(JournalEntry_t);
+        if (count > JOURNAL_SCAN_CHUNK)
+            count = JOURNAL_SCAN_CHUNK;
+        ssize_t got = pread(journal.fd, chunk, count * sizeof(JournalEntry_t), offset);
+        if (got < (ssize_t)sizeof(JournalEntry_t))
+        {
+            ok = false;
+            break;
+        }
+        count = got / sizeof(JournalEntry_t);
+        for (size_t i = 0; i < count; i++, offset += sizeof(JournalEntry_t))
+        {
+            if (!entryIntact(&chunk[i]))
+            {
+                end = offset;
+                break;
+            }
+            if (!reserveHeads(chunk[i].account))
+            {
+                ok = false;
+                break;
+            }
+            journal.heads[chunk[i].account - 1] = offset;
+        }
+    }
+    free(chunk);
+    if (ok && end < journal.size)
+    {
+        ok = ftruncate(journal.fd, end) == 0;
+        journal.size = end;
+    }
+    return ok;
+}
+
+// Closes without saving the heads, which may not cover the journal
+static bool abandon()
+{
+    journal.failed = true;
+    journalClose();
+    return false;
+}
+
+bool journalOpen(const char *path, const char *heads_path)
+{
+    journal.fd = open(path, O_RDWR | O_CREAT, 0644);
+    journal.heads_path = strdup(heads_path);
+    struct stat st;
+    if (journal.fd < 0 || journal.heads_path == NULL || fstat(journal.fd, &st) != 0)
+        return abandon();
+
+    JournalHeader_t header = { JOURNAL_MAGIC, JOURNAL_VERSION, sizeof(JournalEntry_t), 0 };
+    if (st.st_size < (off_t)sizeof(header))
+    {
+        if (pwrite(journal.fd, &header, sizeof(header), 0) != sizeof(header) ||
+            ftruncate(journal.fd, sizeof(header)) != 0 || fdatasync(journal.fd) != 0)
+            return abandon();
+        st.st_size = sizeof(header);
+    }
+    else if (pread(journal.fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != JOURNAL_MAGIC ||
+             header.version != JOURNAL_VERSION || header.entry_size != sizeof(JournalEntry_t))
+    {
+        fprintf(stderr, "%s is not a journal of this version\n", path);
+        return abandon();
+    }
+
+    // A partial entry at the end never made it, whole ones are checked
+    journal.size = st.st_size - (st.st_size - sizeof(header)) % sizeof(JournalEntry_t);
+    if (!scanTail(loadHeads(heads_path)))
+        return abandon();
+
+    JournalEntry_t last;
+    journal.last_lsn = JOURNAL_NO_LSN;
+    if (journal.size > sizeof(header) && readEntry(journal.size - sizeof(JournalEntry_t), &last))
+        journal.last_lsn = last.lsn;
+    return true;
+}
+
+static bool saveHeads()
+{
+    char tmp_path[BUFFER];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", journal.heads_path);
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL)
+        return false;
+
+    JournalEntry_t last = { 0 };
+    HeadsHeader_t header = { JOURNAL_HEADS_MAGIC, JOURNAL_VERSION, journal.size, journal.head_capacity, 0 };
+    if (journal.size > sizeof(JournalHeader_t) && readEntry(journal.size - sizeof(JournalEntry_t), &last))
+        header.last_checksum = last.checksum;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(journal.heads, sizeof(uint64_t), journal.head_capacity, file) == journal.head_capacity;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path, journal.heads_path) != 0)
+    {
+        remove(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+void journalClose()
+{
+    if (journal.fd >= 0 && !journal.failed && (fdatasync(journal.fd) != 0 || !saveHeads()))
+        fprintf(stderr, "Could not save %s, the journal will be scanned on next start\n", journal.heads_path);
+    if (journal.fd >= 0)
+        close(journal.fd);
+    free(journal.heads_path);
+    free(journal.heads);
+    free(journal.queued);
+    free(journal.queued_at);
+    journal.fd = -1;
+    journal.heads_path = NULL;
+    journal.heads = NULL;
+    journal.head_capacity = 0;
+    journal.size = 0;
+    journal.queued = NULL;
+    journal.queued_at = NULL;
+    journal.queued_count = 0;
+    journal.queued_capacity = 0;
+    journal.generation = 1;
+    journal.failed = false;
+}
+
+bool journalIsOpen()
+{
+    return journal.fd >= 0;
+}
+
+uint64_t journalLastLSN()
+{
+    return journal.fd >= 0 ? journal.last_lsn : JOURNAL_NO_LSN;
+}
+
+bool journalLastState(uint32_t id, AccountHot_t *state)
+{
+    JournalEntry_t entry;
+    uint64_t head = headOf(id);
+    if (journal.fd < 0 || head == 0 || !readEntry(head, &entry))
+        return false;
+    memset(state, 0, sizeof(*state));
+    state->id = id;
+    state->balance = entry.balance;
+    state->debt = entry.debt;
+    return true;
+}
+
+// Appending
+
+static JournalKind_t kindOf(const AccountHot_t *before, const AccountHot_t *after, uint32_t counterparty)
+{
+    if (before == NULL)
+        return JOURNAL_OPEN;
+    Money_t change = after->balance - before->balance;
+    if (counterparty != 0 && change != 0)
+        return change > 0 ? JOURNAL_TRANSFER_IN : JOURNAL_TRANSFER_OUT;
+    // Loans add to the debt more than they pay out, repayments come off both
+    if (after->debt > before->debt)
+        return JOURNAL_LOAN;
+    if (after->debt < before->debt)
+        return JOURNAL_REPAYMENT;
+    if (change == 0)
+        return 0;
+    return change > 0 ? JOURNAL_DEPOSIT : JOURNAL_WITHDRAWAL;
+}
+
+void journalRecord(uint64_t lsn, int64_t time, const AccountHot_t *before, const AccountHot_t *after,
+                   uint32_t counterparty)
+{
+    JournalKind_t kind = kindOf(before, after, counterparty);
+    if (journal.fd < 0 || journal.failed || kind == 0)
+        return;
+
+    if (journal.queued_count == journal.queued_capacity && !growQueue())
+    {
+        journal.failed = true;
+        return;
+    }
+
+    // The previous entry may still be queued with this one
+    uint64_t previous = headOf(after->id);
+    QueuedAt_t *at = queuedProbe(journal.queued_at, journal.queued_capacity * 2, after->id);
+    if (at->generation == journal.generation)
+        previous = journal.size + at->index * sizeof(JournalEntry_t);
+    *at = (QueuedAt_t){ after->id, journal.generation, (uint32_t)journal.queued_count };
+
+    JournalEntry_t *entry = &journal.queued[journal.queued_count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->lsn = lsn;
+    entry->time = time;
+    entry->previous = previous;
+    entry->account = after->id;
+    entry->counterparty = counterparty;
+    entry->kind = (uint16_t)kind;
+    entry->amount = before != NULL ? after->balance - before->balance : after->balance;
+    entry->balance = after->balance;
+    entry->debt = after->debt;
+    entry->checksum = entryChecksum(entry);
+}
+
+bool journalWrite()
+{
+    if (journal.fd < 0 || journal.queued_count == 0 || journal.failed)
+    {
+        emptyQueue();
+        return journal.fd < 0 || !journal.failed;
+    }
+
+    size_t size = journal.queued_count * sizeof(JournalEntry_t);
+    pthread_mutex_lock(&journal.lock);
+    bool written = true;
+    for (size_t i = 0; written && i < journal.queued_count; i++)
+        written = reserveHeads(journal.queued[i].account);
+    written = written && pwrite(journal.fd, journal.queued, size, journal.size) == (ssize_t)size;
+    if (written)
+    {
+        for (size_t i = 0; i < journal.queued_count; i++)
+            journal.heads[journal.queued[i].account - 1] = journal.size + i * sizeof(JournalEntry_t);
+        journal.size += size;
+        journal.last_lsn = journal.queued[journal.queued_count - 1].lsn;
+    }
+    else
+    {
+        journal.failed = true;
+    }
+    pthread_mutex_unlock(&journal.lock);
+    emptyQueue();
+    return written;
+}
+
+void journalDiscard()
+{
+    emptyQueue();
+}
+
+bool journalSync()
+{
+    return journal.fd < 0 || (!journal.failed && fdatasync(journal.fd) == 0);
+}
+
+// Statements
+
+static bool listAppend(JournalList_t *list, const JournalEntry_t *entry)
+{
+    if (list->count == list->capacity)
+    {
+        size_t new_capacity = list->capacity ? list->capacity * 2 : 16;
+        JournalEntry_t *entries = realloc(list->entries, new_capacity * sizeof(JournalEntry_t));
+        if (entries == NULL)
+            return false;
+        list->entries = entries;
+        list->capacity = new_capacity;
+    }
+    list->entries[list->count++] = *entry;
+    return true;
+}
+
+bool journalStatement(uint32_t id, int64_t from, int64_t to, uint32_t limit, JournalList_t *entries)
+{
+    if (journal.fd < 0)
+        return false;
+    pthread_mutex_lock(&journal.lock);
+    uint64_t offset = headOf(id);
+    pthread_mutex_unlock(&journal.lock);
+
+    // Written entries never change, so the chain is followed unlocked; it
+    // runs newest first and stops at the first entry older than from
+    while (offset != 0 && (limit == 0 || entries->count < limit))
+    {
+        JournalEntry_t entry;
+        if (!readEntry(offset, &entry) || entry.account != id)
+            return false;
+        if (from != 0 && entry.time < from)
+            break;
+        if ((to == 0 || entry.time <= to) && !listAppend(entries, &entry))
+            return false;
+        offset = entry.previous;
+    }
+    return true;
+}
+
+void journalListFree(JournalList_t *list)
+{
+    free(list->entries);
+    memset(list, 0, sizeof(JournalList_t));
+}
+
+const char *journalKindName(JournalKind_t kind)
+{
+    return kind >= JOURNAL_OPEN && kind <= JOURNAL_REPAYMENT ? kind_names[kind] : "unknown";
+}
+
+// Statement command
+
+static bool parseDate(const char *text, bool end_of_day, int64_t *value)
+{
+    struct tm date = { 0 };
+    char rest;
+    if (sscanf(text, "%d-%d-%d%c", &date.tm_year, &date.tm_mon, &date.tm_mday, &rest) != 3)
+        return false;
+    date.tm_year -= 1900;
+    date.tm_mon -= 1;
+    date.tm_isdst = -1;
+    if (end_of_day)
+    {
+        date.tm_hour = 23;
+        date.tm_min = 59;
+        date.tm_sec = 59;
+    }
+    time_t seconds = mktime(&date);
+    *value = seconds;
+    return seconds != (time_t)-1;
+}
+
+void journalPrint(const JournalList_t *entries)
+{
+    printf("%-19s | %-12s | %12s | %8s | %12s | %12s\n", "Date", "Type", "Amount", "With", "Balance", "Debt");
+    for (size_t i = 0; i < entries->count; i++)
+    {
+        const JournalEntry_t *entry = &entries->entries[i];
+        char date[32], amount[MONEY_BUFFER], balance[MONEY_BUFFER], debt[MONEY_BUFFER], with[16] = "";
+        time_t seconds = entry->time;
+        struct tm local;
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &local));
+        formatMoney(entry->amount, amount);
+        formatMoney(entry->balance, balance);
+        formatMoney(entry->debt, debt);
+        if (entry->counterparty != 0)
+            snprintf(with, sizeof(with), "%u", entry->counterparty);
+        printf("%-19s | %-12s | %12s | %8s | %12s | %12s\n", date, journalKindName(entry->kind), amount, with,
+               balance, debt);
+    }
+    if (entries->count == 0)
+        printf("No transactions\n");
+}
+
+int runStatement(int argc, char *argv[])
+{
+    static const char usage[] = "Usage: statement ID [--last N] [--from YYYY-MM-DD] [--to YYYY-MM-DD]\n";
+    char *endptr;
+    unsigned long id = argc > 1 ? strtoul(argv[1], &endptr, 10) : 0;
+    if (argc < 2 || *endptr != '\0' || id == 0 || id > UINT32_MAX)
+    {
+        fputs(usage, stderr);
+        return 1;
+    }
+
+    int64_t from = 0, to = 0;
+    unsigned long limit = 0;
+    for (int i = 2; i < argc; i++)
+    {
+        bool ok = i + 1 < argc;
+        if (ok && strcmp(argv[i], "--last") == 0)
+        {
+            limit = strtoul(argv[++i], &endptr, 10);
+            ok = *endptr == '\0' && limit > 0 && limit <= UINT32_MAX;
+        }
+        else if (ok && strcmp(argv[i], "--from") == 0)
+            ok = parseDate(argv[++i], false, &from);
+        else if (ok && strcmp(argv[i], "--to") == 0)
+            ok = parseDate(argv[++i], true, &to);
+        else
+            ok = false;
+        if (!ok)
+        {
+            fputs(usage, stderr);
+            return 1;
+        }
+    }
+
+    Account_t account;
+    if (!storeGet((uint32_t)id, &account))
+    {
+        fprintf(stderr, "Account %lu was not found\n", id);
+        return 1;
+    }
+    JournalList_t entries = { 0 };
+    if (!journalStatement(account.id, from, to, (uint32_t)limit, &entries))
+    {
+        fprintf(stderr, "Error reading the journal\n");
+        journalListFree(&entries);
+        return 1;
+    }
+    printf("Account %u (%s), %s %s\n", account.id, account.account_number, account.first_name, account.last_name);
+    journalPrint(&entries);
+    journalListFree(&entries);
+    return 0;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bank.h"
+#include "store.h"
+
+// Append-only journal of every balance change. The store derives the
+// entries from its before- and after-images when a change commits, so the
+// menus, batches and the server are all covered. Each entry points back at
+// the previous entry of its account, and the newest entry of every account
+// (its chain head) is kept in memory and saved in a side file at close, so
+// an account's history is read by following its own chain, newest first,
+// without touching anyone else's entries.
+//
+// Entries are written after the change's log record is durable and synced
+// with the data files at checkpoints. Each carries the log sequence number
+// of its change, so after a crash the replayed records newer than the
+// journal get their entries again, with the amounts worked out from the
+// accounts' last entries. Accounts added by bulk loads have no opening
+// entry; their history starts at their first change, and when that change
+// had already reached the data files before a crash it cannot be told
+// apart from no change and gets no entry (unless it is a transfer).
+typedef enum {
+    JOURNAL_OPEN = 1,
+    JOURNAL_DEPOSIT,
+    JOURNAL_WITHDRAWAL,
+    JOURNAL_TRANSFER_IN,
+    JOURNAL_TRANSFER_OUT,
+    JOURNAL_LOAN,
+    JOURNAL_REPAYMENT
+} JournalKind_t;
+
+typedef struct
+{
+    uint64_t lsn;
+    // Seconds since the epoch
+    int64_t time;
+    // File offset of the account's previous entry, 0 for its first
+    uint64_t previous;
+    uint32_t account;
+    // The other account of a transfer, 0 otherwise
+    uint32_t counterparty;
+    uint16_t kind;
+    uint16_t reserved;
+    uint32_t checksum;
+    // Change of the balance; the opening balance for JOURNAL_OPEN
+    Money_t amount;
+    Money_t balance;
+    Money_t debt;
+} JournalEntry_t;
+
+typedef struct {
+    JournalEntry_t *entries;
+    size_t count;
+    size_t capacity;
+} JournalList_t;
+
+#define JOURNAL_NO_LSN UINT64_MAX
+
+// Opened before the store, so that its replay can fill in lost entries
+bool journalOpen(const char *path, const char *heads_path);
+// Saves the chain heads and closes the journal
+void journalClose();
+bool journalIsOpen();
+
+// The sequence number of the newest entry, JOURNAL_NO_LSN when there is
+// none or the journal is not open
+uint64_t journalLastLSN();
+// The balance and debt after the account's newest entry
+bool journalLastState(uint32_t id, AccountHot_t *state);
+
+// Queues the entry of one account's change as it is staged; before is NULL
+// for a created account. Changes that move no money queue nothing. Does
+// nothing when the journal is not open.
+void journalRecord(uint64_t lsn, int64_t time, const AccountHot_t *before, const AccountHot_t *after,
+                   uint32_t counterparty);
+// Appends the queued entries in one write, once their log records are
+// durable. After a failed write (or a failure to queue) the journal takes
+// no more entries until it is reopened, so replay can fill the gap without
+// leaving holes behind later entries.
+bool journalWrite();
+// Drops the queued entries of a rolled back group
+void journalDiscard();
+bool journalSync();
+
+// Collects up to limit entries of account id (0 for no limit), newest
+// first, made between from and to inclusive; 0 leaves either end open
+bool journalStatement(uint32_t id, int64_t from, int64_t to, uint32_t limit, JournalList_t *entries);
+void journalListFree(JournalList_t *list);
+// Prints the entries as a table, for statements
+void journalPrint(const JournalList_t *entries);
+const char *journalKindName(JournalKind_t kind);
+
+// statement ID [--last N] [--from YYYY-MM-DD] [--to YYYY-MM-DD]
+int runStatement(int argc, char *argv[]);
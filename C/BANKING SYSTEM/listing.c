@@ -0,0 +1,688 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bank.h"
+#include "listing.h"
+#include "money.h"
+#include "query.h"
+#include "store.h"
+#include "util.h"
+
+#define LIST_WRITE_BUFFER (1 << 20)
+// No row of either format is longer, so a row is formatted without checks
+#define LIST_MAX_ROW 512
+
+typedef struct
+{
+    int fd;
+    char *data;
+    size_t used;
+    bool failed;
+} ListOutput_t;
+
+typedef struct
+{
+    const char *title;
+    const char *name;
+    // Width in tables; numbers are aligned to the right
+    size_t width;
+    bool number;
+    // Where text columns sit in the cold part
+    size_t offset;
+} Column_t;
+
+static const Column_t columns[LIST_COLUMNS] = {
+    { "ID", "id", 4, true, 0 },
+    { "IBAN", "account_number", 8, false, offsetof(AccountCold_t, account_number) },
+    { "First Name", "first_name", 15, false, offsetof(AccountCold_t, first_name) },
+    { "Last Name", "last_name", 15, false, offsetof(AccountCold_t, last_name) },
+    { "Address", "address", 30, false, offsetof(AccountCold_t, address) },
+    { "PESEL", "pesel", 11, false, offsetof(AccountCold_t, pesel_number) },
+    { "Balance", "balance", 10, true, 0 },
+    { "Debt", "debt", 10, true, 0 },
+};
+
+static void flushOutput(ListOutput_t *out)
+{
+    const char *pos = out->data;
+    while (!out->failed && out->used > 0)
+    {
+        ssize_t put = write(out->fd, pos, out->used);
+        if (put <= 0)
+            out->failed = true;
+        else
+        {
+            pos += put;
+            out->used -= put;
+        }
+    }
+    out->used = 0;
+}
+
+static char *reserveRow(ListOutput_t *out)
+{
+    if (out->used + LIST_MAX_ROW > LIST_WRITE_BUFFER)
+        flushOutput(out);
+    return out->data + out->used;
+}
+
+static size_t formatID(uint32_t id, char *buffer)
+{
+    char digits[16];
+    size_t count = 0, length = 0;
+    do
+    {
+        digits[count++] = (char)('0' + id % 10);
+        id /= 10;
+    } while (id > 0);
+    while (count > 0)
+        buffer[length++] = digits[--count];
+    buffer[length] = '\0';
+    return length;
+}
+
+// The text of a column and its length; numbers are formatted into buffer
+static const char *columnText(const AccountHot_t *hot, const AccountCold_t *cold, ListColumn_t column,
+                              char *buffer, size_t *length)
+{
+    switch (column)
+    {
+    case LIST_ID:
+        *length = formatID(hot->id, buffer);
+        return buffer;
+    case LIST_BALANCE:
+        *length = formatMoney(hot->balance, buffer);
+        return buffer;
+    case LIST_DEBT:
+        *length = formatMoney(hot->debt, buffer);
+        return buffer;
+    default:
+    {
+        const char *text = (const char *)cold + columns[column].offset;
+        *length = strlen(text);
+        return text;
+    }
+    }
+}
+
+// Pads like printf's %-Ns, or %Ns for numbers, without truncating
+static char *putCell(char *pos, const char *text, size_t length, const Column_t *column)
+{
+    size_t padding = length < column->width ? column->width - length : 0;
+    if (column->number)
+    {
+        memset(pos, ' ', padding);
+        pos += padding;
+    }
+    memcpy(pos, text, length);
+    pos += length;
+    if (!column->number)
+    {
+        memset(pos, ' ', padding);
+        pos += padding;
+    }
+    return pos;
+}
+
+// Fields cannot hold tabs or line breaks once validated, but older files
+// were never checked, so they are blanked out rather than trusted
+static char *putField(char *pos, const char *text, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+        *pos++ = text[i] == '\t' || text[i] == '\n' || text[i] == '\r' ? ' ' : text[i];
+    return pos;
+}
+
+static void putLine(ListOutput_t *out)
+{
+    char *pos = reserveRow(out);
+    memset(pos, '-', LINE_LENGTH);
+    pos[LINE_LENGTH] = '\n';
+    out->used += LINE_LENGTH + 1;
+}
+
+static void putHeader(ListOutput_t *out, ListFormat_t format)
+{
+    if (format == LIST_TABLE)
+        putLine(out);
+    char *start = reserveRow(out), *pos = start;
+    for (int c = 0; c < LIST_COLUMNS; c++)
+    {
+        if (format == LIST_TSV)
+        {
+            size_t length = strlen(columns[c].name);
+            memcpy(pos, columns[c].name, length);
+            pos += length;
+            *pos++ = c + 1 < LIST_COLUMNS ? '\t' : '\n';
+        }
+        else
+        {
+            memcpy(pos, c == 0 ? "| " : " | ", c == 0 ? 2 : 3);
+            pos = putCell(pos + (c == 0 ? 2 : 3), columns[c].title, strlen(columns[c].title), &columns[c]);
+        }
+    }
+    if (format == LIST_TABLE)
+    {
+        memcpy(pos, " |\n", 3);
+        pos += 3;
+    }
+    out->used += pos - start;
+    if (format == LIST_TABLE)
+        putLine(out);
+}
+
+static void putRow(ListOutput_t *out, ListFormat_t format, uint32_t slot)
+{
+    const AccountHot_t *hot = storeHot(slot);
+    const AccountCold_t *cold = storeCold(slot);
+    char *start = reserveRow(out), *pos = start;
+    char number[MONEY_BUFFER];
+    for (int c = 0; c < LIST_COLUMNS; c++)
+    {
+        size_t length;
+        const char *text = columnText(hot, cold, c, number, &length);
+        if (format == LIST_TSV)
+        {
+            pos = putField(pos, text, length);
+            *pos++ = c + 1 < LIST_COLUMNS ? '\t' : '\n';
+        }
+        else
+        {
+            memcpy(pos, c == 0 ? "| " : " | ", c == 0 ? 2 : 3);
+            pos = putCell(pos + (c == 0 ? 2 : 3), text, length, &columns[c]);
+        }
+    }
+    if (format == LIST_TABLE)
+    {
+        memcpy(pos, " |\n", 3);
+        pos += 3;
+    }
+    out->used += pos - start;
+}
+
+static void putMessage(ListOutput_t *out, const char *message)
+{
+    char *pos = reserveRow(out);
+    out->used += snprintf(pos, LIST_MAX_ROW, "| %-110.110s |\n", message);
+}
+
+// Sorting
+
+// Listings of at most this many rows past the start of the order, and
+// under an eighth of the accounts, are picked out with a bounded heap
+// rather than by sorting everything
+#define LIST_TOP_MAX 10000
+// Full orders of every account kept for the next listing
+#define LIST_CACHED_ORDERS 4
+
+// One full order, valid while the store version it was built at holds
+typedef struct
+{
+    uint32_t *slots;
+    size_t count;
+    ListColumn_t column;
+    bool descending;
+    uint64_t version;
+    uint64_t used;
+} CachedOrder_t;
+
+static ListColumn_t sort_column;
+static bool sort_descending;
+
+// Guarded by the store lock, like everything listAccounts reads
+static struct
+{
+    CachedOrder_t orders[LIST_CACHED_ORDERS];
+    uint64_t clock;
+} cache;
+
+static int compareColumn(uint32_t a, uint32_t b)
+{
+    const AccountHot_t *hot_a = storeHot(a), *hot_b = storeHot(b);
+    switch (sort_column)
+    {
+    case LIST_ID:
+        return (hot_a->id > hot_b->id) - (hot_a->id < hot_b->id);
+    case LIST_BALANCE:
+        return (hot_a->balance > hot_b->balance) - (hot_a->balance < hot_b->balance);
+    case LIST_DEBT:
+        return (hot_a->debt > hot_b->debt) - (hot_a->debt < hot_b->debt);
+    default:
+    {
+        size_t offset = columns[sort_column].offset;
+        return strcmp((const char *)storeCold(a) + offset, (const char *)storeCold(b) + offset);
+    }
+    }
+}
+
+static int compareOrder(uint32_t slot_a, uint32_t slot_b)
+{
+    int order = compareColumn(slot_a, slot_b);
+    if (order != 0)
+        return sort_descending ? -order : order;
+    uint32_t id_a = storeHot(slot_a)->id, id_b = storeHot(slot_b)->id;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+static int compareForSort(const void *a, const void *b)
+{
+    return compareOrder(*(const uint32_t *)a, *(const uint32_t *)b);
+}
+
+// A full sort compares packed keys instead of going back to the records:
+// the number, or the first bytes of the text, flipped for descending
+// orders so every order is ascending
+typedef struct
+{
+    uint64_t key;
+    uint32_t id;
+    uint32_t slot;
+} SortKey_t;
+
+static uint64_t sortKey(uint32_t slot)
+{
+    const AccountHot_t *hot = storeHot(slot);
+    uint64_t key = 0;
+    switch (sort_column)
+    {
+    case LIST_ID:
+        key = hot->id;
+        break;
+    case LIST_BALANCE:
+        key = (uint64_t)hot->balance ^ (1ull << 63);
+        break;
+    case LIST_DEBT:
+        key = (uint64_t)hot->debt ^ (1ull << 63);
+        break;
+    default:
+    {
+        const unsigned char *text = (const unsigned char *)storeCold(slot) + columns[sort_column].offset;
+        bool ended = false;
+        for (size_t i = 0; i < sizeof(key); i++)
+        {
+            ended = ended || text[i] == '\0';
+            key = key << 8 | (ended ? 0 : text[i]);
+        }
+    }
+    }
+    return sort_descending ? ~key : key;
+}
+
+static int compareKeys(const void *a, const void *b)
+{
+    const SortKey_t *x = a, *y = b;
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    // Equal texts that go on past the packed bytes are told apart in full
+    uint64_t key = sort_descending ? ~x->key : x->key;
+    if (!columns[sort_column].number && (key & 0xFF) != 0)
+    {
+        int order = compareColumn(x->slot, y->slot);
+        if (order != 0)
+            return sort_descending ? -order : order;
+    }
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+static bool sortByKeys(uint32_t *slots, size_t count)
+{
+    SortKey_t *keys = malloc(count ? count * sizeof(SortKey_t) : 1);
+    if (keys == NULL)
+        return false;
+    for (size_t i = 0; i < count; i++)
+        keys[i] = (SortKey_t){ sortKey(slots[i]), storeHot(slots[i])->id, slots[i] };
+    qsort(keys, count, sizeof(SortKey_t), compareKeys);
+    for (size_t i = 0; i < count; i++)
+        slots[i] = keys[i].slot;
+    free(keys);
+    return true;
+}
+
+// Balances and debts change with every operation, the other columns only
+// when accounts come or go
+static uint64_t orderVersion(ListColumn_t column)
+{
+    return column == LIST_BALANCE || column == LIST_DEBT ? storeHotVersion() : storeColdVersion();
+}
+
+// Drops the orders gone out of date on the way
+static CachedOrder_t *cachedOrder(const ListOptions_t *options)
+{
+    CachedOrder_t *found = NULL;
+    for (int i = 0; i < LIST_CACHED_ORDERS; i++)
+    {
+        CachedOrder_t *order = &cache.orders[i];
+        if (order->slots != NULL && order->version != orderVersion(order->column))
+        {
+            free(order->slots);
+            *order = (CachedOrder_t){ 0 };
+        }
+        else if (order->slots != NULL && order->column == options->sort && order->descending == options->descending)
+        {
+            order->used = ++cache.clock;
+            found = order;
+        }
+    }
+    return found;
+}
+
+// Takes over slots, replacing the least recently used order
+static void cacheOrder(uint32_t *slots, size_t count, const ListOptions_t *options)
+{
+    CachedOrder_t *victim = &cache.orders[0];
+    for (int i = 1; i < LIST_CACHED_ORDERS; i++)
+    {
+        if (cache.orders[i].used < victim->used)
+            victim = &cache.orders[i];
+    }
+    free(victim->slots);
+    *victim = (CachedOrder_t){ slots, count, options->sort, options->descending, orderVersion(options->sort),
+                               ++cache.clock };
+}
+
+// Keeps the wanted slots that sort first in a heap topped by the last of
+// them, so a slot that does not belong costs a single comparison
+static void offerSlot(uint32_t *heap, size_t *size, size_t wanted, uint32_t slot)
+{
+    size_t i;
+    if (*size < wanted)
+    {
+        for (i = (*size)++; i > 0 && compareOrder(heap[(i - 1) / 2], slot) < 0; i = (i - 1) / 2)
+            heap[i] = heap[(i - 1) / 2];
+        heap[i] = slot;
+        return;
+    }
+    if (compareOrder(slot, heap[0]) >= 0)
+        return;
+    for (i = 0; 2 * i + 1 < *size;)
+    {
+        size_t child = 2 * i + 1;
+        if (child + 1 < *size && compareOrder(heap[child + 1], heap[child]) > 0)
+            child++;
+        if (compareOrder(heap[child], slot) <= 0)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = slot;
+}
+
+// The live slots of the listing in order, or for a short listing only its
+// first wanted ones; the caller holds the store lock. Orders of every
+// account are cached, and *owned tells whether the caller frees the array.
+static uint32_t *sortedSlots(const SlotList_t *slots, const ListOptions_t *options, size_t *count, bool *owned)
+{
+    sort_column = options->sort;
+    sort_descending = options->descending;
+    CachedOrder_t *order = slots == NULL ? cachedOrder(options) : NULL;
+    *owned = order == NULL;
+    if (order != NULL)
+    {
+        *count = order->count;
+        return order->slots;
+    }
+
+    size_t candidates = slots != NULL ? slots->count : storeCount();
+    uint64_t wanted = options->limit ? (uint64_t)options->offset + options->limit : UINT64_MAX;
+    bool partial = wanted <= LIST_TOP_MAX && wanted < candidates / 8;
+    size_t capacity = partial ? wanted : candidates;
+    uint32_t *sorted = malloc(capacity ? capacity * sizeof(uint32_t) : 1);
+    if (sorted == NULL)
+        return NULL;
+    *count = 0;
+    if (slots != NULL)
+    {
+        for (size_t i = 0; i < slots->count; i++)
+        {
+            if (storeHot(slots->slots[i]) == NULL)
+                continue;
+            if (partial)
+                offerSlot(sorted, count, wanted, slots->slots[i]);
+            else
+                sorted[(*count)++] = slots->slots[i];
+        }
+    }
+    else
+    {
+        for (uint32_t slot = 0; slot < storeSlots() && (partial || *count < capacity); slot++)
+        {
+            if (storeHot(slot) == NULL)
+                continue;
+            if (partial)
+                offerSlot(sorted, count, wanted, slot);
+            else
+                sorted[(*count)++] = slot;
+        }
+    }
+    if (partial)
+        qsort(sorted, *count, sizeof(uint32_t), compareForSort);
+    else if (!sortByKeys(sorted, *count))
+    {
+        free(sorted);
+        return NULL;
+    }
+    if (slots == NULL && !partial)
+    {
+        cacheOrder(sorted, *count, options);
+        *owned = false;
+    }
+    return sorted;
+}
+
+// Whether the listing has to be sorted: slots are in id order in a direct
+// layout, so only a packed store needs sorting by id
+static bool needsSort(const SlotList_t *slots, const ListOptions_t *options)
+{
+    if (options->sort != LIST_ID || options->descending)
+        return true;
+    return slots != NULL || storeLayout() != STORE_DIRECT;
+}
+
+bool listOrder(const SlotList_t *slots, const ListOptions_t *options, SlotList_t *ordered)
+{
+    storeLock();
+    bool owned = false, ok = true;
+    size_t count = 0;
+    uint32_t *sorted = needsSort(slots, options) ? sortedSlots(slots, options, &count, &owned) : NULL;
+    uint64_t limit = options->limit ? options->limit : UINT64_MAX, listed = 0, skipped = 0;
+    if (sorted != NULL)
+    {
+        for (size_t i = options->offset; ok && i < count && listed < limit; i++, listed++)
+            ok = slotListAppend(ordered, sorted[i]);
+    }
+    else if (needsSort(slots, options))
+    {
+        ok = false;
+    }
+    else
+    {
+        for (uint32_t slot = 0; ok && slot < storeSlots() && listed < limit; slot++)
+        {
+            if (storeHot(slot) == NULL || skipped++ < options->offset)
+                continue;
+            ok = slotListAppend(ordered, slot);
+            listed++;
+        }
+    }
+    storeUnlock();
+    if (owned)
+        free(sorted);
+    return ok;
+}
+
+bool listAccounts(int fd, const SlotList_t *slots, const ListOptions_t *options)
+{
+    ListOutput_t out = { fd, malloc(LIST_WRITE_BUFFER), 0, false };
+    if (out.data == NULL)
+        return false;
+
+    storeLock();
+    bool ok = true;
+    uint32_t *sorted = NULL;
+    size_t count = 0;
+    bool owned = false;
+    if (needsSort(slots, options))
+    {
+        sorted = sortedSlots(slots, options, &count, &owned);
+        ok = sorted != NULL;
+    }
+
+    uint64_t listed = 0, skipped = 0;
+    uint64_t limit = options->limit ? options->limit : UINT64_MAX;
+    if (ok)
+        putHeader(&out, options->format);
+    if (sorted != NULL)
+    {
+        for (size_t i = options->offset; i < count && listed < limit && !out.failed; i++, listed++)
+            putRow(&out, options->format, sorted[i]);
+    }
+    else
+    {
+        for (uint32_t slot = 0; ok && slot < storeSlots() && listed < limit && !out.failed; slot++)
+        {
+            if (storeHot(slot) == NULL || skipped++ < options->offset)
+                continue;
+            putRow(&out, options->format, slot);
+            listed++;
+        }
+    }
+    storeUnlock();
+    if (owned)
+        free(sorted);
+
+    if (ok && options->format == LIST_TABLE)
+    {
+        if (listed == 0 && options->empty_message != NULL)
+            putMessage(&out, options->empty_message);
+        putLine(&out);
+    }
+    flushOutput(&out);
+    free(out.data);
+    return ok && !out.failed;
+}
+
+bool listColumnByName(const char *name, ListColumn_t *column)
+{
+    for (int c = 0; c < LIST_COLUMNS; c++)
+    {
+        if (strcmp(name, columns[c].name) == 0)
+        {
+            *column = c;
+            return true;
+        }
+    }
+    if (strcmp(name, "name") == 0)
+        *column = LIST_NAME;
+    else if (strcmp(name, "surname") == 0)
+        *column = LIST_SURNAME;
+    else
+        return false;
+    return true;
+}
+
+static bool parseSort(char *text, ListOptions_t *options)
+{
+    char *order = strchr(text, ':');
+    if (order != NULL)
+    {
+        *order++ = '\0';
+        if (strcmp(order, "desc") == 0)
+            options->descending = true;
+        else if (strcmp(order, "asc") != 0)
+            return false;
+    }
+    return listColumnByName(text, &options->sort);
+}
+
+bool listParseOptions(int argc, char *argv[], ListOptions_t *options)
+{
+    for (int i = 0; i < argc; i++)
+    {
+        const char *option = argv[i];
+        bool ok = i + 1 < argc;
+        if (ok && strcmp(option, "--limit") == 0)
+            ok = parseCount(argv[++i], UINT32_MAX, &options->limit);
+        else if (ok && strcmp(option, "--offset") == 0)
+            ok = parseCount(argv[++i], UINT32_MAX, &options->offset);
+        else if (ok && strcmp(option, "--sort") == 0)
+            ok = parseSort(argv[++i], options);
+        else if (ok && strcmp(option, "--format") == 0)
+        {
+            const char *format = argv[++i];
+            ok = strcmp(format, "table") == 0 || strcmp(format, "tsv") == 0;
+            options->format = strcmp(format, "tsv") == 0 ? LIST_TSV : LIST_TABLE;
+        }
+        else
+            ok = false;
+
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+int runList(int argc, char *argv[])
+{
+    ListOptions_t options = { LIST_TABLE, LIST_ID, false, 0, 0, NULL };
+    if (!listParseOptions(argc - 1, argv + 1, &options))
+    {
+        fprintf(stderr, "Usage: list [--limit N] [--offset N] [--sort COLUMN[:desc]] [--format table|tsv]\n"
+                        "COLUMN is one of id, account_number, name, surname, address, pesel, balance, debt\n");
+        return 1;
+    }
+
+    if (!listAccounts(STDOUT_FILENO, NULL, &options))
+    {
+        fprintf(stderr, "Error writing the listing\n");
+        return 1;
+    }
+    return 0;
+}
+
+int runTop(int argc, char *argv[])
+{
+    ListOptions_t options = { LIST_TABLE, LIST_ID, false, 0, 0, "No accounts to list" };
+    Query_t query;
+    char error[BUFFER] = "";
+    bool filtered = false, ok = argc >= 3 && parseCount(argv[1], UINT32_MAX, &options.limit) && options.limit > 0;
+    int next = ok && strcmp(argv[2], "by") == 0 ? 3 : 2;
+    // The largest come first unless :asc is asked for
+    bool ordered = ok && next < argc && strchr(argv[next], ':') != NULL;
+    ok = ok && next < argc && parseSort(argv[next++], &options);
+    options.descending = options.descending || !ordered;
+    if (ok && next + 1 < argc && strcmp(argv[next], "--where") == 0)
+    {
+        ok = filtered = queryCompile(argv[next + 1], &query, error);
+        next += 2;
+    }
+    uint32_t limit = options.limit;
+    ListColumn_t sort = options.sort;
+    bool descending = options.descending;
+    ok = ok && listParseOptions(argc - next, argv + next, &options);
+    if (!ok)
+    {
+        if (error[0] != '\0')
+            fprintf(stderr, "%s\n", error);
+        fprintf(stderr, "Usage: top K [by] COLUMN[:asc] [--where EXPRESSION] [--offset N] [--format table|tsv]\n"
+                        "COLUMN is one of id, account_number, name, surname, address, pesel, balance, debt\n");
+        return 1;
+    }
+    options.limit = limit;
+    options.sort = sort;
+    options.descending = descending;
+
+    SlotList_t matches = { 0 };
+    if (filtered && !queryRun(&query, &matches))
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    ok = listAccounts(STDOUT_FILENO, filtered ? &matches : NULL, &options);
+    slotListFree(&matches);
+    if (!ok)
+        fprintf(stderr, "Error writing the listing\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "index.h"
+
+// Account listings formatted by hand into a large buffer that goes out with
+// write(2) whenever it fills, so a page is a single write and a full dump
+// costs a write per megabyte instead of a printf per row. Tables match the
+// menus' layout; the tsv format has a header line of column names and the
+// raw fields separated by tabs, for scripts.
+typedef enum {
+    LIST_ID,
+    LIST_ACCOUNT,
+    LIST_NAME,
+    LIST_SURNAME,
+    LIST_ADDRESS,
+    LIST_PESEL,
+    LIST_BALANCE,
+    LIST_DEBT,
+    LIST_COLUMNS
+} ListColumn_t;
+
+typedef enum {
+    LIST_TABLE,
+    LIST_TSV
+} ListFormat_t;
+
+typedef struct {
+    ListFormat_t format;
+    ListColumn_t sort;
+    bool descending;
+    uint32_t offset;
+    // 0 lists everything after the offset
+    uint32_t limit;
+    // Row printed by tables that list nothing, if not NULL
+    const char *empty_message;
+} ListOptions_t;
+
+// Lists the accounts in slots, or every account when slots is NULL, to fd.
+// Accounts come in order of options->sort, ties in id order. Takes the
+// store lock itself.
+//
+// A short listing from near the start of the order (a top-K) is picked
+// out with a bounded heap in one pass; longer ones sort everything, and
+// full orders of every account are kept, up to a few of them, until the
+// store changes in a way that affects their column.
+bool listAccounts(int fd, const SlotList_t *slots, const ListOptions_t *options);
+
+// Collects the slots listAccounts would list, in its order
+bool listOrder(const SlotList_t *slots, const ListOptions_t *options, SlotList_t *ordered);
+
+// Accepts the column names of the tsv header, "name" and "surname"
+bool listColumnByName(const char *name, ListColumn_t *column);
+
+// Reads the --limit, --offset, --sort and --format options shared by the
+// commands that print listings
+bool listParseOptions(int argc, char *argv[], ListOptions_t *options);
+
+// list [--limit N] [--offset N] [--sort COLUMN[:desc]] [--format table|tsv]
+int runList(int argc, char *argv[]);
+
+// top K [by] COLUMN[:asc] [--where EXPRESSION] [--offset N] [--format table|tsv],
+// the K largest first unless :asc is given
+int runTop(int argc, char *argv[]);
@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,48 +7,30 @@
 #include <stdint.h>
 #include <time.h>
 #include <assert.h>
-
-// Constants and type definitions
-#define CHARBUFFER 50
-#define ADDRBUFFER 150
-#define BUFFER 256
-#define IBAN_LENGTH 8  
-#define PESEL_LENGTH 11
-#define ID_LEN 4
-#define BALANCE_SIZE_C 12
-#define DEBT_SIZE_C 12
-#define PRECISION 2
-#define LINE_LENGTH 120 
-#define DATA_FILE "accounts.dat"
-#define COUNTRY "PL"
-#define BANK_CODE "1234"
-#define CASH_MIN 0.0
-#define CASH_MAX 999999.99
-#define LOAN_MAX 50000.0
-#define MONTHS_OF_PAYMENT 12
-
-typedef enum {
-    INPUT_SUCCESS = 0,
-    INPUT_GO_BACK = 1,
-    INPUT_ERROR = 2
-} InputStatus_t;
-
-typedef char Fixed_string[CHARBUFFER];
-typedef char Address[ADDRBUFFER];
-typedef char PESEL[PESEL_LENGTH + 1];
-typedef char IBAN[IBAN_LENGTH + 1];
-
-typedef struct
-{
-    uint32_t id;
-    IBAN account_number;
-    Fixed_string first_name;
-    Fixed_string last_name;
-    Address address;
-    PESEL pesel_number;
-    double balance;
-    double debt;
-} Account_t;
+#include <unistd.h>
+
+#include "bank.h"
+#include "batch.h"
+#include "bench.h"
+#include "csv.h"
+#include "index.h"
+#include "journal.h"
+#include "listing.h"
+#include "metrics.h"
+#include "money.h"
+#include "monthend.h"
+#include "operations.h"
+#include "query.h"
+#include "report.h"
+#include "server.h"
+#include "stress.h"
+#include "store.h"
+#include "util.h"
+
+// Accounts per page of the menu listings
+#define PAGE_ROWS 20
+#define COMPLETION_ROWS 8
+#define HISTORY_ROWS 20
 
 typedef struct {
     char *headers[8];
@@ -58,6 +41,7 @@ typedef struct {
 char quit_flag = 0;
 
 // Function declarations
+void clearScreen();
 void printActions();
 void printModifyingOptions();
 void printDisplayOptions();
@@ -69,15 +53,18 @@ void printSearchOptions();
 void printHelpMenu();
 void printErrorAndWait(const char* error_msg);
 InputStatus_t getString(char *str, int size, const char *msg, bool clear);
-bool checkLetters(char *string);
-bool noLetters(char *string);
-bool checkDigits(char *string);
 InputStatus_t getDouble(double *value, double min, double max, const char *msg);
+InputStatus_t getCount(uint32_t *value, uint32_t max, const char *msg);
+InputStatus_t getMoney(Money_t *value, Money_t min, Money_t max, const char *msg);
 void printAccount(Account_t acc);
 void printLine();
 void printAllList();
 void printListHeader();
 void printAccounts(Fixed_string key, bool (*condition)(Account_t ref, Fixed_string key));
+void printAccountList(const SlotList_t *matches);
+void printAccountPages(const SlotList_t *matches, const ListOptions_t *listing);
+void printSortedList();
+void printNamePages(SearchField_t field, const char *key);
 
 bool findName(Account_t ref, Fixed_string key);
 bool findSurname(Account_t ref, Fixed_string key);
@@ -85,7 +72,9 @@ bool findAddress(Account_t ref, Fixed_string key);
 bool findPESEL(Account_t ref, Fixed_string key);
 bool findAccountNumber(Account_t ref, Fixed_string key);
 InputStatus_t getSearchKey(char *search_key, short len);
+void searchQuery();
 void searchList();
+void printHistory();
 
 void transferMoney();
 void makeDeposit();
@@ -105,8 +94,6 @@ InputStatus_t getName(Account_t *new);
 InputStatus_t getLocation(Account_t *new);
 InputStatus_t getBalance(Account_t *new);
 InputStatus_t getDebtInfo(Account_t *new);
-void generateIBAN(Account_t *new);
-bool isIBANoverlapping(IBAN check_val);
 uint32_t getLastID();
 void createAccount();
 
@@ -114,6 +101,7 @@ int getAction();
 void chooseAction();
 void chooseModifyingOperation();
 void chooseDisplayOperation();
+int runCommand(int argc, char *argv[]);
 
 //----------------> FUNCTION IMPLEMENTATIONS <----------------
 
@@ -155,10 +143,33 @@ InputStatus_t getSearchKey(char *search_key, short len)
     return getString(search_key, len, "Enter search key (or 'r' to return): ", true);
 }
 
+void searchQuery()
+{
+    Address text;
+    Query_t query;
+    char error[BUFFER];
+    while (1)
+    {
+        if (getString(text, ADDRBUFFER, "Enter query (or 'r' to return): ", false) == INPUT_GO_BACK)
+            return;
+        if (queryCompile(text, &query, error))
+            break;
+        printErrorAndWait(error);
+    }
+
+    SlotList_t matches = { 0 };
+    if (queryRun(&query, &matches))
+        printAccountList(&matches);
+    else
+        printErrorAndWait("Out of memory");
+    slotListFree(&matches);
+}
+
 void searchList()
 {
     printSearchOptions();
     bool (*searchFun)(Account_t ref, Fixed_string key);
+    SearchField_t field;
     short len = CHARBUFFER;
     Fixed_string search_type;
     Address search_key;
@@ -171,47 +182,77 @@ void searchList()
         if (strcmp(search_type, "account") == 0)
         {
             searchFun = &findAccountNumber;
+            field = SEARCH_ACCOUNT;
             len = IBAN_LENGTH + 1;
             break;
         }
         else if (strcmp(search_type, "name") == 0)
         {
             searchFun = &findName;
+            field = SEARCH_NAME;
             break;
         }
         else if (strcmp(search_type, "surname") == 0)
         {
             searchFun = &findSurname;
+            field = SEARCH_SURNAME;
             break;
         }
         else if (strcmp(search_type, "address") == 0)
         {
             searchFun = &findAddress;
+            field = SEARCH_ADDRESS;
             len = ADDRBUFFER + 1;
             break;
         }
+        else if (strcmp(search_type, "query") == 0)
+        {
+            searchQuery();
+            return;
+        }
         else if (strcmp(search_type, "pesel") == 0)
         {
             searchFun = &findPESEL;
+            field = SEARCH_PESEL;
             len = PESEL_LENGTH + 1;
             break;
         }
         else
         {
-            printErrorAndWait("Invalid search type. Valid options: account, name, surname, address, pesel");
+            printErrorAndWait("Invalid search type. Valid options: account, name, surname, address, pesel, query");
         }
     }
     
     if (getSearchKey(search_key, len) == INPUT_GO_BACK)
         return;
         
-    printAccounts(search_key, searchFun);
+    size_t key_length = strlen(search_key);
+    if ((field == SEARCH_NAME || field == SEARCH_SURNAME) &&
+        (search_key[0] == '=' || (key_length > 0 && search_key[key_length - 1] == '*')))
+    {
+        printNamePages(field, search_key);
+        return;
+    }
+
+    SlotList_t matches = { 0 };
+    if (indexSearch(field, search_key, &matches))
+        printAccountList(&matches);
+    else
+        printAccounts(search_key, searchFun);
+    slotListFree(&matches);
 }
 
 // Prompt functions
+void clearScreen()
+{
+    uint64_t start = metricStart();
+    bool cleared = system("clear") == 0;
+    metricEnd(METRIC_CLEAR_SCREEN, start, cleared);
+}
+
 void printActions()
 {
-    system("clear");
+    clearScreen();
     printf("Choose what you want to do\n");
     printf("1. Accounts modifications\n");
     printf("2. Accounts listing\n");
@@ -221,7 +262,7 @@ void printActions()
 
 void printModifyingOptions()
 {
-    system("clear");
+    clearScreen();
     printf("Choose what you want to do\n");
     printf("1. Create a new account\n");
     printf("2. Make a deposit\n");
@@ -233,29 +274,31 @@ void printModifyingOptions()
 
 void printDisplayOptions()
 {
-    system("clear");
+    clearScreen();
     printf("Choose what you want to do\n");
     printf("1. List all accounts\n");
     printf("2. Search an account\n");
+    printf("3. Account history\n");
+    printf("4. Top accounts by balance, debt or any column\n");
 }
 
 void printOutOfRange()
 {
-    system("clear");
+    clearScreen();
     printf("Value overflow, operation terminated\n");
     waitingForReturn();
 }
 
 void printSuccess()
 {
-    system("clear");
+    clearScreen();
     printf("Operation successful\n");
     waitingForReturn();
 }
 
 void printAbort()
 {
-    system("clear");
+    clearScreen();
     printf("Operation aborted\n");
     waitingForReturn();
 }
@@ -272,18 +315,21 @@ void waitingForReturn()
 
 void printSearchOptions()
 {
-    system("clear");
+    clearScreen();
     printf("Enter by what you want to search\n");
     printf("account\t-\taccount number\n");
     printf("name\t-\tfirst name\n");
     printf("surname\t-\tlast name\n");
     printf("address\t-\taddress\n");
     printf("pesel\t-\tPESEL number\n");
+    printf("query\t-\tterms joined by AND, e.g. surname^=Kow AND balance>10000 AND debt=0\n");
+    printf("Names match anywhere by default; end the key with '*' to match the\n"
+           "beginning only (Kow*) or start it with '=' for an exact match (=Kowalski)\n");
 }
 
 void printHelpMenu()
 {
-    system("clear");
+    clearScreen();
     printf("Simple Bank Program:\n"
            "- Create accounts, deposits, withdrawals, transfers, loans, debt payments\n"
            "- List or search accounts\n"
@@ -298,7 +344,7 @@ InputStatus_t getString(char *str, int size, const char *msg, bool clear)
     while (1)
     {
         if (clear)
-            system("clear");
+            clearScreen();
         printf("%s", msg);
         if (fgets(buffer, BUFFER, stdin) == NULL) {
             printErrorAndWait("Failed to read input");
@@ -340,50 +386,76 @@ InputStatus_t getString(char *str, int size, const char *msg, bool clear)
     return INPUT_SUCCESS;
 }
 
-bool checkLetters(char *string)
+InputStatus_t getDouble(double *value, double min, double max, const char *msg)
 {
-    if (string == NULL || strlen(string) == 0)
-        return false;
-        
-    for (size_t i = 0; i < strlen(string); i++)
+    char buffer[CHARBUFFER];
+    char message[BUFFER];
+    sprintf(message, "Enter value of %s (%.2f - %.2f, or 'r' to return): ", msg, min, max);
+    
+    while (1)
     {
-        if (!isalpha(string[i]) && string[i] != ' ')
-            return false;
-    }
-    return true;
-}
-
-bool noLetters(char *string)
-{
-    if (string == NULL)
-        return true;
+        InputStatus_t status = getString(buffer, CHARBUFFER, message, true);
+        if (status == INPUT_GO_BACK)
+            return INPUT_GO_BACK;
+        if (status == INPUT_ERROR)
+            return INPUT_ERROR;
+            
+        char *endptr;
+        *value = strtod(buffer, &endptr);
         
-    for (size_t i = 0; i < strlen(string); i++)
-    {
-        if (isalpha(string[i]))
-            return false;
+        if (*endptr != '\0' || endptr == buffer || !isfinite(*value)) {
+            printErrorAndWait("Invalid number format, please enter a valid decimal number");
+            continue;
+        }
+        
+        if (*value < min || *value > max) {
+            char error_msg[BUFFER];
+            sprintf(error_msg, "Value must be between %.2f and %.2f", min, max);
+            printErrorAndWait(error_msg);
+            continue;
+        }
+        
+        break;
     }
-    return true;
+
+    return INPUT_SUCCESS;
 }
 
-bool checkDigits(char *string)
+InputStatus_t getCount(uint32_t *value, uint32_t max, const char *msg)
 {
-    if (string == NULL || strlen(string) == 0)
-        return false;
-        
-    for (size_t i = 0; i < strlen(string); i++)
+    char buffer[CHARBUFFER];
+    char message[BUFFER];
+    sprintf(message, "Enter %s (0 - %u, or 'r' to return): ", msg, max);
+    
+    while (1)
     {
-        if (!isdigit(string[i]))
-            return false;
+        InputStatus_t status = getString(buffer, CHARBUFFER, message, true);
+        if (status == INPUT_GO_BACK)
+            return INPUT_GO_BACK;
+        if (status == INPUT_ERROR)
+            return INPUT_ERROR;
+            
+        if (!parseCount(buffer, max, value)) {
+            char error_msg[BUFFER];
+            sprintf(error_msg, "Please enter a whole number between 0 and %u", max);
+            printErrorAndWait(error_msg);
+            continue;
+        }
+        
+        break;
     }
-    return true;
+
+    return INPUT_SUCCESS;
 }
 
-InputStatus_t getDouble(double *value, double min, double max, const char *msg)
+InputStatus_t getMoney(Money_t *value, Money_t min, Money_t max, const char *msg)
 {
     char buffer[CHARBUFFER];
     char message[BUFFER];
-    sprintf(message, "Enter value of %s (%.2f - %.2f, or 'r' to return): ", msg, min, max);
+    char low[MONEY_BUFFER], high[MONEY_BUFFER];
+    formatMoney(min, low);
+    formatMoney(max, high);
+    sprintf(message, "Enter value of %s (%s - %s, or 'r' to return): ", msg, low, high);
     
     while (1)
     {
@@ -393,17 +465,14 @@ InputStatus_t getDouble(double *value, double min, double max, const char *msg)
         if (status == INPUT_ERROR)
             return INPUT_ERROR;
             
-        char *endptr;
-        *value = strtod(buffer, &endptr);
-        
-        if (*endptr != '\0' || endptr == buffer) {
-            printErrorAndWait("Invalid number format, please enter a valid decimal number");
+        if (!parseMoney(buffer, value)) {
+            printErrorAndWait("Invalid number format, please enter an amount with at most two decimals");
             continue;
         }
         
         if (*value < min || *value > max) {
             char error_msg[BUFFER];
-            sprintf(error_msg, "Value must be between %.2f and %.2f", min, max);
+            sprintf(error_msg, "Value must be between %s and %s", low, high);
             printErrorAndWait(error_msg);
             continue;
         }
@@ -416,15 +485,18 @@ InputStatus_t getDouble(double *value, double min, double max, const char *msg)
 
 void printAccount(Account_t acc)
 {
-    printf("| %4u | %-8s | %-15s | %-15s | %-30s | %-11s | %10.2f | %10.2f |\n", 
+    char balance[MONEY_BUFFER], debt[MONEY_BUFFER];
+    formatMoney(acc.balance, balance);
+    formatMoney(acc.debt, debt);
+    printf("| %4u | %-8s | %-15s | %-15s | %-30s | %-11s | %10s | %10s |\n", 
            acc.id, 
            acc.account_number, 
            acc.first_name, 
            acc.last_name, 
            acc.address, 
            acc.pesel_number, 
-           acc.balance, 
-           acc.debt);
+           balance, 
+           debt);
 }
 
 void printLine()
@@ -456,37 +528,173 @@ void printListHeader()
 
 void printAccounts(Fixed_string key, bool (*condition)(Account_t ref, Fixed_string key))
 {
-    FILE *print_f = fopen(DATA_FILE, "rb");
-    if (print_f == NULL)
+    if (condition == NULL)
     {
-        printf("No accounts found or error opening file!\n");
-        waitingForReturn();
+        ListOptions_t listing = { LIST_TABLE, LIST_ID, false, 0, 0, NULL };
+        printAccountPages(NULL, &listing);
         return;
     }
-    
-    Account_t print;
-    bool found_any = false;
-    system("clear");
-    printLine();
-    printListHeader();
-    printLine();
-    
-    while (fread(&print, sizeof(Account_t), 1, print_f))
+
+    SlotList_t matches = { 0 };
+    bool ok = true;
+    for (uint32_t slot = 0; ok && slot < storeSlots(); slot++)
+    {
+        Account_t print;
+        if (storeRead(slot, &print) && condition(print, key))
+            ok = slotListAppend(&matches, slot);
+    }
+    if (ok)
+        printAccountList(&matches);
+    else
+        printErrorAndWait("Out of memory");
+    slotListFree(&matches);
+}
+
+void printAccountList(const SlotList_t *matches)
+{
+    ListOptions_t listing = { LIST_TABLE, LIST_ID, false, 0, 0, "No accounts found matching the search criteria" };
+    printAccountPages(matches, &listing);
+}
+
+// Shows PAGE_ROWS accounts at a time, in the order listing asks for and
+// no more than its limit (if set) in all, until the user returns
+void printAccountPages(const SlotList_t *matches, const ListOptions_t *listing)
+{
+    ListOptions_t options = *listing;
+    options.offset = 0;
+    while (1)
     {
-        if (condition == NULL || (condition != NULL && condition(print, key)))
+        uint32_t total = matches != NULL ? (uint32_t)matches->count : storeCount();
+        if (listing->limit != 0 && listing->limit < total)
+            total = listing->limit;
+        uint32_t pages = total > 0 ? (total + PAGE_ROWS - 1) / PAGE_ROWS : 1;
+        if (options.offset >= total && options.offset > 0)
+            options.offset = (pages - 1) * PAGE_ROWS;
+        options.limit = total - options.offset < PAGE_ROWS ? total - options.offset : PAGE_ROWS;
+
+        uint64_t start = metricStart();
+        clearScreen();
+        fflush(stdout);
+        bool listed = listAccounts(STDOUT_FILENO, matches, &options);
+        metricEnd(METRIC_PRINT_ACCOUNTS, start, listed);
+        if (!listed)
         {
-            printAccount(print);
-            found_any = true;
+            printErrorAndWait("Error listing accounts");
+            return;
         }
+
+        printf("Page %u of %u - 'n' next, 'p' previous, 'r' return\n", options.offset / PAGE_ROWS + 1, pages);
+        int key = getAction();
+        if ((key == 'n' || key == 'N') && options.offset + PAGE_ROWS < total)
+            options.offset += PAGE_ROWS;
+        else if ((key == 'p' || key == 'P') && options.offset >= PAGE_ROWS)
+            options.offset -= PAGE_ROWS;
+        else if (key == 'r' || key == 'R' || key == EOF)
+            return;
     }
-    
-    if (!found_any && condition != NULL)
+}
+
+// Pages through a name search in name order straight from the index, a
+// page at a time, with the names completing a prefix above the prompt
+void printNamePages(SearchField_t field, const char *key)
+{
+    ListOptions_t options = { LIST_TABLE, field == SEARCH_NAME ? LIST_NAME : LIST_SURNAME, false, 0, 0,
+                              "No accounts found matching the search criteria" };
+    Fixed_string prefix;
+    size_t length = strlen(key);
+    bool exact = key[0] == '=';
+    snprintf(prefix, sizeof(prefix), "%.*s", (int)(exact ? length : length - 1), key);
+    NameCount_t names[COMPLETION_ROWS];
+    size_t found = 0;
+    if (!exact && !indexCompletions(field, prefix, names, COMPLETION_ROWS, &found))
+        found = 0;
+
+    size_t offset = 0;
+    while (1)
     {
-        printf("| %-110s |\n", "No accounts found matching the search criteria");
+        SlotList_t page = { 0 };
+        size_t total = 0;
+        uint64_t start = metricStart();
+        clearScreen();
+        fflush(stdout);
+        bool listed = indexNamePage(field, prefix, offset, PAGE_ROWS, &page, &total) &&
+                      listAccounts(STDOUT_FILENO, &page, &options);
+        metricEnd(METRIC_PRINT_ACCOUNTS, start, listed);
+        slotListFree(&page);
+        if (!listed)
+        {
+            printErrorAndWait("Error listing accounts");
+            return;
+        }
+
+        if (found > 0)
+        {
+            printf("%s starting with '%s':", field == SEARCH_NAME ? "Names" : "Surnames", prefix);
+            for (size_t i = 0; i < found; i++)
+                printf("%s %s (%zu)", i > 0 ? "," : "", names[i].name, names[i].count);
+            printf("%s\n", found == COMPLETION_ROWS ? ", ..." : "");
+        }
+        size_t pages = total > 0 ? (total + PAGE_ROWS - 1) / PAGE_ROWS : 1;
+        printf("Page %zu of %zu (%zu accounts) - 'n' next, 'p' previous, 'r' return\n", offset / PAGE_ROWS + 1,
+               pages, total);
+        int action = getAction();
+        if ((action == 'n' || action == 'N') && offset + PAGE_ROWS < total)
+            offset += PAGE_ROWS;
+        else if ((action == 'p' || action == 'P') && offset >= PAGE_ROWS)
+            offset -= PAGE_ROWS;
+        else if (action == 'r' || action == 'R' || action == EOF)
+            return;
     }
-    
-    printLine();
-    fclose(print_f);
+}
+
+// Largest (or smallest) first by any column, e.g. the biggest debtors
+void printSortedList()
+{
+    ListOptions_t listing = { LIST_TABLE, LIST_DEBT, true, 0, 0, NULL };
+    Fixed_string column;
+    while (1)
+    {
+        if (getString(column, CHARBUFFER, "Sort by (balance, debt, id, account_number, name, surname, address, "
+                      "pesel; add ':asc' for smallest first, or 'r' to return): ", true) == INPUT_GO_BACK)
+            return;
+        char *order = strchr(column, ':');
+        if (order != NULL)
+            *order++ = '\0';
+        listing.descending = order == NULL || strcmp(order, "desc") == 0;
+        if (listColumnByName(column, &listing.sort) && (order == NULL || listing.descending || strcmp(order, "asc") == 0))
+            break;
+        printErrorAndWait("Invalid column or order");
+    }
+
+    if (getCount(&listing.limit, storeCount(), "how many accounts to show (0 for all)") != INPUT_SUCCESS)
+        return;
+    printAccountPages(NULL, &listing);
+}
+
+// Shows the newest HISTORY_ROWS transactions of an account
+void printHistory()
+{
+    bool found = false;
+    Account_t account;
+    if (findAccount("the", &found, &account) == INPUT_GO_BACK)
+        return;
+    if (!found)
+    {
+        printErrorAndWait("Account was not found");
+        return;
+    }
+
+    JournalList_t entries = { 0 };
+    if (!journalStatement(account.id, 0, 0, HISTORY_ROWS, &entries))
+    {
+        journalListFree(&entries);
+        printErrorAndWait("Error reading the journal");
+        return;
+    }
+    clearScreen();
+    printf("Account %u (%s), %s %s\n", account.id, account.account_number, account.first_name, account.last_name);
+    journalPrint(&entries);
+    journalListFree(&entries);
     waitingForReturn();
 }
 
@@ -519,34 +727,17 @@ void transferMoney()
         return;
     }
     
-    double transfer;
-    if (getDouble(&transfer, 0.01, CASH_MAX, "transfer amount") == INPUT_GO_BACK)
+    Money_t transfer;
+    if (getMoney(&transfer, 1, CASH_MAX, "transfer amount") == INPUT_GO_BACK)
         return;
         
-    if (transfer > source.balance)
-    {
-        char error_msg[BUFFER];
-        sprintf(error_msg, "Insufficient funds. Available balance: %.2f", source.balance);
-        printErrorAndWait(error_msg);
-        return;
-    }
-    
-    if (transfer <= 0)
-    {
-        printErrorAndWait("Transfer amount must be positive");
-        return;
-    }
-    
-    if ((destination.balance + transfer) > CASH_MAX)
+    char error_msg[BUFFER];
+    if (!applyTransfer(&source, &destination, transfer, error_msg))
     {
-        char error_msg[BUFFER];
-        sprintf(error_msg, "Transfer would exceed maximum balance limit of %.2f", CASH_MAX);
         printErrorAndWait(error_msg);
         return;
     }
     
-    source.balance -= transfer;
-    destination.balance += transfer;
     Account_t accs[] = {source, destination};
     perfromTransferUpdate(accs);
 }
@@ -564,25 +755,17 @@ void makeDeposit()
         return;
     }
     
-    double deposit_amount;
-    if (getDouble(&deposit_amount, 0.01, CASH_MAX, "deposit amount") == INPUT_GO_BACK)
+    Money_t deposit_amount;
+    if (getMoney(&deposit_amount, 1, CASH_MAX, "deposit amount") == INPUT_GO_BACK)
         return;
         
-    if (deposit_amount <= 0)
+    char error_msg[BUFFER];
+    if (!applyDeposit(&deposit_acc, deposit_amount, error_msg))
     {
-        printErrorAndWait("Deposit amount must be positive");
-        return;
-    }
-    
-    if ((deposit_acc.balance + deposit_amount) > CASH_MAX)
-    {
-        char error_msg[BUFFER];
-        sprintf(error_msg, "Deposit would exceed maximum balance limit of %.2f", CASH_MAX);
         printErrorAndWait(error_msg);
         return;
     }
     
-    deposit_acc.balance += deposit_amount;
     performOtherUpdate(deposit_acc);
 }
 
@@ -599,25 +782,17 @@ void makeWithdrawal()
         return;
     }
     
-    double withdrawal_amount;
-    if (getDouble(&withdrawal_amount, 0.01, withdrawal_acc.balance, "withdrawal amount") == INPUT_GO_BACK)
+    Money_t withdrawal_amount;
+    if (getMoney(&withdrawal_amount, 1, withdrawal_acc.balance, "withdrawal amount") == INPUT_GO_BACK)
         return;
         
-    if (withdrawal_amount <= 0)
+    char error_msg[BUFFER];
+    if (!applyWithdrawal(&withdrawal_acc, withdrawal_amount, error_msg))
     {
-        printErrorAndWait("Withdrawal amount must be positive");
-        return;
-    }
-    
-    if (withdrawal_amount > withdrawal_acc.balance)
-    {
-        char error_msg[BUFFER];
-        sprintf(error_msg, "Insufficient funds. Available balance: %.2f", withdrawal_acc.balance);
         printErrorAndWait(error_msg);
         return;
     }
     
-    withdrawal_acc.balance -= withdrawal_amount;
     performOtherUpdate(withdrawal_acc);
 }
 
@@ -634,31 +809,21 @@ void takeLoan()
         return;
     }
     
-    double loan;
-    if (getDouble(&loan, 0.01, LOAN_MAX, "loan amount") == INPUT_GO_BACK)
+    Money_t loan;
+    if (getMoney(&loan, 1, LOAN_MAX, "loan amount") == INPUT_GO_BACK)
         return;
         
     double interest_rate;
     if (getDouble(&interest_rate, 0.0, 1.0, "interest rate (as decimal, e.g., 0.05 for 5%)") == INPUT_GO_BACK)
         return;
     
-    if ((loan_acc.balance + loan) > CASH_MAX)
+    char error_msg[BUFFER];
+    if (!applyLoan(&loan_acc, loan, interest_rate, error_msg))
     {
-        char error_msg[BUFFER];
-        sprintf(error_msg, "Loan would exceed maximum balance limit of %.2f", CASH_MAX);
         printErrorAndWait(error_msg);
         return;
     }
     
-    if (loan <= 0)
-    {
-        printErrorAndWait("Loan amount must be positive");
-        return;
-    }
-    
-    loan_acc.balance += loan;
-    double total_loan_with_interest = loan * (1 + interest_rate);
-    loan_acc.debt += total_loan_with_interest;
     performOtherUpdate(loan_acc);
 }
 
@@ -681,28 +846,18 @@ void payDebt()
         return;
     }
     
-    double max_payment = (debt_acc.balance < debt_acc.debt) ? debt_acc.balance : debt_acc.debt;
-    double payment_amount;
-    if (getDouble(&payment_amount, 0.01, max_payment, "payment amount") == INPUT_GO_BACK)
+    Money_t max_payment = (debt_acc.balance < debt_acc.debt) ? debt_acc.balance : debt_acc.debt;
+    Money_t payment_amount;
+    if (getMoney(&payment_amount, 1, max_payment, "payment amount") == INPUT_GO_BACK)
         return;
     
-    if (payment_amount <= 0)
+    char error_msg[BUFFER];
+    if (!applyDebtPayment(&debt_acc, payment_amount, error_msg))
     {
-        printErrorAndWait("Payment amount must be positive");
-        return;
-    }
-    
-    if (payment_amount > debt_acc.balance)
-    {
-        char error_msg[BUFFER];
-        sprintf(error_msg, "Insufficient funds. Available balance: %.2f", debt_acc.balance);
         printErrorAndWait(error_msg);
         return;
     }
     
-    debt_acc.balance -= payment_amount;
-    debt_acc.debt -= payment_amount;
-    if (debt_acc.debt < 0) debt_acc.debt = 0;
     performOtherUpdate(debt_acc);
 }
 
@@ -735,7 +890,7 @@ void performOtherUpdate(Account_t acc)
 
 bool confirmation(Account_t accounts[], bool is_transfer)
 {
-    system("clear");
+    clearScreen();
     printLine();
     printListHeader();
     printLine();
@@ -753,55 +908,24 @@ bool confirmation(Account_t accounts[], bool is_transfer)
 
 void updateAccount(Account_t updated)
 {
-    FILE *update_f = fopen(DATA_FILE, "rb+");
-    if (update_f == NULL)
+    uint64_t start = metricStart();
+    bool updated_ok = storeUpdate(&updated);
+    metricEnd(METRIC_UPDATE_ACCOUNT, start, updated_ok);
+    if (!updated_ok)
     {
-        printErrorAndWait("Error opening file for update");
-        return;
+        printErrorAndWait("Error writing account to file");
     }
-    
-    Account_t temp;
-    bool found = false;
-    long position = 0;
-
-    while (fread(&temp, sizeof(Account_t), 1, update_f))
-    {
-        if (temp.id == updated.id)
-        {
-            found = true;
-            break;
-        }
-        position++;
-    }
-    
-    if (!found)
-    {
-        printErrorAndWait("Account not found for update");
-        fclose(update_f);
-        return;
-    }
-    
-    if (fseek(update_f, position * sizeof(Account_t), SEEK_SET) != 0)
-    {
-        printErrorAndWait("Error seeking file position");
-        fclose(update_f);
-        return;
-    }
-    
-    if (fwrite(&updated, sizeof(Account_t), 1, update_f) != 1)
-    {
-        printErrorAndWait("Error writing to file");
-        fclose(update_f);
-        return;
-    }
-    
-    fclose(update_f);
 }
 
 void updateTransfer(Account_t source, Account_t destination)
 {
-    updateAccount(source);
-    updateAccount(destination);
+    uint64_t start = metricStart();
+    bool transferred = storeTransfer(&source, &destination);
+    metricEnd(METRIC_UPDATE_TRANSFER, start, transferred);
+    if (!transferred)
+    {
+        printErrorAndWait("Error writing transfer to file");
+    }
 }
 
 InputStatus_t findAccount(const char *msg, bool *found, Account_t *account)
@@ -813,7 +937,7 @@ InputStatus_t findAccount(const char *msg, bool *found, Account_t *account)
     
     while (1)
     {
-        system("clear");
+        clearScreen();
         sprintf(prompt, "Enter %s account ID (or 'r' to return): ", msg);
         
         if (getString(buffer, CHARBUFFER, prompt, false) == INPUT_GO_BACK)
@@ -835,27 +959,9 @@ InputStatus_t findAccount(const char *msg, bool *found, Account_t *account)
         break;
     }
     
-    FILE *search_f = fopen(DATA_FILE, "rb");
-    if (search_f == NULL)
-    {
-        printErrorAndWait("Error opening accounts file");
-        *found = false;
-        return INPUT_ERROR;
-    }
-    
-    Account_t temp_account;
-    while (fread(&temp_account, sizeof(Account_t), 1, search_f))
-    {
-        if (temp_account.id == search_by)
-        {
-            fclose(search_f);
-            *found = true;
-            *account = temp_account;
-            return INPUT_SUCCESS;
-        }
-    }
-    fclose(search_f);
-    *found = false;
+    uint64_t start = metricStart();
+    *found = storeGet(search_by, account);
+    metricEnd(METRIC_FIND_ACCOUNT, start, *found);
     return INPUT_SUCCESS;
 }
 
@@ -884,6 +990,12 @@ InputStatus_t getPESEL(Account_t *new)
             printErrorAndWait(error_msg);
             continue;
         }
+
+        char error_msg[BUFFER];
+        if (!checkPESELUnique(buffer, error_msg)) {
+            printErrorAndWait(error_msg);
+            continue;
+        }
         
         break;
     }
@@ -962,71 +1074,17 @@ InputStatus_t getLocation(Account_t *new)
 
 InputStatus_t getBalance(Account_t *new)
 {
-    return getDouble(&new->balance, CASH_MIN, CASH_MAX, "initial balance");
+    return getMoney(&new->balance, CASH_MIN, CASH_MAX, "initial balance");
 }
 
 InputStatus_t getDebtInfo(Account_t *new)
 {
-    return getDouble(&new->debt, 0.0, CASH_MAX, "current debt");
-}
-
-void generateIBAN(Account_t *new)
-{
-    IBAN to_be_generated;
-    do
-    {
-        for (int i = 0; i < IBAN_LENGTH; i++)
-        {
-            to_be_generated[i] = (rand() % 10) + '0';
-        }
-        to_be_generated[IBAN_LENGTH] = '\0';
-        
-    } while (isIBANoverlapping(to_be_generated));
-    
-    strcpy(new->account_number, to_be_generated);
-}
-
-bool isIBANoverlapping(IBAN check_val)
-{
-    FILE *check_f = fopen(DATA_FILE, "rb");
-    if (check_f == NULL)
-    {
-        return false;
-    }
-    Account_t check;
-    while (fread(&check, sizeof(Account_t), 1, check_f))
-    {
-        if (strcmp(check.account_number, check_val) == 0)
-        {
-            fclose(check_f);
-            return true;
-        }
-    }
-    fclose(check_f);
-    return false;
+    return getMoney(&new->debt, 0, CASH_MAX, "current debt");
 }
 
 uint32_t getLastID()
 {
-    FILE *seek_file = fopen(DATA_FILE, "rb");
-    if (seek_file == NULL)
-    {
-        return 0;
-    }
-    
-    Account_t last;
-    uint32_t last_id = 0;
-    
-    while (fread(&last, sizeof(Account_t), 1, seek_file))
-    {
-        if (last.id > last_id)
-        {
-            last_id = last.id;
-        }
-    }
-    
-    fclose(seek_file);
-    return last_id;
+    return storeLastID();
 }
 
 void createAccount()
@@ -1034,7 +1092,11 @@ void createAccount()
     Account_t new;
     memset(&new, 0, sizeof(Account_t)); 
     new.id = getLastID() + 1;
-    generateIBAN(&new);
+    if (!generateIBAN(&new))
+    {
+        printErrorAndWait("No free account numbers left");
+        return;
+    }
     
     if (getName(&new) == INPUT_GO_BACK) return;
     if (getPESEL(&new) == INPUT_GO_BACK) return;
@@ -1044,21 +1106,15 @@ void createAccount()
     
     if (confirmation(&new, false))
     {
-        FILE *append_file = fopen(DATA_FILE, "ab");
-        if (append_file == NULL)
-        {
-            printf("Error opening file!\n");
-            waitingForReturn();
-            return;
-        }
-        if (fwrite(&new, sizeof(Account_t), 1, append_file) != 1)
+        uint64_t start = metricStart();
+        bool created = storeAppend(&new);
+        metricEnd(METRIC_CREATE_ACCOUNT, start, created);
+        if (!created)
         {
             printf("Error writing to file!\n");
-            fclose(append_file);
             waitingForReturn();
             return;
         }
-        fclose(append_file);
         printSuccess();
     }
     else
@@ -1133,7 +1189,7 @@ void chooseModifyingOperation()
 void chooseDisplayOperation()
 {
     void (*functionPointer)(void);
-    system("clear");
+    clearScreen();
     printDisplayOptions();
     int key = getAction();
 
@@ -1145,15 +1201,103 @@ void chooseDisplayOperation()
     case '2':
         functionPointer = &searchList;
         break;
+    case '3':
+        functionPointer = &printHistory;
+        break;
+    case '4':
+        functionPointer = &printSortedList;
+        break;
     default:
         return;
     }
     (*functionPointer)();
 }
 
+// Command line operations, run instead of the menus when named as the
+// first argument. Those that do not use the bank's files open their own.
+typedef struct {
+    const char *name;
+    int (*run)(int argc, char *argv[]);
+    bool uses_bank;
+    const char *usage;
+} Command_t;
+
+static const Command_t commands[] = {
+    { "batch", runBatch, true, "batch [FILE]\t- apply operations from FILE (or stdin) without the menus" },
+    { "serve", runServer, true, "serve [SOCKET [WORKERS]]\t- serve clients over a Unix domain socket until stopped" },
+    { "import", runImport, true, "import FILE [THREADS]\t- add the accounts in a CSV file, parsed in parallel" },
+    { "export", runExport, true, "export [FILE]\t- write every account to FILE (or stdout) as CSV" },
+    { "list", runList, true, "list [--limit N] [--offset N] [--sort COLUMN[:desc]] [--format table|tsv]\t- page through the accounts" },
+    { "complete", runComplete, true, "complete name|surname PREFIX [LIMIT]\t- names starting with PREFIX and their account counts" },
+    { "top", runTop, true, "top K [by] COLUMN[:asc] [--where EXPRESSION] [--format table|tsv]\t- the K largest balances, debts or other columns" },
+    { "query", runQuery, true, "query EXPRESSION... [--limit N] [--sort COLUMN[:desc]] [--format table|tsv]\t- accounts matching terms like 'surname^=Kow AND debt>0'" },
+    { "statement", runStatement, true, "statement ID [--last N] [--from DATE] [--to DATE]\t- transactions of an account, newest first" },
+    { "monthend", runMonthEnd, true, "monthend RATE [THREADS]\t- accrue a month of interest on every debt and collect its instalment" },
+    { "report", runReport, true, "report [DEBT...]\t- totals, debt counts above each DEBT, histogram and percentiles" },
+    { "bench", runBench, false, "bench [ACCOUNTS [OPERATIONS [MIX [THREADS]]]]\t- latency of a synthetic workload on a scratch store" },
+    { "stress", runStress, false, "stress [THREADS [TRANSFERS]]\t- check concurrent transfers on a scratch store" },
+};
+
+#define COMMANDS_COUNT (sizeof(commands) / sizeof(commands[0]))
+
+const Command_t *findCommand(const char *name)
+{
+    for (size_t i = 0; i < COMMANDS_COUNT; i++)
+    {
+        if (strcmp(name, commands[i].name) == 0)
+            return &commands[i];
+    }
+    
+    fprintf(stderr, "Unknown command '%s'. Usage:\n", name);
+    for (size_t i = 0; i < COMMANDS_COUNT; i++)
+    {
+        fprintf(stderr, "  main %s\n", commands[i].usage);
+    }
+    return NULL;
+}
+
 int main(int argc, char *argv[])
 {
     srand((unsigned int)time(NULL));  
+    metricsStart();
+    atexit(metricsStop);
+    const Command_t *command = NULL;
+    if (argc > 1)
+    {
+        command = findCommand(argv[1]);
+        if (command == NULL)
+            return 1;
+        if (!command->uses_bank)
+            return command->run(argc - 1, argv + 1);
+    }
+    // The journal goes first, replaying the log may add to it
+    if (!journalOpen(JOURNAL_FILE, JOURNAL_HEADS_FILE))
+    {
+        fprintf(stderr, "Error opening %s\n", JOURNAL_FILE);
+        return 1;
+    }
+    if (!storeOpen(DATA_FILE, HOT_FILE, WAL_FILE, SNAPSHOT_FILE))
+    {
+        fprintf(stderr, "Error opening %s\n", DATA_FILE);
+        journalClose();
+        return 1;
+    }
+    if (!indexOpen(INDEX_FILE))
+    {
+        fprintf(stderr, "Error building search indexes\n");
+        storeClose();
+        journalClose();
+        return 1;
+    }
+    
+    if (command != NULL)
+    {
+        int status = command->run(argc - 1, argv + 1);
+        indexClose();
+        storeClose();
+        journalClose();
+        return status;
+    }
     
     while (1)
     {
@@ -1164,5 +1308,8 @@ int main(int argc, char *argv[])
         }
     }
 
+    indexClose();
+    storeClose();
+    journalClose();
     return 0;
 }
@@ -0,0 +1,206 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bank.h"
+#include "histogram.h"
+#include "metrics.h"
+
+#define METRICS_DEFAULT_INTERVAL 10
+
+typedef struct
+{
+    atomic_uint_fast64_t failures;
+    atomic_uint_fast64_t bytes_read;
+    atomic_uint_fast64_t bytes_written;
+    // Its count is the number of calls
+    Histogram_t latency;
+} OperationMetrics_t;
+
+static const char *metric_names[METRIC_COUNT] = {
+    "find_account", "update_account", "update_transfer", "create_account", "iban_check", "pesel_check",
+    "print_accounts", "clear_screen", "batch_line", "store_open", "store_get", "store_stage", "store_commit",
+    "store_checkpoint", "store_load", "wal_commit", "index_open", "index_search", "index_save", "query",
+};
+
+// Prometheus bucket bounds in seconds, 1-2.5-5 steps from a microsecond to
+// ten seconds; the histograms are finer and are summed into these
+static const double bucket_bounds[] = {
+    1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3,
+    5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0,
+};
+
+static const double quantiles[] = { 0.5, 0.99, 0.999 };
+
+#define BOUNDS_COUNT (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]))
+#define QUANTILES_COUNT (sizeof(quantiles) / sizeof(quantiles[0]))
+
+static OperationMetrics_t metrics[METRIC_COUNT];
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    // Held across a dump, as the thread and SIGUSR1 share the temporary file
+    pthread_mutex_t dumping;
+    pthread_t thread;
+    bool running;
+    bool stopping;
+    unsigned interval;
+} dumper = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+
+uint64_t metricStart()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+void metricEnd(Metric_t metric, uint64_t start, bool succeeded)
+{
+    histogramRecord(&metrics[metric].latency, metricStart() - start);
+    if (!succeeded)
+        atomic_fetch_add_explicit(&metrics[metric].failures, 1, memory_order_relaxed);
+}
+
+void metricRead(Metric_t metric, uint64_t bytes)
+{
+    atomic_fetch_add_explicit(&metrics[metric].bytes_read, bytes, memory_order_relaxed);
+}
+
+void metricWritten(Metric_t metric, uint64_t bytes)
+{
+    atomic_fetch_add_explicit(&metrics[metric].bytes_written, bytes, memory_order_relaxed);
+}
+
+static void writeCounter(FILE *file, const char *name, const char *help, size_t offset)
+{
+    fprintf(file, "# HELP bank_operation_%s %s\n# TYPE bank_operation_%s counter\n", name, help, name);
+    for (int m = 0; m < METRIC_COUNT; m++)
+    {
+        const atomic_uint_fast64_t *value = (const atomic_uint_fast64_t *)((const char *)&metrics[m] + offset);
+        fprintf(file, "bank_operation_%s{op=\"%s\"} %lu\n", name, metric_names[m], (unsigned long)atomic_load(value));
+    }
+}
+
+static void writeHistogram(FILE *file, Metric_t metric)
+{
+    const Histogram_t *latency = &metrics[metric].latency;
+    const char *name = metric_names[metric];
+    uint64_t cumulative = 0;
+    uint32_t bucket = 0;
+    for (size_t b = 0; b < BOUNDS_COUNT; b++)
+    {
+        uint64_t bound_ns = (uint64_t)(bucket_bounds[b] * 1e9 + 0.5);
+        while (bucket < HISTOGRAM_BUCKETS && histogramBucketLimit(bucket) <= bound_ns)
+            cumulative += atomic_load_explicit(&latency->counts[bucket++], memory_order_relaxed);
+        fprintf(file, "bank_operation_latency_seconds_bucket{op=\"%s\",le=\"%g\"} %lu\n", name, bucket_bounds[b],
+                (unsigned long)cumulative);
+    }
+    uint64_t count = atomic_load(&latency->count);
+    fprintf(file, "bank_operation_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %lu\n", name, (unsigned long)count);
+    fprintf(file, "bank_operation_latency_seconds_sum{op=\"%s\"} %.9f\n", name, atomic_load(&latency->sum) / 1e9);
+    fprintf(file, "bank_operation_latency_seconds_count{op=\"%s\"} %lu\n", name, (unsigned long)count);
+}
+
+bool metricsWrite(FILE *file)
+{
+    fprintf(file, "# HELP bank_operation_calls_total Calls of each operation.\n"
+                  "# TYPE bank_operation_calls_total counter\n");
+    for (int m = 0; m < METRIC_COUNT; m++)
+        fprintf(file, "bank_operation_calls_total{op=\"%s\"} %lu\n", metric_names[m],
+                (unsigned long)atomic_load(&metrics[m].latency.count));
+    writeCounter(file, "failures_total", "Calls that failed.", offsetof(OperationMetrics_t, failures));
+    writeCounter(file, "read_bytes_total", "Bytes read from files.", offsetof(OperationMetrics_t, bytes_read));
+    writeCounter(file, "written_bytes_total", "Bytes written to files.",
+                 offsetof(OperationMetrics_t, bytes_written));
+
+    fprintf(file, "# HELP bank_operation_latency_seconds Time spent in each call.\n"
+                  "# TYPE bank_operation_latency_seconds histogram\n");
+    for (int m = 0; m < METRIC_COUNT; m++)
+        writeHistogram(file, m);
+
+    fprintf(file, "# HELP bank_operation_latency_quantile_seconds Latency quantiles from the histograms.\n"
+                  "# TYPE bank_operation_latency_quantile_seconds gauge\n");
+    for (int m = 0; m < METRIC_COUNT; m++)
+    {
+        for (size_t q = 0; q < QUANTILES_COUNT; q++)
+            fprintf(file, "bank_operation_latency_quantile_seconds{op=\"%s\",quantile=\"%g\"} %.9f\n",
+                    metric_names[m], quantiles[q], histogramPercentile(&metrics[m].latency, quantiles[q] * 100) / 1e9);
+    }
+    return !ferror(file);
+}
+
+bool metricsDump(const char *path)
+{
+    char tmp_path[BUFFER];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    pthread_mutex_lock(&dumper.dumping);
+    FILE *file = fopen(tmp_path, "w");
+    bool ok = file != NULL && metricsWrite(file);
+    ok = file != NULL && fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0)
+    {
+        remove(tmp_path);
+        ok = false;
+    }
+    pthread_mutex_unlock(&dumper.dumping);
+    return ok;
+}
+
+const char *metricsPath()
+{
+    const char *path = getenv("BANK_METRICS");
+    return path != NULL && *path != '\0' ? path : METRICS_FILE;
+}
+
+static void *dumperMain(void *unused)
+{
+    (void)unused;
+    pthread_mutex_lock(&dumper.lock);
+    while (!dumper.stopping)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += dumper.interval;
+        while (!dumper.stopping && pthread_cond_timedwait(&dumper.wake, &dumper.lock, &deadline) == 0)
+            ;
+        if (!dumper.stopping && !metricsDump(metricsPath()))
+            fprintf(stderr, "Could not write metrics to %s\n", metricsPath());
+    }
+    pthread_mutex_unlock(&dumper.lock);
+    return NULL;
+}
+
+void metricsStart()
+{
+    const char *path = getenv("BANK_METRICS"), *interval = getenv("BANK_METRICS_INTERVAL");
+    if (path == NULL || *path == '\0' || dumper.running)
+        return;
+    dumper.interval = interval != NULL && atoi(interval) > 0 ? (unsigned)atoi(interval) : METRICS_DEFAULT_INTERVAL;
+    dumper.stopping = false;
+    // The thread takes no signals, so the server's signal descriptor still sees them all
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    dumper.running = pthread_create(&dumper.thread, NULL, dumperMain, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+void metricsStop()
+{
+    if (!dumper.running)
+        return;
+    pthread_mutex_lock(&dumper.lock);
+    dumper.stopping = true;
+    pthread_cond_signal(&dumper.wake);
+    pthread_mutex_unlock(&dumper.lock);
+    pthread_join(dumper.thread, NULL);
+    dumper.running = false;
+    if (!metricsDump(metricsPath()))
+        fprintf(stderr, "Could not write metrics to %s\n", metricsPath());
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Per-operation metrics: calls, failures, bytes read and written, and an
+// HDR-style latency histogram. Recording costs two clock reads and a few
+// relaxed atomic adds, so it stays on everywhere. Interactive operations
+// are timed without the time spent waiting for the user.
+//
+// The metrics are written in the Prometheus text format on request (the
+// server's "metrics" request and SIGUSR1), and when BANK_METRICS names a
+// file, to that file every BANK_METRICS_INTERVAL seconds (10 by default)
+// and once more at exit.
+typedef enum {
+    METRIC_FIND_ACCOUNT,
+    METRIC_UPDATE_ACCOUNT,
+    METRIC_UPDATE_TRANSFER,
+    METRIC_CREATE_ACCOUNT,
+    METRIC_IBAN_CHECK,
+    METRIC_PESEL_CHECK,
+    METRIC_PRINT_ACCOUNTS,
+    METRIC_CLEAR_SCREEN,
+    METRIC_BATCH_LINE,
+    METRIC_STORE_OPEN,
+    METRIC_STORE_GET,
+    METRIC_STORE_STAGE,
+    METRIC_STORE_COMMIT,
+    METRIC_STORE_CHECKPOINT,
+    METRIC_STORE_LOAD,
+    METRIC_WAL_COMMIT,
+    METRIC_INDEX_OPEN,
+    METRIC_INDEX_SEARCH,
+    METRIC_INDEX_SAVE,
+    METRIC_QUERY,
+    METRIC_COUNT
+} Metric_t;
+
+// A timestamp to hand to metricEnd
+uint64_t metricStart();
+void metricEnd(Metric_t metric, uint64_t start, bool succeeded);
+void metricRead(Metric_t metric, uint64_t bytes);
+void metricWritten(Metric_t metric, uint64_t bytes);
+
+bool metricsWrite(FILE *file);
+// Replaces path through a temporary file, so a scraper never sees half
+bool metricsDump(const char *path);
+// Where on-demand dumps go: BANK_METRICS, or METRICS_FILE when it is unset
+const char *metricsPath();
+
+// Start and stop the periodic dump; both do nothing unless BANK_METRICS is set
+void metricsStart();
+void metricsStop();
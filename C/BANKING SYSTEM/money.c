@@ -0,0 +1,74 @@
+#include <stdio.h>
+
+#include "money.h"
+
+#define MONEY_WHOLE_MAX (INT64_MAX / 100 - 1)
+
+bool parseMoney(const char *text, Money_t *amount)
+{
+    const char *c = text;
+    bool negative = *c == '-';
+    if (*c == '-' || *c == '+')
+        c++;
+
+    int64_t whole = 0;
+    const char *digits = c;
+    for (; *c >= '0' && *c <= '9'; c++)
+    {
+        if (whole > (MONEY_WHOLE_MAX - (*c - '0')) / 10)
+            return false;
+        whole = whole * 10 + (*c - '0');
+    }
+    bool any_digits = c != digits;
+
+    int64_t fraction = 0;
+    if (*c == '.' || *c == ',')
+    {
+        c++;
+        for (int place = 0; *c >= '0' && *c <= '9'; c++, place++)
+        {
+            if (place >= 2 && *c != '0')
+                return false;
+            if (place < 2)
+                fraction += (*c - '0') * (place == 0 ? 10 : 1);
+            any_digits = true;
+        }
+    }
+    if (!any_digits || *c != '\0')
+        return false;
+
+    *amount = negative ? -(whole * 100 + fraction) : whole * 100 + fraction;
+    return true;
+}
+
+size_t formatMoney(Money_t amount, char *buffer)
+{
+    // Digits come out least significant first; at least three so that
+    // amounts under a złoty still get their leading zero
+    char digits[MONEY_BUFFER];
+    uint64_t value = amount < 0 ? -(uint64_t)amount : (uint64_t)amount;
+    size_t count = 0;
+    do
+    {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0 || count < 3);
+
+    size_t length = 0;
+    if (amount < 0)
+        buffer[length++] = '-';
+    while (count > 2)
+        buffer[length++] = digits[--count];
+    buffer[length++] = '.';
+    buffer[length++] = digits[1];
+    buffer[length++] = digits[0];
+    buffer[length] = '\0';
+    return length;
+}
+
+void printMoneyRow(const char *label, Money_t amount)
+{
+    char text[MONEY_BUFFER];
+    formatMoney(amount, text);
+    printf("%-24s %16s\n", label, text);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "bank.h"
+
+// Room for the longest formatted amount and its terminator
+#define MONEY_BUFFER 24
+
+// Parses a decimal amount such as "120", "-3.5" or "0,99": digits with an
+// optional sign and at most two decimals after a '.' or ','. Further
+// decimals are accepted only when they are zeros, so no amount is ever
+// rounded on the way in.
+bool parseMoney(const char *text, Money_t *amount);
+
+// Writes the amount as "-1234.56" into buffer (MONEY_BUFFER bytes) and
+// returns its length
+size_t formatMoney(Money_t amount, char *buffer);
+
+// Prints one "label  amount" row of a summary, the amount right-aligned
+void printMoneyRow(const char *label, Money_t amount);
@@ -0,0 +1,256 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bank.h"
+#include "money.h"
+#include "monthend.h"
+#include "operations.h"
+#include "store.h"
+#include "util.h"
+
+#define MONTHEND_MAX_THREADS 64
+// Slots a worker checks for debt while holding the store lock once
+#define MONTHEND_SCAN_SLOTS 4096
+// Each worker waits for durability after this many accounts, so a group
+// commit carries thousands of them
+#define MONTHEND_SYNC_EVERY 4096
+#define MONTHEND_PROGRESS_NS 500000000
+
+typedef struct
+{
+    double rate;
+    uint16_t month;
+    uint32_t first_slot;
+    uint32_t end_slot;
+    unsigned long settled;
+    unsigned long short_of_funds;
+    unsigned long already_charged;
+    Money_t interest;
+    Money_t paid;
+    bool failed;
+} Worker_t;
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    int running;
+    atomic_ulong slots_done;
+    atomic_ulong settled;
+} progress = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// The account is read again under its lock, as a client may have changed
+// it since the scan
+static void settle(Worker_t *worker, uint32_t id)
+{
+    Account_t account;
+    MonthEnd_t result;
+    storeLockAccounts(id, 0);
+    if (storeGet(id, &account) && applyMonthEnd(&account, worker->rate, worker->month, &result))
+    {
+        if (storeUpdate(&account))
+        {
+            worker->settled++;
+            worker->short_of_funds += result.paid < result.instalment;
+            worker->interest += result.interest;
+            worker->paid += result.paid;
+        }
+        else
+        {
+            worker->failed = true;
+        }
+    }
+    storeUnlockAccounts(id, 0);
+}
+
+static void *workerMain(void *argument)
+{
+    Worker_t *worker = argument;
+    uint32_t ids[MONTHEND_SCAN_SLOTS];
+    unsigned long unsynced = 0;
+    for (uint32_t first = worker->first_slot; first < worker->end_slot && !worker->failed;
+         first += MONTHEND_SCAN_SLOTS)
+    {
+        uint32_t end = worker->end_slot - first > MONTHEND_SCAN_SLOTS ? first + MONTHEND_SCAN_SLOTS : worker->end_slot;
+        uint32_t count = 0;
+        storeLock();
+        for (uint32_t slot = first; slot < end; slot++)
+        {
+            const AccountHot_t *hot = storeHot(slot);
+            if (hot == NULL || hot->debt <= 0)
+                continue;
+            if (hot->charged_month == worker->month)
+                worker->already_charged++;
+            else
+                ids[count++] = hot->id;
+        }
+        storeUnlock();
+
+        unsigned long settled = worker->settled;
+        for (uint32_t i = 0; i < count && !worker->failed; i++)
+            settle(worker, ids[i]);
+        unsynced += worker->settled - settled;
+        if (unsynced >= MONTHEND_SYNC_EVERY)
+        {
+            worker->failed = worker->failed || !storeSync(true);
+            unsynced = 0;
+        }
+        atomic_fetch_add(&progress.slots_done, end - first);
+        atomic_fetch_add(&progress.settled, worker->settled - settled);
+    }
+    worker->failed = !storeSync(true) || worker->failed;
+
+    pthread_mutex_lock(&progress.lock);
+    progress.running--;
+    pthread_cond_signal(&progress.finished);
+    pthread_mutex_unlock(&progress.lock);
+    return NULL;
+}
+
+static void printProgress(uint32_t slots, const struct timespec *start, bool last)
+{
+    double seconds = elapsedSince(start);
+    unsigned long settled = atomic_load(&progress.settled);
+    fprintf(stderr, "%s%5.1f%% of the accounts checked, %lu settled, %.0f/s%s",
+            isatty(STDERR_FILENO) ? "\r" : "", slots ? 100.0 * atomic_load(&progress.slots_done) / slots : 100.0,
+            settled, seconds > 0 ? settled / seconds : 0.0, last || !isatty(STDERR_FILENO) ? "\n" : "");
+}
+
+// Reports progress until every worker is done
+static void waitForWorkers(uint32_t slots, const struct timespec *start)
+{
+    pthread_mutex_lock(&progress.lock);
+    while (progress.running > 0)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += MONTHEND_PROGRESS_NS;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (pthread_cond_timedwait(&progress.finished, &progress.lock, &deadline) != 0)
+            printProgress(slots, start, false);
+    }
+    pthread_mutex_unlock(&progress.lock);
+    printProgress(slots, start, true);
+}
+
+static Money_t totalDebt()
+{
+    Money_t total = 0;
+    storeLock();
+    const AccountHot_t *hot = storeHotColumn();
+    for (uint32_t slot = 0; slot < storeSlots(); slot++)
+        total += hot[slot].debt;
+    storeUnlock();
+    return total;
+}
+
+// Months counted from 1 for January 2000, as applyMonthEnd takes them
+static uint16_t currentMonth()
+{
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    int month = (local.tm_year - 100) * 12 + local.tm_mon + 1;
+    return month < 1 ? 1 : (uint16_t)month;
+}
+
+int runMonthEnd(int argc, char *argv[])
+{
+    char *endptr = NULL;
+    double rate = argc > 1 ? strtod(argv[1], &endptr) : -1.0;
+    long threads = argc > 2 ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc < 2 || *endptr != '\0' || !(rate >= 0.0 && rate <= 1.0) || threads < 1 ||
+        (argc > 2 && threads > MONTHEND_MAX_THREADS))
+    {
+        fprintf(stderr, "Usage: monthend RATE (0.00-1.00, yearly) [THREADS (1-%d)]\n", MONTHEND_MAX_THREADS);
+        return 1;
+    }
+    if (threads > MONTHEND_MAX_THREADS)
+        threads = MONTHEND_MAX_THREADS;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!storeCommit())
+        return 1;
+    storeSetAutocommit(false);
+    uint16_t month = currentMonth();
+
+    // Slots only grow while this runs, and the new ones hold no debt yet
+    uint32_t slots = storeSlots();
+    uint32_t slice = (uint32_t)((slots + threads - 1) / threads);
+    pthread_t ids[MONTHEND_MAX_THREADS];
+    Worker_t workers[MONTHEND_MAX_THREADS];
+    atomic_store(&progress.slots_done, 0);
+    atomic_store(&progress.settled, 0);
+    progress.running = 0;
+    int started = 0;
+    for (; started < threads; started++)
+    {
+        Worker_t *worker = &workers[started];
+        memset(worker, 0, sizeof(*worker));
+        worker->rate = rate;
+        worker->month = month;
+        uint64_t first = (uint64_t)slice * started;
+        worker->first_slot = first < slots ? (uint32_t)first : slots;
+        worker->end_slot = slots - worker->first_slot > slice ? worker->first_slot + slice : slots;
+        pthread_mutex_lock(&progress.lock);
+        progress.running++;
+        pthread_mutex_unlock(&progress.lock);
+        if (pthread_create(&ids[started], NULL, workerMain, worker) != 0)
+        {
+            pthread_mutex_lock(&progress.lock);
+            progress.running--;
+            pthread_mutex_unlock(&progress.lock);
+            break;
+        }
+    }
+    waitForWorkers(slots, &start);
+
+    MonthEnd_t totals = { 0 };
+    unsigned long settled = 0, short_of_funds = 0, already_charged = 0;
+    bool ok = started == threads;
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(ids[i], NULL);
+        settled += workers[i].settled;
+        short_of_funds += workers[i].short_of_funds;
+        already_charged += workers[i].already_charged;
+        totals.interest += workers[i].interest;
+        totals.paid += workers[i].paid;
+        ok = ok && !workers[i].failed;
+    }
+    double seconds = elapsedSince(&start);
+    storeSetAutocommit(true);
+
+    printf("%-24s %16lu\n", "Accounts settled", settled);
+    printf("%-24s %16lu\n", "Short of funds", short_of_funds);
+    printf("%-24s %16lu\n", "Already charged", already_charged);
+    printMoneyRow("Interest accrued", totals.interest);
+    printMoneyRow("Instalments collected", totals.paid);
+    printMoneyRow("Outstanding debt", totalDebt());
+    printf("%lu accounts in %.3f s with %d threads, %.0f accounts/s\n", settled, seconds, started,
+           seconds > 0 ? settled / seconds : 0.0);
+    if (!ok)
+    {
+        fprintf(stderr, "A worker could not start or a commit failed, the figures include changes that were "
+                        "rolled back\n");
+        return 1;
+    }
+    // Accounts charged by an earlier run are skipped, so a second run in
+    // a month only finishes what a failed one left
+    if (settled == 0 && already_charged > 0)
+    {
+        fprintf(stderr, "Month end for %04d-%02d has already run\n", 2000 + (month - 1) / 12, (month - 1) % 12 + 1);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+// End-of-month run over every account with debt: a month of interest is
+// accrued and the scheduled instalment collected from the balance, see
+// applyMonthEnd. Each account records the month it was charged for, so a
+// repeated run in the same month skips it. The slots are split into
+// one contiguous range per worker thread; each worker finds the indebted
+// accounts of its range from the hot column and changes them like the
+// batch workers do, under the account's lock and synced in groups. Progress
+// goes to stderr while it runs.
+// monthend RATE [THREADS], RATE being the annual interest rate as a
+// decimal (0.05 for 5%).
+int runMonthEnd(int argc, char *argv[]);
@@ -0,0 +1,285 @@
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ibanset.h"
+#include "metrics.h"
+#include "money.h"
+#include "operations.h"
+#include "store.h"
+
+static bool checkRange(Money_t value, Money_t min, Money_t max, const char *what, char *error_msg)
+{
+    if (value < min || value > max)
+    {
+        char low[MONEY_BUFFER], high[MONEY_BUFFER];
+        formatMoney(min, low);
+        formatMoney(max, high);
+        sprintf(error_msg, "%s must be between %s and %s", what, low, high);
+        return false;
+    }
+    return true;
+}
+
+static bool checkBalanceLimit(Money_t balance, Money_t amount, const char *what, char *error_msg)
+{
+    if (balance + amount > CASH_MAX)
+    {
+        char limit[MONEY_BUFFER];
+        formatMoney(CASH_MAX, limit);
+        sprintf(error_msg, "%s would exceed maximum balance limit of %s", what, limit);
+        return false;
+    }
+    return true;
+}
+
+static bool checkFunds(Money_t balance, Money_t amount, char *error_msg)
+{
+    if (amount > balance)
+    {
+        char available[MONEY_BUFFER];
+        formatMoney(balance, available);
+        sprintf(error_msg, "Insufficient funds. Available balance: %s", available);
+        return false;
+    }
+    return true;
+}
+
+bool applyDeposit(Account_t *acc, Money_t amount, char *error_msg)
+{
+    if (amount <= 0)
+    {
+        strcpy(error_msg, "Deposit amount must be positive");
+        return false;
+    }
+    if (!checkRange(amount, 1, CASH_MAX, "Deposit amount", error_msg) ||
+        !checkBalanceLimit(acc->balance, amount, "Deposit", error_msg))
+        return false;
+    acc->balance += amount;
+    return true;
+}
+
+bool applyWithdrawal(Account_t *acc, Money_t amount, char *error_msg)
+{
+    if (amount <= 0)
+    {
+        strcpy(error_msg, "Withdrawal amount must be positive");
+        return false;
+    }
+    if (!checkFunds(acc->balance, amount, error_msg) ||
+        !checkRange(amount, 1, acc->balance, "Withdrawal amount", error_msg))
+        return false;
+    acc->balance -= amount;
+    return true;
+}
+
+bool applyTransfer(Account_t *source, Account_t *destination, Money_t amount, char *error_msg)
+{
+    if (source->id == destination->id)
+    {
+        strcpy(error_msg, "Cannot transfer to the same account");
+        return false;
+    }
+    if (!checkFunds(source->balance, amount, error_msg))
+        return false;
+    if (amount <= 0)
+    {
+        strcpy(error_msg, "Transfer amount must be positive");
+        return false;
+    }
+    if (!checkRange(amount, 1, CASH_MAX, "Transfer amount", error_msg) ||
+        !checkBalanceLimit(destination->balance, amount, "Transfer", error_msg))
+        return false;
+    source->balance -= amount;
+    destination->balance += amount;
+    return true;
+}
+
+bool applyLoan(Account_t *acc, Money_t amount, double interest_rate, char *error_msg)
+{
+    // Written so that NaN fails it too
+    if (!(interest_rate >= 0.0 && interest_rate <= 1.0))
+    {
+        strcpy(error_msg, "Interest rate must be between 0.00 and 1.00");
+        return false;
+    }
+    if (!checkBalanceLimit(acc->balance, amount, "Loan", error_msg))
+        return false;
+    if (amount <= 0)
+    {
+        strcpy(error_msg, "Loan amount must be positive");
+        return false;
+    }
+    if (!checkRange(amount, 1, LOAN_MAX, "Loan amount", error_msg))
+        return false;
+    // The interest is the only amount that is ever rounded, to whole grosze
+    acc->balance += amount;
+    acc->debt += amount + llround(amount * interest_rate);
+    acc->instalments_paid = 0;
+    return true;
+}
+
+bool applyDebtPayment(Account_t *acc, Money_t amount, char *error_msg)
+{
+    if (acc->debt <= 0)
+    {
+        strcpy(error_msg, "No debt to pay on this account");
+        return false;
+    }
+    if (amount <= 0)
+    {
+        strcpy(error_msg, "Payment amount must be positive");
+        return false;
+    }
+    if (!checkFunds(acc->balance, amount, error_msg))
+        return false;
+    if (!checkRange(amount, 1, acc->debt, "Payment amount", error_msg))
+        return false;
+    acc->balance -= amount;
+    acc->debt -= amount;
+    if (acc->debt < 0) acc->debt = 0;
+    return true;
+}
+
+bool applyMonthEnd(Account_t *acc, double annual_rate, uint16_t month, MonthEnd_t *result)
+{
+    if (!(annual_rate >= 0.0 && annual_rate <= 1.0) || acc->debt <= 0 || acc->charged_month == month)
+        return false;
+    double monthly = annual_rate / 12;
+    int left = MONTHS_OF_PAYMENT - acc->instalments_paid;
+    result->interest = llround(acc->debt * monthly);
+    if (left <= 1)
+        result->instalment = acc->debt + result->interest;
+    else if (monthly == 0.0)
+        result->instalment = (acc->debt + left - 1) / left;
+    else
+        result->instalment = (Money_t)ceil(acc->debt * monthly / (1 - pow(1 + monthly, -left)));
+    acc->debt += result->interest;
+    if (result->instalment > acc->debt)
+        result->instalment = acc->debt;
+    // A month short of funds still counts, the months left then pay more
+    if (acc->instalments_paid < MONTHS_OF_PAYMENT)
+        acc->instalments_paid++;
+    acc->charged_month = month;
+    result->paid = acc->balance <= 0 ? 0 : result->instalment < acc->balance ? result->instalment : acc->balance;
+    acc->balance -= result->paid;
+    acc->debt -= result->paid;
+    return true;
+}
+
+bool validateAccount(const Account_t *new, char *error_msg)
+{
+    if (!checkLetters(new->first_name))
+    {
+        strcpy(error_msg, "First name must contain only letters and spaces");
+        return false;
+    }
+    if (!checkLetters(new->last_name))
+    {
+        strcpy(error_msg, "Last name must contain only letters and spaces");
+        return false;
+    }
+    if (!checkDigits(new->pesel_number))
+    {
+        strcpy(error_msg, "PESEL must contain only digits (0-9)");
+        return false;
+    }
+    if (strlen(new->pesel_number) != PESEL_LENGTH)
+    {
+        sprintf(error_msg, "PESEL must be exactly %d digits long, you entered %zu digits",
+                PESEL_LENGTH, strlen(new->pesel_number));
+        return false;
+    }
+    if (strlen(new->address) == 0)
+    {
+        strcpy(error_msg, "Address cannot be empty");
+        return false;
+    }
+    if (!checkRange(new->balance, CASH_MIN, CASH_MAX, "Initial balance", error_msg))
+        return false;
+    return checkRange(new->debt, 0, CASH_MAX, "Current debt", error_msg);
+}
+
+bool checkLetters(const char *string)
+{
+    if (string == NULL || strlen(string) == 0)
+        return false;
+        
+    for (size_t i = 0; i < strlen(string); i++)
+    {
+        if (!isalpha(string[i]) && string[i] != ' ')
+            return false;
+    }
+    return true;
+}
+
+bool noLetters(const char *string)
+{
+    if (string == NULL)
+        return true;
+        
+    for (size_t i = 0; i < strlen(string); i++)
+    {
+        if (isalpha(string[i]))
+            return false;
+    }
+    return true;
+}
+
+bool checkDigits(const char *string)
+{
+    if (string == NULL || strlen(string) == 0)
+        return false;
+        
+    for (size_t i = 0; i < strlen(string); i++)
+    {
+        if (!isdigit(string[i]))
+            return false;
+    }
+    return true;
+}
+
+bool generateIBAN(Account_t *new)
+{
+    if (storeIBANCount() >= IBAN_SPACE)
+        return false;
+        
+    IBAN to_be_generated;
+    do
+    {
+        for (int i = 0; i < IBAN_LENGTH; i++)
+        {
+            to_be_generated[i] = (rand() % 10) + '0';
+        }
+        to_be_generated[IBAN_LENGTH] = '\0';
+        
+    } while (isIBANoverlapping(to_be_generated));
+    
+    strcpy(new->account_number, to_be_generated);
+    return true;
+}
+
+// A collision counts as a failed check
+bool isIBANoverlapping(IBAN check_val)
+{
+    uint64_t start = metricStart();
+    bool overlapping = storeHasIBAN(check_val);
+    metricEnd(METRIC_IBAN_CHECK, start, !overlapping);
+    return overlapping;
+}
+
+// A PESEL already in use counts as a failed check
+bool checkPESELUnique(const char *pesel, char *error_msg)
+{
+    uint64_t start = metricStart();
+    uint32_t slot;
+    storeLock();
+    uint32_t owner = storeFindPESEL(pesel, &slot, 1) > 0 ? storeHot(slot)->id : 0;
+    storeUnlock();
+    metricEnd(METRIC_PESEL_CHECK, start, owner == 0);
+    if (owner != 0)
+        sprintf(error_msg, "PESEL %s already belongs to account ID %u", pesel, owner);
+    return owner == 0;
+}
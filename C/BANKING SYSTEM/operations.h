@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bank.h"
+
+typedef struct
+{
+    Money_t interest;
+    Money_t instalment;
+    // Less than the instalment when the balance fell short
+    Money_t paid;
+} MonthEnd_t;
+
+// Business rules shared by the menus and the non-interactive front ends.
+// Each apply function checks the operation against the account(s), changes
+// them in place when it is allowed, and otherwise leaves them untouched and
+// writes the reason into error_msg (BUFFER bytes).
+bool applyDeposit(Account_t *acc, Money_t amount, char *error_msg);
+bool applyWithdrawal(Account_t *acc, Money_t amount, char *error_msg);
+bool applyTransfer(Account_t *source, Account_t *destination, Money_t amount, char *error_msg);
+// A loan restarts the repayment schedule, now of the whole debt
+bool applyLoan(Account_t *acc, Money_t amount, double interest_rate, char *error_msg);
+bool applyDebtPayment(Account_t *acc, Money_t amount, char *error_msg);
+// Charges month (counted from 1 for January 2000) to the account: a month
+// of interest at annual_rate / 12 is added to the debt, then the instalment
+// is taken from the balance as far as it reaches. The instalment is the
+// annuity that pays the debt off over the months left of the
+// MONTHS_OF_PAYMENT-month schedule, so it stays the same while it is paid
+// in full and the last one clears the debt. Returns false, changing
+// nothing, for accounts without debt or already charged for month, and for
+// a rate outside 0-1.
+bool applyMonthEnd(Account_t *acc, double annual_rate, uint16_t month, MonthEnd_t *result);
+bool validateAccount(const Account_t *new, char *error_msg);
+
+bool checkLetters(const char *string);
+bool noLetters(const char *string);
+bool checkDigits(const char *string);
+
+// Fails only once every account number is taken
+bool generateIBAN(Account_t *new);
+bool isIBANoverlapping(IBAN check_val);
+// Fails, naming the account that has it, when pesel is taken
+bool checkPESELUnique(const char *pesel, char *error_msg);
@@ -0,0 +1,147 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bank.h"
+#include "peselmap.h"
+#include "util.h"
+
+#define PESEL_MAP_MIN_CAPACITY 1024
+
+// Id 0 marks an empty bucket. The bucket is taken from the hash, so
+// growing never needs the PESELs themselves.
+typedef struct
+{
+    uint32_t hash;
+    uint32_t id;
+} PeselEntry_t;
+
+typedef struct
+{
+    PeselEntry_t *entries;
+    uint32_t capacity;
+    uint32_t used;
+} PeselMap_t;
+
+typedef struct
+{
+    uint32_t capacity;
+    uint32_t used;
+} PeselMapHeader_t;
+
+static PeselMap_t map;
+
+static bool peselHash(const char *pesel, uint32_t *hash)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < PESEL_LENGTH; i++)
+    {
+        if (!isdigit((unsigned char)pesel[i]))
+            return false;
+        value = value * 10 + (pesel[i] - '0');
+    }
+    if (pesel[PESEL_LENGTH] != '\0')
+        return false;
+    *hash = (uint32_t)(((value + 1) * 0x9E3779B97F4A7C15ull) >> 32);
+    return true;
+}
+
+static PeselEntry_t *freeBucket(PeselEntry_t *entries, uint32_t capacity, uint32_t hash)
+{
+    uint32_t pos = hash & (capacity - 1);
+    while (entries[pos].id != 0)
+        pos = (pos + 1) & (capacity - 1);
+    return &entries[pos];
+}
+
+static bool grow(uint32_t needed)
+{
+    uint32_t new_capacity = map.capacity ? map.capacity * 2 : PESEL_MAP_MIN_CAPACITY;
+    while ((uint64_t)needed * 2 > new_capacity)
+        new_capacity *= 2;
+    PeselEntry_t *entries = calloc(new_capacity, sizeof(PeselEntry_t));
+    if (entries == NULL)
+        return false;
+    for (uint32_t i = 0; i < map.capacity; i++)
+    {
+        if (map.entries[i].id != 0)
+            *freeBucket(entries, new_capacity, map.entries[i].hash) = map.entries[i];
+    }
+    free(map.entries);
+    map.entries = entries;
+    map.capacity = new_capacity;
+    return true;
+}
+
+bool peselMapReserve(uint32_t more)
+{
+    if ((uint64_t)(map.used + more) * 2 <= map.capacity)
+        return true;
+    return grow(map.used + more);
+}
+
+bool peselMapPut(const char *pesel, uint32_t id)
+{
+    uint32_t hash;
+    if (!peselHash(pesel, &hash))
+        return true;
+    if (!peselMapReserve(1))
+        return false;
+    PeselEntry_t *entry = freeBucket(map.entries, map.capacity, hash);
+    entry->hash = hash;
+    entry->id = id;
+    map.used++;
+    return true;
+}
+
+void peselMapFind(const char *pesel, PeselCursor_t *cursor)
+{
+    cursor->done = map.capacity == 0 || !peselHash(pesel, &cursor->hash);
+    cursor->pos = cursor->done ? 0 : cursor->hash & (map.capacity - 1);
+}
+
+uint32_t peselMapNext(PeselCursor_t *cursor)
+{
+    while (!cursor->done)
+    {
+        const PeselEntry_t *entry = &map.entries[cursor->pos];
+        cursor->pos = (cursor->pos + 1) & (map.capacity - 1);
+        if (entry->id == 0)
+            cursor->done = true;
+        else if (entry->hash == cursor->hash)
+            return entry->id;
+    }
+    return 0;
+}
+
+void peselMapFree()
+{
+    free(map.entries);
+    memset(&map, 0, sizeof(map));
+}
+
+bool peselMapSave(int fd)
+{
+    PeselMapHeader_t header = { map.capacity, map.used };
+    return writeFully(fd, &header, sizeof(header)) &&
+           writeFully(fd, map.entries, (size_t)map.capacity * sizeof(PeselEntry_t));
+}
+
+bool peselMapLoad(int fd)
+{
+    PeselMapHeader_t header;
+    peselMapFree();
+    if (!readFully(fd, &header, sizeof(header)) || (header.capacity & (header.capacity - 1)) != 0 ||
+        (uint64_t)header.used * 2 > header.capacity)
+        return false;
+
+    map.entries = malloc(header.capacity ? (size_t)header.capacity * sizeof(PeselEntry_t) : 1);
+    if (map.entries == NULL || !readFully(fd, map.entries, (size_t)header.capacity * sizeof(PeselEntry_t)))
+    {
+        peselMapFree();
+        return false;
+    }
+    map.capacity = header.capacity;
+    map.used = header.used;
+    return true;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Map from PESEL to the ids of the accounts carrying it, for constant-time
+// duplicate checks when accounts are created and for exact lookups. Each
+// entry holds only the id and a 32-bit hash of the PESEL, so the caller
+// confirms the candidates against the records; that also skips entries
+// left behind by rolled back creates.
+typedef struct
+{
+    uint32_t hash;
+    uint32_t pos;
+    bool done;
+} PeselCursor_t;
+
+// Makes room for more entries, so that as many peselMapPut calls after it
+// cannot fail
+bool peselMapReserve(uint32_t more);
+// Adds an entry for pesel; strings other than 11 digits are not mapped
+bool peselMapPut(const char *pesel, uint32_t id);
+// Starts going through the candidates for pesel
+void peselMapFind(const char *pesel, PeselCursor_t *cursor);
+// The next candidate's id, 0 after the last
+uint32_t peselMapNext(PeselCursor_t *cursor);
+void peselMapFree();
+
+// The whole map as one block at the descriptor's position, for snapshots.
+// Saving makes nothing but write calls, so a child forked from a threaded
+// process may do it; loading replaces the map
+bool peselMapSave(int fd);
+bool peselMapLoad(int fd);
@@ -0,0 +1,525 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "listing.h"
+#include "metrics.h"
+#include "money.h"
+#include "query.h"
+#include "store.h"
+
+// Slots checked while holding the store lock once
+#define QUERY_BATCH 4096
+#define QUERY_TEXT_MAX 4096
+#define COMPLETE_DEFAULT 10
+
+static const struct
+{
+    const char *name;
+    QueryField_t field;
+} fields[] = {
+    { "id", QUERY_ID },
+    { "balance", QUERY_BALANCE },
+    { "debt", QUERY_DEBT },
+    { "account", QUERY_ACCOUNT },
+    { "pesel", QUERY_PESEL },
+    { "name", QUERY_NAME },
+    { "surname", QUERY_SURNAME },
+    { "address", QUERY_ADDRESS },
+};
+
+// Two-character operators go first, so "<=" is not read as "<"
+static const struct
+{
+    const char *symbol;
+    QueryOp_t op;
+} operators[] = {
+    { "^=", QUERY_PREFIX },
+    { "$=", QUERY_SUFFIX },
+    { "*=", QUERY_CONTAINS },
+    { "!=", QUERY_NOT_EQUAL },
+    { "<=", QUERY_LESS_EQUAL },
+    { ">=", QUERY_GREATER_EQUAL },
+    { "=", QUERY_EQUAL },
+    { "<", QUERY_LESS },
+    { ">", QUERY_GREATER },
+};
+
+#define FIELDS_COUNT (sizeof(fields) / sizeof(fields[0]))
+#define OPERATORS_COUNT (sizeof(operators) / sizeof(operators[0]))
+
+static bool isNumeric(QueryField_t field)
+{
+    return field == QUERY_ID || field == QUERY_BALANCE || field == QUERY_DEBT;
+}
+
+static bool isOrdering(QueryOp_t op)
+{
+    return op == QUERY_LESS || op == QUERY_LESS_EQUAL || op == QUERY_GREATER || op == QUERY_GREATER_EQUAL;
+}
+
+static const char *skipSpaces(const char *c)
+{
+    while (isspace((unsigned char)*c))
+        c++;
+    return c;
+}
+
+// Substrings and suffixes are dearer than comparisons from the start, and
+// the fields are ordered by length
+static int cost(const QueryTerm_t *term)
+{
+    return (term->op == QUERY_CONTAINS || term->op == QUERY_SUFFIX) * 8 + term->field;
+}
+
+static bool parseField(const char **c, QueryTerm_t *term, const char *text, char *error)
+{
+    const char *start = *c;
+    while (isalpha((unsigned char)**c) || **c == '_')
+        (*c)++;
+    size_t length = *c - start;
+    for (size_t f = 0; f < FIELDS_COUNT; f++)
+    {
+        if (length == strlen(fields[f].name) && strncasecmp(start, fields[f].name, length) == 0)
+        {
+            term->field = fields[f].field;
+            return true;
+        }
+    }
+    if (length == 0)
+        snprintf(error, BUFFER, "Expected a field at position %d", (int)(start - text) + 1);
+    else
+        snprintf(error, BUFFER, "Unknown field '%.*s'; valid fields: id, balance, debt, account, pesel, name, "
+                 "surname, address", (int)length, start);
+    return false;
+}
+
+static bool parseOperator(const char **c, QueryTerm_t *term, const char *text, char *error)
+{
+    size_t o = 0;
+    while (o < OPERATORS_COUNT && strncmp(*c, operators[o].symbol, strlen(operators[o].symbol)) != 0)
+        o++;
+    if (o == OPERATORS_COUNT)
+    {
+        snprintf(error, BUFFER, "Expected an operator at position %d", (int)(*c - text) + 1);
+        return false;
+    }
+    term->op = operators[o].op;
+    *c += strlen(operators[o].symbol);
+
+    bool numeric = isNumeric(term->field);
+    if (numeric ? term->op >= QUERY_PREFIX : isOrdering(term->op))
+    {
+        snprintf(error, BUFFER, "%s fields take %s", numeric ? "Numeric" : "Text",
+                 numeric ? "= != < <= > >=" : "= != ^= $= *=");
+        return false;
+    }
+    return true;
+}
+
+static bool parseValue(const char **c, QueryTerm_t *term, const char *text, char *error)
+{
+    const char *start = *c, *end;
+    if (*start == '"')
+    {
+        start++;
+        end = strchr(start, '"');
+        if (end == NULL)
+        {
+            snprintf(error, BUFFER, "Missing closing quote after position %d", (int)(start - text));
+            return false;
+        }
+        *c = end + 1;
+    }
+    else
+    {
+        for (end = start; *end != '\0' && !isspace((unsigned char)*end); end++)
+            ;
+        *c = end;
+    }
+
+    term->length = end - start;
+    if (term->length >= sizeof(term->text))
+    {
+        snprintf(error, BUFFER, "The value at position %d is too long", (int)(start - text) + 1);
+        return false;
+    }
+    memcpy(term->text, start, term->length);
+    term->text[term->length] = '\0';
+    if (!isNumeric(term->field))
+        return true;
+
+    char *endptr;
+    bool parsed;
+    if (term->field == QUERY_ID)
+    {
+        unsigned long id = strtoul(term->text, &endptr, 10);
+        parsed = isdigit((unsigned char)term->text[0]) && *endptr == '\0' && id <= UINT32_MAX;
+        term->number = (Money_t)id;
+    }
+    else
+    {
+        parsed = parseMoney(term->text, &term->number);
+    }
+    if (!parsed)
+        snprintf(error, BUFFER, "'%s' is not a valid %s", term->text, term->field == QUERY_ID ? "id" : "amount");
+    return parsed;
+}
+
+bool queryCompile(const char *text, Query_t *query, char *error)
+{
+    query->count = query->numeric = 0;
+    const char *c = skipSpaces(text);
+    if (*c == '\0')
+    {
+        snprintf(error, BUFFER, "The query is empty");
+        return false;
+    }
+
+    while (*c != '\0')
+    {
+        if (query->count == QUERY_MAX_TERMS)
+        {
+            snprintf(error, BUFFER, "A query has at most %d terms", QUERY_MAX_TERMS);
+            return false;
+        }
+        QueryTerm_t term;
+        if (!parseField(&c, &term, text, error))
+            return false;
+        c = skipSpaces(c);
+        if (!parseOperator(&c, &term, text, error))
+            return false;
+        c = skipSpaces(c);
+        if (!parseValue(&c, &term, text, error))
+            return false;
+
+        // Insertion keeps the numeric terms first and the text terms by
+        // cost, each in written order among equals
+        int at = query->count;
+        if (isNumeric(term.field))
+            at = query->numeric++;
+        else
+            while (at > query->numeric && cost(&query->terms[at - 1]) > cost(&term))
+                at--;
+        memmove(&query->terms[at + 1], &query->terms[at], (query->count - at) * sizeof(term));
+        query->terms[at] = term;
+        query->count++;
+
+        c = skipSpaces(c);
+        if (*c == '\0')
+            break;
+        if (strncasecmp(c, "AND", 3) != 0 || (c[3] != '\0' && !isspace((unsigned char)c[3])))
+        {
+            snprintf(error, BUFFER, "Expected AND at position %d", (int)(c - text) + 1);
+            return false;
+        }
+        c = skipSpaces(c + 3);
+        if (*c == '\0')
+        {
+            snprintf(error, BUFFER, "Expected a term after the last AND");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Evaluation
+
+static Money_t hotValue(const AccountHot_t *hot, QueryField_t field)
+{
+    return field == QUERY_ID ? hot->id : field == QUERY_BALANCE ? hot->balance : hot->debt;
+}
+
+static bool compareNumber(Money_t value, QueryOp_t op, Money_t operand)
+{
+    switch (op)
+    {
+    case QUERY_EQUAL:
+        return value == operand;
+    case QUERY_NOT_EQUAL:
+        return value != operand;
+    case QUERY_LESS:
+        return value < operand;
+    case QUERY_LESS_EQUAL:
+        return value <= operand;
+    case QUERY_GREATER:
+        return value > operand;
+    default:
+        return value >= operand;
+    }
+}
+
+static const char *coldText(const AccountCold_t *cold, QueryField_t field)
+{
+    switch (field)
+    {
+    case QUERY_ACCOUNT:
+        return cold->account_number;
+    case QUERY_PESEL:
+        return cold->pesel_number;
+    case QUERY_NAME:
+        return cold->first_name;
+    case QUERY_SURNAME:
+        return cold->last_name;
+    default:
+        return cold->address;
+    }
+}
+
+static bool matchText(const QueryTerm_t *term, const char *text)
+{
+    switch (term->op)
+    {
+    case QUERY_EQUAL:
+        return strcmp(text, term->text) == 0;
+    case QUERY_NOT_EQUAL:
+        return strcmp(text, term->text) != 0;
+    case QUERY_PREFIX:
+        return strncmp(text, term->text, term->length) == 0;
+    case QUERY_SUFFIX:
+    {
+        size_t length = strlen(text);
+        return length >= term->length && memcmp(text + length - term->length, term->text, term->length) == 0;
+    }
+    default:
+        return strstr(text, term->text) != NULL;
+    }
+}
+
+// Narrows the selected slots down to the matches of every term, one term
+// at a time over the whole batch, and appends them. The caller holds the
+// store lock.
+static bool checkBatch(const Query_t *query, uint32_t *selected, uint32_t count, SlotList_t *matches)
+{
+    const AccountHot_t *hot = storeHotColumn();
+    uint32_t slots = storeSlots(), kept = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (selected[i] < slots && hot[selected[i]].id != 0)
+            selected[kept++] = selected[i];
+    }
+    count = kept;
+
+    for (int t = 0; t < query->numeric && count > 0; t++)
+    {
+        const QueryTerm_t *term = &query->terms[t];
+        kept = 0;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (compareNumber(hotValue(&hot[selected[i]], term->field), term->op, term->number))
+                selected[kept++] = selected[i];
+        }
+        count = kept;
+    }
+
+    for (int t = query->numeric; t < query->count && count > 0; t++)
+    {
+        const QueryTerm_t *term = &query->terms[t];
+        kept = 0;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            const AccountCold_t *cold = storeCold(selected[i]);
+            if (cold != NULL && matchText(term, coldText(cold, term->field)))
+                selected[kept++] = selected[i];
+        }
+        count = kept;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!slotListAppend(matches, selected[i]))
+            return false;
+    }
+    return true;
+}
+
+// Picks the text term the indexes answer most narrowly and writes its
+// search key: a whole PESEL or account number, then an exact name, then a
+// name prefix, last names before first names as they repeat less. Returns
+// -1 when no term can use them.
+static int indexTerm(const Query_t *query, Address key, SearchField_t *field)
+{
+    int best = -1, best_rank = 5;
+    for (int t = query->numeric; t < query->count; t++)
+    {
+        const QueryTerm_t *term = &query->terms[t];
+        bool name = term->field == QUERY_NAME || term->field == QUERY_SURNAME;
+        int rank = 5;
+        if (term->op == QUERY_EQUAL && term->field == QUERY_PESEL && term->length == PESEL_LENGTH)
+            rank = 0;
+        else if (term->op == QUERY_EQUAL && term->field == QUERY_ACCOUNT && term->length == IBAN_LENGTH)
+            rank = 0;
+        else if (name && term->length > 0 && term->length < CHARBUFFER - 1 &&
+                 (term->op == QUERY_EQUAL || (term->op == QUERY_PREFIX && term->text[0] != '=')))
+            rank = 1 + (term->op == QUERY_PREFIX) * 2 + (term->field == QUERY_NAME);
+
+        if (rank < best_rank)
+        {
+            best = t;
+            best_rank = rank;
+        }
+    }
+    if (best < 0)
+        return -1;
+
+    const QueryTerm_t *term = &query->terms[best];
+    if (best_rank == 0)
+        snprintf(key, ADDRBUFFER, "%s", term->text);
+    else
+        snprintf(key, ADDRBUFFER, term->op == QUERY_EQUAL ? "=%s" : "%s*", term->text);
+    *field = term->field == QUERY_PESEL     ? SEARCH_PESEL
+             : term->field == QUERY_ACCOUNT ? SEARCH_ACCOUNT
+             : term->field == QUERY_NAME    ? SEARCH_NAME
+                                            : SEARCH_SURNAME;
+    return best;
+}
+
+static int compareSlots(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Checks the index's candidates, in slot order so the records are read
+// front to back
+static bool checkCandidates(const Query_t *query, SlotList_t *candidates, SlotList_t *matches)
+{
+    qsort(candidates->slots, candidates->count, sizeof(uint32_t), compareSlots);
+    uint32_t selected[QUERY_BATCH];
+    bool ok = true;
+    for (size_t first = 0; ok && first < candidates->count; first += QUERY_BATCH)
+    {
+        uint32_t count = 0;
+        size_t end = candidates->count - first > QUERY_BATCH ? first + QUERY_BATCH : candidates->count;
+        for (size_t i = first; i < end; i++)
+        {
+            if (count == 0 || candidates->slots[i] != selected[count - 1])
+                selected[count++] = candidates->slots[i];
+        }
+        storeLock();
+        ok = checkBatch(query, selected, count, matches);
+        storeUnlock();
+    }
+    return ok;
+}
+
+static bool scanAll(const Query_t *query, SlotList_t *matches)
+{
+    uint32_t selected[QUERY_BATCH];
+    bool ok = true;
+    storeLock();
+    for (uint32_t first = 0; ok && first < storeSlots(); first += QUERY_BATCH)
+    {
+        uint32_t slots = storeSlots();
+        uint32_t end = slots - first > QUERY_BATCH ? first + QUERY_BATCH : slots;
+        for (uint32_t slot = first; slot < end; slot++)
+            selected[slot - first] = slot;
+        ok = checkBatch(query, selected, end - first, matches);
+        // Lets writers in between batches
+        storeUnlock();
+        storeLock();
+    }
+    storeUnlock();
+    return ok;
+}
+
+bool queryRun(const Query_t *query, SlotList_t *matches)
+{
+    uint64_t start = metricStart();
+    Address key;
+    SearchField_t field;
+    SlotList_t candidates = { 0 };
+    bool ok;
+    if (indexTerm(query, key, &field) >= 0 && indexSearch(field, key, &candidates))
+        ok = checkCandidates(query, &candidates, matches);
+    else
+        ok = scanAll(query, matches);
+    slotListFree(&candidates);
+    metricEnd(METRIC_QUERY, start, ok);
+    return ok;
+}
+
+static void printUsage()
+{
+    fprintf(stderr, "Usage: query EXPRESSION... [--limit N] [--offset N] [--sort COLUMN[:desc]] [--format table|tsv]\n"
+                    "EXPRESSION is FIELD OP VALUE terms joined by AND, e.g. 'surname^=Kow AND balance>10000 AND "
+                    "debt=0'\n"
+                    "id, balance and debt take = != < <= > >=; account, pesel, name, surname and address take\n"
+                    "= != ^= (prefix) $= (suffix) *= (substring); quote values with spaces in \"\"\n");
+}
+
+int runQuery(int argc, char *argv[])
+{
+    // The expression may come in one argument or spread over several
+    char text[QUERY_TEXT_MAX] = "";
+    size_t length = 0;
+    int i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) != 0; i++)
+    {
+        int written = snprintf(text + length, sizeof(text) - length, "%s%s", length > 0 ? " " : "", argv[i]);
+        if (written < 0 || (size_t)written >= sizeof(text) - length)
+        {
+            fprintf(stderr, "The query is longer than %d characters\n", QUERY_TEXT_MAX - 1);
+            return 1;
+        }
+        length += written;
+    }
+
+    ListOptions_t options = { LIST_TABLE, LIST_ID, false, 0, 0, "No accounts match the query" };
+    Query_t query;
+    char error[BUFFER];
+    if (!listParseOptions(argc - i, argv + i, &options))
+    {
+        printUsage();
+        return 1;
+    }
+    if (!queryCompile(text, &query, error))
+    {
+        fprintf(stderr, "%s\n", error);
+        printUsage();
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    SlotList_t matches = { 0 };
+    bool ok = queryRun(&query, &matches);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!ok)
+        fprintf(stderr, "Out of memory\n");
+    else if (!(ok = listAccounts(STDOUT_FILENO, &matches, &options)))
+        fprintf(stderr, "Error writing the listing\n");
+    else
+        fprintf(stderr, "%zu accounts match (%.3f s)\n", matches.count,
+                (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    slotListFree(&matches);
+    return ok ? 0 : 1;
+}
+
+int runComplete(int argc, char *argv[])
+{
+    char *endptr = NULL;
+    long limit = argc > 3 ? strtol(argv[3], &endptr, 10) : COMPLETE_DEFAULT;
+    bool surname = argc > 1 && strcmp(argv[1], "surname") == 0;
+    if (argc < 3 || argc > 4 || (!surname && strcmp(argv[1], "name") != 0) || (endptr != NULL && *endptr != '\0') ||
+        limit < 1 || limit > COMPLETE_MAX)
+    {
+        fprintf(stderr, "Usage: complete name|surname PREFIX [LIMIT (1-%d)]\n", COMPLETE_MAX);
+        return 1;
+    }
+
+    NameCount_t names[COMPLETE_MAX];
+    size_t found;
+    if (!indexCompletions(surname ? SEARCH_SURNAME : SEARCH_NAME, argv[2], names, (size_t)limit, &found))
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < found; i++)
+        printf("%s\t%zu\n", names[i].name, names[i].count);
+    return 0;
+}
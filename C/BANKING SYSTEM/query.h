@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "bank.h"
+#include "index.h"
+
+// Compound account searches written as terms joined by AND (in any case):
+//   surname^=Kow AND balance>10000 AND debt=0
+// The numeric fields id, balance and debt take = != < <= > >=, amounts
+// written like the menus read them (100 or 100.50). The text fields
+// account, name, surname, address and pesel take = and != for the whole
+// field, ^= for a prefix, $= for a suffix and *= for a substring; a value
+// with spaces goes in double quotes.
+//
+// A compiled query checks its numeric terms first, a batch of slots at a
+// time over the hot column, and reads the cold records only for the slots
+// that pass them, cheaper text terms before dearer ones. An exact PESEL or
+// account number, or an exact or prefix name term, is looked up in the
+// indexes instead and only its candidates are checked.
+#define QUERY_MAX_TERMS 16
+#define COMPLETE_MAX 100
+
+typedef enum {
+    QUERY_ID,
+    QUERY_BALANCE,
+    QUERY_DEBT,
+    QUERY_ACCOUNT,
+    QUERY_PESEL,
+    QUERY_NAME,
+    QUERY_SURNAME,
+    QUERY_ADDRESS
+} QueryField_t;
+
+typedef enum {
+    QUERY_EQUAL,
+    QUERY_NOT_EQUAL,
+    QUERY_LESS,
+    QUERY_LESS_EQUAL,
+    QUERY_GREATER,
+    QUERY_GREATER_EQUAL,
+    QUERY_PREFIX,
+    QUERY_SUFFIX,
+    QUERY_CONTAINS
+} QueryOp_t;
+
+typedef struct {
+    QueryField_t field;
+    QueryOp_t op;
+    Money_t number;
+    Address text;
+    size_t length;
+} QueryTerm_t;
+
+typedef struct {
+    // The numeric terms come first, then the text terms cheapest first
+    QueryTerm_t terms[QUERY_MAX_TERMS];
+    int count;
+    int numeric;
+} Query_t;
+
+// Parses text into query. On failure error (BUFFER bytes) says what is
+// wrong and where.
+bool queryCompile(const char *text, Query_t *query, char *error);
+// Collects the slots of the matching accounts, ascending. Takes the store
+// lock itself, a batch at a time.
+bool queryRun(const Query_t *query, SlotList_t *matches);
+
+// query EXPRESSION... [--limit N] [--offset N] [--sort COLUMN[:desc]] [--format table|tsv]
+int runQuery(int argc, char *argv[]);
+
+// complete name|surname PREFIX [LIMIT]: the first names or surnames
+// starting with PREFIX and how many accounts carry each, one per line
+int runComplete(int argc, char *argv[]);
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bank.h"
+#include "money.h"
+#include "report.h"
+#include "store.h"
+#include "util.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define REPORT_AVX2
+#include <immintrin.h>
+#endif
+
+#define REPORT_MAX_THRESHOLDS 8
+#define HISTOGRAM_BOUNDARIES 7
+// Percentiles first find their coarse bucket (balance >> COARSE_SHIFT) and
+// then count the exact balances inside it
+#define COARSE_SHIFT 16
+#define COARSE_BUCKETS ((CASH_MAX >> COARSE_SHIFT) + 1)
+#define FINE_BUCKETS (1 << COARSE_SHIFT)
+
+// Lower bounds of the histogram buckets after the first, which holds zero
+// balances: 0.01, 1, 10, ... 100000 zł
+static const Money_t boundaries[HISTOGRAM_BOUNDARIES] = { 1, 100, 1000, 10000, 100000, 1000000, 10000000 };
+
+static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+
+#define PERCENTILES_COUNT (sizeof(percentiles) / sizeof(percentiles[0]))
+
+typedef struct
+{
+    int64_t balance_total;
+    int64_t debt_total;
+    uint64_t debt_over[REPORT_MAX_THRESHOLDS];
+    uint64_t balance_at_least[HISTOGRAM_BOUNDARIES];
+    uint32_t coarse[COARSE_BUCKETS];
+} Totals_t;
+
+// Tombstones are zeroed, so they add nothing to the sums and counts; only
+// the coarse bucket of zero balances has to be corrected for them
+static uint32_t coarseOf(Money_t balance)
+{
+    uint64_t bucket = (uint64_t)balance >> COARSE_SHIFT;
+    return bucket < COARSE_BUCKETS ? (uint32_t)bucket : COARSE_BUCKETS - 1;
+}
+
+static void sumScalar(const AccountHot_t *hot, uint32_t begin, uint32_t end,
+                      const Money_t *thresholds, size_t threshold_count, Totals_t *totals)
+{
+    for (uint32_t slot = begin; slot < end; slot++)
+    {
+        Money_t balance = hot[slot].balance, debt = hot[slot].debt;
+        totals->balance_total += balance;
+        totals->debt_total += debt;
+        for (size_t t = 0; t < threshold_count; t++)
+            totals->debt_over[t] += debt > thresholds[t];
+        for (size_t b = 0; b < HISTOGRAM_BOUNDARIES; b++)
+            totals->balance_at_least[b] += balance >= boundaries[b];
+        totals->coarse[coarseOf(balance)]++;
+    }
+}
+
+#ifdef REPORT_AVX2
+// Four accounts per step: balances and debts are gathered out of the 24
+// byte hot records, and every comparison adds its all-ones mask (-1) to a
+// per-lane counter, so the loop has no branches
+__attribute__((target("avx2")))
+static uint32_t sumAVX2(const AccountHot_t *hot, uint32_t slots,
+                        const Money_t *thresholds, size_t threshold_count, Totals_t *totals)
+{
+    const __m256i stride = _mm256_set_epi64x(9, 6, 3, 0);
+    __m256i balance_sum = _mm256_setzero_si256(), debt_sum = _mm256_setzero_si256();
+    __m256i over[REPORT_MAX_THRESHOLDS], at_least[HISTOGRAM_BOUNDARIES];
+    __m256i over_limit[REPORT_MAX_THRESHOLDS], below_boundary[HISTOGRAM_BOUNDARIES];
+    for (size_t t = 0; t < threshold_count; t++)
+    {
+        over[t] = _mm256_setzero_si256();
+        over_limit[t] = _mm256_set1_epi64x(thresholds[t]);
+    }
+    for (size_t b = 0; b < HISTOGRAM_BOUNDARIES; b++)
+    {
+        at_least[b] = _mm256_setzero_si256();
+        below_boundary[b] = _mm256_set1_epi64x(boundaries[b] - 1);
+    }
+
+    uint32_t slot = 0;
+    for (; slot + 4 <= slots; slot += 4)
+    {
+        const long long *base = (const long long *)&hot[slot];
+        __m256i balance = _mm256_i64gather_epi64(base + 1, stride, 8);
+        __m256i debt = _mm256_i64gather_epi64(base + 2, stride, 8);
+        balance_sum = _mm256_add_epi64(balance_sum, balance);
+        debt_sum = _mm256_add_epi64(debt_sum, debt);
+        for (size_t t = 0; t < threshold_count; t++)
+            over[t] = _mm256_sub_epi64(over[t], _mm256_cmpgt_epi64(debt, over_limit[t]));
+        for (size_t b = 0; b < HISTOGRAM_BOUNDARIES; b++)
+            at_least[b] = _mm256_sub_epi64(at_least[b], _mm256_cmpgt_epi64(balance, below_boundary[b]));
+        for (uint32_t i = 0; i < 4; i++)
+            totals->coarse[coarseOf(hot[slot + i].balance)]++;
+    }
+
+    long long lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, balance_sum);
+    totals->balance_total += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_si256((__m256i *)lanes, debt_sum);
+    totals->debt_total += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (size_t t = 0; t < threshold_count; t++)
+    {
+        _mm256_storeu_si256((__m256i *)lanes, over[t]);
+        totals->debt_over[t] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    for (size_t b = 0; b < HISTOGRAM_BOUNDARIES; b++)
+    {
+        _mm256_storeu_si256((__m256i *)lanes, at_least[b]);
+        totals->balance_at_least[b] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    return slot;
+}
+#endif
+
+// Returns the name of the code path that did the work
+static const char *sumColumn(const Money_t *thresholds, size_t threshold_count, Totals_t *totals)
+{
+    const AccountHot_t *hot = storeHotColumn();
+    uint32_t slots = storeSlots(), done = 0;
+    const char *path = "scalar";
+#ifdef REPORT_AVX2
+    if (__builtin_cpu_supports("avx2"))
+    {
+        done = sumAVX2(hot, slots, thresholds, threshold_count, totals);
+        path = "AVX2";
+    }
+#endif
+    sumScalar(hot, done, slots, thresholds, threshold_count, totals);
+    totals->coarse[0] -= slots - storeCount();
+    return path;
+}
+
+// Nearest-rank percentiles: the coarse histogram names the bucket holding
+// each rank, and one more pass counts the exact balances in those buckets
+static bool findPercentiles(const Totals_t *totals, uint64_t count, Money_t *values)
+{
+    uint32_t bucket[PERCENTILES_COUNT];
+    uint64_t rank[PERCENTILES_COUNT];
+    uint32_t *fine = calloc(PERCENTILES_COUNT * FINE_BUCKETS, sizeof(uint32_t));
+    if (fine == NULL)
+        return false;
+
+    for (size_t p = 0; p < PERCENTILES_COUNT; p++)
+    {
+        uint64_t wanted = (uint64_t)(percentiles[p] / 100.0 * count + 0.999999);
+        rank[p] = wanted ? wanted : 1;
+        uint64_t below = 0;
+        bucket[p] = 0;
+        while (bucket[p] + 1 < COARSE_BUCKETS && below + totals->coarse[bucket[p]] < rank[p])
+            below += totals->coarse[bucket[p]++];
+        rank[p] -= below;
+    }
+
+    const AccountHot_t *hot = storeHotColumn();
+    for (uint32_t slot = 0; slot < storeSlots(); slot++)
+    {
+        if (hot[slot].id == 0)
+            continue;
+        uint32_t coarse = coarseOf(hot[slot].balance);
+        for (size_t p = 0; p < PERCENTILES_COUNT; p++)
+        {
+            if (coarse == bucket[p])
+                fine[p * FINE_BUCKETS + (hot[slot].balance & (FINE_BUCKETS - 1))]++;
+        }
+    }
+
+    for (size_t p = 0; p < PERCENTILES_COUNT; p++)
+    {
+        const uint32_t *counts = &fine[p * FINE_BUCKETS];
+        uint64_t seen = 0;
+        uint32_t offset = 0;
+        while (offset + 1 < FINE_BUCKETS && seen + counts[offset] < rank[p])
+            seen += counts[offset++];
+        values[p] = ((Money_t)bucket[p] << COARSE_SHIFT) + offset;
+    }
+    free(fine);
+    return true;
+}
+
+static Money_t mean(int64_t total, uint64_t count)
+{
+    return count ? (total + (int64_t)count / 2) / (int64_t)count : 0;
+}
+
+int runReport(int argc, char *argv[])
+{
+    Money_t thresholds[REPORT_MAX_THRESHOLDS] = { 0, 100000, 1000000, 5000000 };
+    size_t threshold_count = 4;
+    if (argc > 1)
+    {
+        threshold_count = 0;
+        for (int i = 1; i < argc; i++)
+        {
+            if (threshold_count == REPORT_MAX_THRESHOLDS || !parseMoney(argv[i], &thresholds[threshold_count]) ||
+                thresholds[threshold_count] < 0)
+            {
+                fprintf(stderr, "Debt thresholds must be up to %d non-negative amounts, got '%s'\n",
+                        REPORT_MAX_THRESHOLDS, argv[i]);
+                return 1;
+            }
+            threshold_count++;
+        }
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Totals_t *totals = calloc(1, sizeof(Totals_t));
+    Money_t values[PERCENTILES_COUNT];
+    if (totals == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    uint64_t count = storeCount();
+    const char *path = sumColumn(thresholds, threshold_count, totals);
+    if (count > 0 && !findPercentiles(totals, count, values))
+    {
+        fprintf(stderr, "Out of memory\n");
+        free(totals);
+        return 1;
+    }
+    double seconds = elapsedSince(&start);
+
+    char label[BUFFER], low[MONEY_BUFFER], high[MONEY_BUFFER];
+    printf("%-24s %16lu\n", "Accounts", (unsigned long)count);
+    printMoneyRow("Total balance", totals->balance_total);
+    printMoneyRow("Mean balance", mean(totals->balance_total, count));
+    printMoneyRow("Total debt", totals->debt_total);
+    printMoneyRow("Mean debt", mean(totals->debt_total, count));
+
+    printf("\n%-24s %16s\n", "Debt above", "Accounts");
+    for (size_t t = 0; t < threshold_count; t++)
+    {
+        formatMoney(thresholds[t], low);
+        printf("%-24s %16lu\n", low, (unsigned long)totals->debt_over[t]);
+    }
+
+    printf("\n%-24s %16s\n", "Balance", "Accounts");
+    printf("%-24s %16lu\n", "0.00", (unsigned long)(count - totals->balance_at_least[0]));
+    for (size_t b = 0; b < HISTOGRAM_BOUNDARIES; b++)
+    {
+        uint64_t above = b + 1 < HISTOGRAM_BOUNDARIES ? totals->balance_at_least[b + 1] : 0;
+        formatMoney(boundaries[b], low);
+        formatMoney(b + 1 < HISTOGRAM_BOUNDARIES ? boundaries[b + 1] - 1 : CASH_MAX, high);
+        snprintf(label, sizeof(label), "%s - %s", low, high);
+        printf("%-24s %16lu\n", label, (unsigned long)(totals->balance_at_least[b] - above));
+    }
+
+    if (count > 0)
+    {
+        printf("\n%-24s %16s\n", "Percentile", "Balance");
+        for (size_t p = 0; p < PERCENTILES_COUNT; p++)
+        {
+            snprintf(label, sizeof(label), "p%g", percentiles[p]);
+            printMoneyRow(label, values[p]);
+        }
+    }
+    printf("\nReport over %u slots in %.3f s (%s)\n", storeSlots(), seconds, path);
+    free(totals);
+    return 0;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+// End-of-day figures over every account: total and mean balance and debt,
+// how many debts exceed each threshold, a balance histogram by decade and
+// balance percentiles. The aggregates come from one pass over the hot
+// column, with AVX2 when the processor has it; the percentiles take a
+// second pass that only looks at the histogram buckets they fall into.
+// argv[1..] are the debt thresholds, by default 0, 1000, 10000 and 50000.
+int runReport(int argc, char *argv[]);
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "scratch.h"
+
+bool scratchCreate(ScratchFiles_t *files, const char *name)
+{
+    const char *tmp = getenv("TMPDIR");
+    snprintf(files->directory, sizeof(files->directory), "%s/bank-%s-XXXXXX", tmp != NULL ? tmp : "/tmp", name);
+    if (mkdtemp(files->directory) == NULL)
+        return false;
+    snprintf(files->data, sizeof(files->data), "%s/%s", files->directory, DATA_FILE);
+    snprintf(files->hot, sizeof(files->hot), "%s/%s", files->directory, HOT_FILE);
+    snprintf(files->wal, sizeof(files->wal), "%s/%s", files->directory, WAL_FILE);
+    snprintf(files->index, sizeof(files->index), "%s/%s", files->directory, INDEX_FILE);
+    snprintf(files->snapshot, sizeof(files->snapshot), "%s/%s", files->directory, SNAPSHOT_FILE);
+    return true;
+}
+
+void scratchRemove(const ScratchFiles_t *files)
+{
+    char tmp_path[BUFFER + 8], snapshot_tmp_path[BUFFER + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", files->index);
+    snprintf(snapshot_tmp_path, sizeof(snapshot_tmp_path), "%s.tmp", files->snapshot);
+    unlink(files->data);
+    unlink(files->hot);
+    unlink(files->wal);
+    unlink(files->index);
+    unlink(tmp_path);
+    unlink(files->snapshot);
+    unlink(snapshot_tmp_path);
+    rmdir(files->directory);
+}
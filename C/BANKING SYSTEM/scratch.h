@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "bank.h"
+
+// Throwaway store files in a fresh directory under $TMPDIR (or /tmp), for
+// the commands that exercise the store without touching the bank's own
+typedef struct
+{
+    char directory[BUFFER / 2];
+    char data[BUFFER];
+    char hot[BUFFER];
+    char wal[BUFFER];
+    char index[BUFFER];
+    char snapshot[BUFFER];
+} ScratchFiles_t;
+
+bool scratchCreate(ScratchFiles_t *files, const char *name);
+// Removes the files and the directory
+void scratchRemove(const ScratchFiles_t *files);
@@ -0,0 +1,803 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "bank.h"
+#include "batch.h"
+#include "index.h"
+#include "listing.h"
+#include "metrics.h"
+#include "money.h"
+#include "server.h"
+#include "store.h"
+#include "util.h"
+
+#define SERVER_DEFAULT_WORKERS 8
+#define SERVER_MAX_WORKERS 256
+#define SERVER_MAX_EVENTS 64
+#define SERVER_MAX_LINE 4096
+#define SERVER_READ_CHUNK 4096
+// Answers waiting to be sent past which no further request is handed out
+#define SERVER_MAX_OUTPUT (1u << 20)
+// Accounts in one page of a name search, and names in one completion
+#define SERVER_PAGE_MAX 1000
+#define SERVER_COMPLETIONS 10
+#define SERVER_COMPLETIONS_MAX 100
+
+typedef struct
+{
+    char *data;
+    size_t used;
+    size_t capacity;
+} Buffer_t;
+
+typedef struct Connection
+{
+    int fd;
+    Buffer_t in;
+    Buffer_t out;
+    size_t out_sent;
+    uint32_t events;
+    // eof: nothing more is read (the client sent everything, or a line too
+    // long), answer it and close once the answers are out; busy: a request
+    // is with the workers; closed: the client is gone and the connection is
+    // freed once its request comes back
+    bool eof;
+    bool busy;
+    bool closed;
+    struct Connection *prev;
+    struct Connection *next;
+} Connection_t;
+
+typedef struct Job
+{
+    Connection_t *connection;
+    char *request;
+    Buffer_t response;
+    struct Job *next;
+} Job_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Job_t *head;
+    Job_t *tail;
+    bool stopping;
+} JobQueue_t;
+
+static JobQueue_t requests = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static Job_t *done_jobs;
+static int done_fd = -1;
+// Workers handling a request; a commit leader only waits for others to
+// join its group when some are
+static atomic_uint active_workers;
+static Connection_t *connections;
+
+// epoll tags for the descriptors that are not connections
+static char listener_tag, signal_tag, done_tag;
+
+static const struct
+{
+    const char *name;
+    SearchField_t field;
+    size_t offset;
+} search_fields[] = {
+    { "account", SEARCH_ACCOUNT, offsetof(AccountCold_t, account_number) },
+    { "name", SEARCH_NAME, offsetof(AccountCold_t, first_name) },
+    { "surname", SEARCH_SURNAME, offsetof(AccountCold_t, last_name) },
+    { "address", SEARCH_ADDRESS, offsetof(AccountCold_t, address) },
+    { "pesel", SEARCH_PESEL, offsetof(AccountCold_t, pesel_number) },
+};
+
+#define SEARCH_FIELDS_COUNT (sizeof(search_fields) / sizeof(search_fields[0]))
+
+static bool bufferAppend(Buffer_t *buffer, const char *data, size_t size)
+{
+    if (buffer->used + size > buffer->capacity)
+    {
+        size_t new_capacity = buffer->capacity ? buffer->capacity : 256;
+        while (new_capacity < buffer->used + size)
+            new_capacity *= 2;
+        char *new_data = realloc(buffer->data, new_capacity);
+        if (new_data == NULL)
+            return false;
+        buffer->data = new_data;
+        buffer->capacity = new_capacity;
+    }
+    memcpy(buffer->data + buffer->used, data, size);
+    buffer->used += size;
+    return true;
+}
+
+static bool bufferPrint(Buffer_t *buffer, const char *text)
+{
+    return bufferAppend(buffer, text, strlen(text));
+}
+
+static bool appendAccount(Buffer_t *buffer, const Account_t *account)
+{
+    char line[BUFFER * 2], balance[MONEY_BUFFER], debt[MONEY_BUFFER];
+    formatMoney(account->balance, balance);
+    formatMoney(account->debt, debt);
+    int length = snprintf(line, sizeof(line), "%u;%s;%s;%s;%s;%s;%s;%s\n", account->id, account->account_number,
+                          account->first_name, account->last_name, account->address, account->pesel_number,
+                          balance, debt);
+    return bufferAppend(buffer, line, (size_t)length);
+}
+
+static void replyError(Buffer_t *response, const char *error_msg)
+{
+    response->used = 0;
+    bufferPrint(response, "ERR ");
+    bufferPrint(response, error_msg);
+    bufferPrint(response, "\n");
+}
+
+static bool appendAccounts(Buffer_t *response, const SlotList_t *slots)
+{
+    for (size_t i = 0; i < slots->count; i++)
+    {
+        Account_t account;
+        if (storeRead(slots->slots[i], &account) && !appendAccount(response, &account))
+            return false;
+    }
+    return true;
+}
+
+static bool replyAccounts(Buffer_t *response, const SlotList_t *slots)
+{
+    char header[CHARBUFFER];
+    snprintf(header, sizeof(header), "OK %zu\n", slots->count);
+    return bufferPrint(response, header) && appendAccounts(response, slots);
+}
+
+// Requests
+
+static void handleChange(char *request, Buffer_t *response)
+{
+    char error_msg[BUFFER];
+    bool applied = batchApplyLine(request, error_msg);
+    if (applied && !storeSync(atomic_load(&active_workers) > 1))
+    {
+        applied = false;
+        strcpy(error_msg, "Error writing to file");
+    }
+
+    if (applied)
+        bufferPrint(response, "OK\n");
+    else
+        replyError(response, error_msg);
+}
+
+static void handleGet(const char *id_text, Buffer_t *response)
+{
+    char *endptr;
+    unsigned long id = strtoul(id_text, &endptr, 10);
+    if (*endptr != '\0' || endptr == id_text || id == 0 || id > UINT32_MAX)
+    {
+        replyError(response, "Invalid account ID");
+        return;
+    }
+
+    Account_t account;
+    bool found = storeGet((uint32_t)id, &account);
+
+    if (!found)
+        bufferPrint(response, "OK 0\n");
+    else if (!bufferPrint(response, "OK 1\n") || !appendAccount(response, &account))
+        replyError(response, "Out of memory");
+}
+
+// search;name|surname;KEY;OFFSET;LIMIT, answered from the name indexes
+// alone with "OK <count> <total>"
+static void handleNamePage(SearchField_t field, const char *key, char *paging, Buffer_t *response)
+{
+    char *limit_text = strchr(paging, ';');
+    uint32_t offset, limit;
+    if (limit_text != NULL)
+        *limit_text++ = '\0';
+    if (limit_text == NULL || !parseCount(paging, UINT32_MAX, &offset) ||
+        !parseCount(limit_text, SERVER_PAGE_MAX, &limit) || (key[0] != '=' && key[strlen(key) - 1] != '*'))
+    {
+        replyError(response, "Usage: search;name|surname;PREFIX*|=NAME;OFFSET;LIMIT");
+        return;
+    }
+
+    // The prefix form of the menus' keys, the trailing '*' dropped
+    Fixed_string name;
+    snprintf(name, sizeof(name), "%.*s", (int)(strlen(key) - (key[0] != '=')), key);
+    SlotList_t page = { 0 };
+    size_t total = 0;
+    char header[CHARBUFFER];
+    storeLock();
+    bool ok = indexNamePage(field, name, offset, limit, &page, &total);
+    snprintf(header, sizeof(header), "OK %zu %zu\n", page.count, total);
+    ok = ok && bufferPrint(response, header) && appendAccounts(response, &page);
+    storeUnlock();
+    slotListFree(&page);
+    if (!ok)
+        replyError(response, "Out of memory");
+}
+
+static void handleSearch(char *arguments, Buffer_t *response)
+{
+    char *key = strchr(arguments, ';');
+    size_t f = 0;
+    if (key != NULL)
+    {
+        *key++ = '\0';
+        while (f < SEARCH_FIELDS_COUNT && strcmp(arguments, search_fields[f].name) != 0)
+            f++;
+    }
+    if (key == NULL || f == SEARCH_FIELDS_COUNT || *key == '\0')
+    {
+        replyError(response, "Usage: search;account|name|surname|address|pesel;KEY");
+        return;
+    }
+    char *paging = strchr(key, ';');
+    if (paging != NULL && (search_fields[f].field == SEARCH_NAME || search_fields[f].field == SEARCH_SURNAME))
+    {
+        *paging++ = '\0';
+        handleNamePage(search_fields[f].field, key, paging, response);
+        return;
+    }
+
+    // Keys the indexes cannot answer fall back to a substring scan, as in the menus
+    SlotList_t matches = { 0 };
+    storeLock();
+    bool ok = true;
+    if (!indexSearch(search_fields[f].field, key, &matches))
+    {
+        for (uint32_t slot = 0; ok && slot < storeSlots(); slot++)
+        {
+            const AccountCold_t *account = storeCold(slot);
+            if (account != NULL && strstr((const char *)account + search_fields[f].offset, key) != NULL)
+                ok = slotListAppend(&matches, slot);
+        }
+    }
+    ok = ok && replyAccounts(response, &matches);
+    storeUnlock();
+    slotListFree(&matches);
+
+    if (!ok)
+        replyError(response, "Out of memory");
+}
+
+static void handleTop(char *arguments, Buffer_t *response)
+{
+    ListOptions_t options = { LIST_TABLE, LIST_ID, true, 0, 0, NULL };
+    char *column = strchr(arguments, ';'), *order = NULL;
+    if (column != NULL)
+    {
+        *column++ = '\0';
+        order = strchr(column, ':');
+        if (order != NULL)
+            *order++ = '\0';
+    }
+    if (column == NULL || !parseCount(arguments, UINT32_MAX, &options.limit) || options.limit == 0 ||
+        !listColumnByName(column, &options.sort) ||
+        (order != NULL && strcmp(order, "asc") != 0 && strcmp(order, "desc") != 0))
+    {
+        replyError(response, "Usage: top;COUNT;COLUMN[:asc]");
+        return;
+    }
+    options.descending = order == NULL || strcmp(order, "desc") == 0;
+
+    // The store lock is recursive, so the order stays put until it is sent
+    SlotList_t top = { 0 };
+    storeLock();
+    bool ok = listOrder(NULL, &options, &top) && replyAccounts(response, &top);
+    storeUnlock();
+    slotListFree(&top);
+    if (!ok)
+        replyError(response, "Out of memory");
+}
+
+// complete;name|surname;PREFIX[;LIMIT], answered with "OK <count>" and a
+// NAME;ACCOUNTS line per name
+static void handleComplete(char *arguments, Buffer_t *response)
+{
+    char *prefix = strchr(arguments, ';'), *limit_text = NULL;
+    uint32_t limit = SERVER_COMPLETIONS;
+    if (prefix != NULL)
+    {
+        *prefix++ = '\0';
+        limit_text = strchr(prefix, ';');
+        if (limit_text != NULL)
+            *limit_text++ = '\0';
+    }
+    bool surname = strcmp(arguments, "surname") == 0;
+    if (prefix == NULL || (!surname && strcmp(arguments, "name") != 0) ||
+        (limit_text != NULL && (!parseCount(limit_text, SERVER_COMPLETIONS_MAX, &limit) || limit == 0)))
+    {
+        replyError(response, "Usage: complete;name|surname;PREFIX[;LIMIT]");
+        return;
+    }
+
+    NameCount_t names[SERVER_COMPLETIONS_MAX];
+    size_t found;
+    storeLock();
+    bool ok = indexCompletions(surname ? SEARCH_SURNAME : SEARCH_NAME, prefix, names, limit, &found);
+    storeUnlock();
+    char line[CHARBUFFER * 2];
+    snprintf(line, sizeof(line), "OK %zu\n", found);
+    ok = ok && bufferPrint(response, line);
+    for (size_t i = 0; ok && i < found; i++)
+    {
+        snprintf(line, sizeof(line), "%s;%zu\n", names[i].name, names[i].count);
+        ok = bufferPrint(response, line);
+    }
+    if (!ok)
+        replyError(response, "Out of memory");
+}
+
+static void handleMetrics(Buffer_t *response)
+{
+    char *text = NULL;
+    size_t size = 0;
+    FILE *file = open_memstream(&text, &size);
+    bool ok = file != NULL && metricsWrite(file);
+    ok = file != NULL && fclose(file) == 0 && ok;
+
+    size_t lines = 0;
+    for (size_t i = 0; ok && i < size; i++)
+        lines += text[i] == '\n';
+    char count[32];
+    snprintf(count, sizeof(count), "OK %zu\n", lines);
+    if (!ok || !bufferPrint(response, count) || !bufferAppend(response, text, size))
+        replyError(response, "Out of memory");
+    free(text);
+}
+
+static void handleRequest(char *request, Buffer_t *response)
+{
+    char *arguments = strchr(request, ';');
+    size_t name_length = arguments != NULL ? (size_t)(arguments - request) : strlen(request);
+    if (name_length == 3 && strncmp(request, "get", 3) == 0 && arguments != NULL)
+        handleGet(arguments + 1, response);
+    else if (name_length == 6 && strncmp(request, "search", 6) == 0 && arguments != NULL)
+        handleSearch(arguments + 1, response);
+    else if (name_length == 3 && strncmp(request, "top", 3) == 0 && arguments != NULL)
+        handleTop(arguments + 1, response);
+    else if (name_length == 8 && strncmp(request, "complete", 8) == 0 && arguments != NULL)
+        handleComplete(arguments + 1, response);
+    else if (strcmp(request, "metrics") == 0)
+        handleMetrics(response);
+    else
+        handleChange(request, response);
+}
+
+// Worker threads
+
+static void pushJob(Job_t *job)
+{
+    pthread_mutex_lock(&requests.lock);
+    job->next = NULL;
+    if (requests.tail != NULL)
+        requests.tail->next = job;
+    else
+        requests.head = job;
+    requests.tail = job;
+    pthread_cond_signal(&requests.ready);
+    pthread_mutex_unlock(&requests.lock);
+}
+
+// Returns NULL once the queue is stopping
+static Job_t *popJob()
+{
+    pthread_mutex_lock(&requests.lock);
+    while (requests.head == NULL && !requests.stopping)
+        pthread_cond_wait(&requests.ready, &requests.lock);
+    Job_t *job = requests.head;
+    if (job != NULL)
+    {
+        requests.head = job->next;
+        if (requests.head == NULL)
+            requests.tail = NULL;
+    }
+    pthread_mutex_unlock(&requests.lock);
+    return job;
+}
+
+static void *workerMain(void *unused)
+{
+    (void)unused;
+    Job_t *job;
+    while ((job = popJob()) != NULL)
+    {
+        atomic_fetch_add(&active_workers, 1);
+        handleRequest(job->request, &job->response);
+        atomic_fetch_sub(&active_workers, 1);
+
+        pthread_mutex_lock(&done_lock);
+        job->next = done_jobs;
+        done_jobs = job;
+        pthread_mutex_unlock(&done_lock);
+        uint64_t one = 1;
+        if (write(done_fd, &one, sizeof(one)) != sizeof(one))
+            perror("eventfd");
+    }
+    return NULL;
+}
+
+// Event loop
+
+static void freeConnection(Connection_t *connection)
+{
+    if (connection->prev != NULL)
+        connection->prev->next = connection->next;
+    else
+        connections = connection->next;
+    if (connection->next != NULL)
+        connection->next->prev = connection->prev;
+    free(connection->in.data);
+    free(connection->out.data);
+    free(connection);
+}
+
+static void closeConnection(Connection_t *connection)
+{
+    if (!connection->closed)
+    {
+        close(connection->fd);
+        connection->closed = true;
+    }
+    if (!connection->busy)
+        freeConnection(connection);
+}
+
+// Reading pauses once more than a line is buffered, until the lines in it
+// are handed out, so a client that sends without waiting for its answers
+// cannot grow the buffer without bound
+static bool watch(int epoll_fd, int op, Connection_t *connection)
+{
+    bool reading = !connection->eof && connection->in.used <= SERVER_MAX_LINE;
+    uint32_t events = (reading ? EPOLLIN : 0) | (connection->out.used > 0 ? EPOLLOUT : 0);
+    if (op == EPOLL_CTL_MOD && events == connection->events)
+        return true;
+    struct epoll_event event = { .events = events, .data.ptr = connection };
+    connection->events = events;
+    return epoll_ctl(epoll_fd, op, connection->fd, &event) == 0;
+}
+
+// Returns false when the connection had to be closed
+static bool flushOutput(int epoll_fd, Connection_t *connection)
+{
+    while (connection->out_sent < connection->out.used)
+    {
+        ssize_t sent = send(connection->fd, connection->out.data + connection->out_sent,
+                            connection->out.used - connection->out_sent, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EAGAIN)
+            break;
+        if (sent <= 0)
+        {
+            closeConnection(connection);
+            return false;
+        }
+        connection->out_sent += sent;
+    }
+    if (connection->out_sent == connection->out.used)
+        connection->out_sent = connection->out.used = 0;
+    watch(epoll_fd, EPOLL_CTL_MOD, connection);
+    return true;
+}
+
+// Hands the next complete line to the workers, one at a time per connection
+// so that its answers keep their order, and none while the client leaves
+// too many answers unread. The connection may be gone after it
+static void dispatchNext(int epoll_fd, Connection_t *connection)
+{
+    while (!connection->busy && !connection->closed && connection->out.used <= SERVER_MAX_OUTPUT)
+    {
+        char *end = memchr(connection->in.data, '\n', connection->in.used);
+        size_t length = end != NULL ? (size_t)(end - connection->in.data) : connection->in.used;
+        if (length > SERVER_MAX_LINE)
+        {
+            bufferPrint(&connection->out, "ERR Request is too long\n");
+            connection->in.used = 0;
+            connection->eof = true;
+            if (flushOutput(epoll_fd, connection) && connection->out.used == 0)
+                closeConnection(connection);
+            return;
+        }
+        if (end == NULL)
+        {
+            if (connection->eof && connection->out.used == 0)
+                closeConnection(connection);
+            else
+                watch(epoll_fd, EPOLL_CTL_MOD, connection);
+            return;
+        }
+
+        Job_t *job = calloc(1, sizeof(Job_t));
+        char *request = malloc(length + 1);
+        if (job == NULL || request == NULL)
+        {
+            free(job);
+            free(request);
+            closeConnection(connection);
+            return;
+        }
+        memcpy(request, connection->in.data, length);
+        request[length] = '\0';
+        if (length > 0 && request[length - 1] == '\r')
+            request[length - 1] = '\0';
+        connection->in.used -= length + 1;
+        memmove(connection->in.data, end + 1, connection->in.used);
+
+        if (request[0] == '\0')
+        {
+            free(request);
+            free(job);
+            continue;
+        }
+        job->connection = connection;
+        job->request = request;
+        connection->busy = true;
+        pushJob(job);
+    }
+    if (!connection->closed)
+        watch(epoll_fd, EPOLL_CTL_MOD, connection);
+}
+
+static void readInput(int epoll_fd, Connection_t *connection)
+{
+    char chunk[SERVER_READ_CHUNK];
+    while (connection->in.used <= SERVER_MAX_LINE)
+    {
+        ssize_t got = recv(connection->fd, chunk, sizeof(chunk), 0);
+        if (got < 0 && errno == EAGAIN)
+            break;
+        if (got == 0)
+        {
+            connection->eof = true;
+            watch(epoll_fd, EPOLL_CTL_MOD, connection);
+            break;
+        }
+        if (got < 0 || !bufferAppend(&connection->in, chunk, (size_t)got))
+        {
+            closeConnection(connection);
+            return;
+        }
+    }
+    dispatchNext(epoll_fd, connection);
+}
+
+static void acceptClients(int epoll_fd, int listener)
+{
+    int fd;
+    while ((fd = accept(listener, NULL, NULL)) >= 0)
+    {
+        Connection_t *connection = calloc(1, sizeof(Connection_t));
+        if (connection == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) != 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) != 0)
+        {
+            free(connection);
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        connection->next = connections;
+        if (connections != NULL)
+            connections->prev = connection;
+        connections = connection;
+        if (!watch(epoll_fd, EPOLL_CTL_ADD, connection))
+            closeConnection(connection);
+    }
+}
+
+static void finishJobs(int epoll_fd)
+{
+    uint64_t count;
+    if (read(done_fd, &count, sizeof(count)) != sizeof(count))
+        return;
+
+    pthread_mutex_lock(&done_lock);
+    Job_t *jobs = done_jobs;
+    done_jobs = NULL;
+    pthread_mutex_unlock(&done_lock);
+
+    while (jobs != NULL)
+    {
+        Job_t *job = jobs;
+        jobs = job->next;
+        Connection_t *connection = job->connection;
+        connection->busy = false;
+        if (connection->closed)
+            freeConnection(connection);
+        else if (bufferAppend(&connection->out, job->response.data, job->response.used) &&
+                 flushOutput(epoll_fd, connection))
+            dispatchNext(epoll_fd, connection);
+        free(job->request);
+        free(job->response.data);
+        free(job);
+    }
+}
+
+static int openListener(const char *path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    // The data file lock is already ours, so a socket left at the path is
+    // stale; anything else there is not ours to remove
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0)
+    {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool addTag(int epoll_fd, int fd, void *tag)
+{
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = tag };
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+// SIGUSR1 dumps the metrics and keeps serving; the others stop the server
+static bool handleSignals(int signal_fd)
+{
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+    {
+        if (info.ssi_signo != SIGUSR1)
+            return false;
+        if (!metricsDump(metricsPath()))
+            fprintf(stderr, "Could not write metrics to %s\n", metricsPath());
+    }
+    return true;
+}
+
+static void serve(int epoll_fd, int listener, int signal_fd)
+{
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    while (1)
+    {
+        int count = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, -1);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+        {
+            perror("epoll_wait");
+            return;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            void *tag = events[i].data.ptr;
+            if (tag == &signal_tag)
+            {
+                if (!handleSignals(signal_fd))
+                    return;
+            }
+            else if (tag == &listener_tag)
+                acceptClients(epoll_fd, listener);
+            else if (tag == &done_tag)
+                finishJobs(epoll_fd);
+            else if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN))
+                closeConnection(tag);
+            else if (events[i].events & EPOLLIN)
+                readInput(epoll_fd, tag);
+            else if (events[i].events & EPOLLOUT && flushOutput(epoll_fd, tag))
+                dispatchNext(epoll_fd, tag);
+        }
+    }
+}
+
+int runServer(int argc, char *argv[])
+{
+    const char *path = argc > 1 ? argv[1] : SOCKET_FILE;
+    long workers = argc > 2 ? strtol(argv[2], NULL, 10) : SERVER_DEFAULT_WORKERS;
+    if (workers < 1 || workers > SERVER_MAX_WORKERS)
+    {
+        fprintf(stderr, "Worker count must be between 1 and %d\n", SERVER_MAX_WORKERS);
+        return 1;
+    }
+
+    // The signals are read from a descriptor; blocking them first means the
+    // worker threads inherit the mask and never take them
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+
+    int listener = openListener(path);
+    int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_t threads[SERVER_MAX_WORKERS];
+    long started = 0;
+    bool ok = listener >= 0 && signal_fd >= 0 && epoll_fd >= 0 && done_fd >= 0 &&
+              addTag(epoll_fd, listener, &listener_tag) && addTag(epoll_fd, signal_fd, &signal_tag) &&
+              addTag(epoll_fd, done_fd, &done_tag);
+
+    storeSetAutocommit(false);
+    while (ok && started < workers && pthread_create(&threads[started], NULL, workerMain, NULL) == 0)
+        started++;
+    if (ok && started == workers)
+    {
+        printf("Serving on %s with %ld workers\n", path, workers);
+        fflush(stdout);
+        serve(epoll_fd, listener, signal_fd);
+    }
+    else if (listener >= 0)
+    {
+        fprintf(stderr, "Failed to start the server\n");
+        ok = false;
+    }
+
+    pthread_mutex_lock(&requests.lock);
+    requests.stopping = true;
+    pthread_cond_broadcast(&requests.ready);
+    pthread_mutex_unlock(&requests.lock);
+    for (long i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    storeSetAutocommit(true);
+
+    while (requests.head != NULL)
+    {
+        Job_t *job = requests.head;
+        requests.head = job->next;
+        free(job->request);
+        free(job);
+    }
+    while (done_jobs != NULL)
+    {
+        Job_t *job = done_jobs;
+        done_jobs = job->next;
+        free(job->request);
+        free(job->response.data);
+        free(job);
+    }
+    requests.tail = NULL;
+    while (connections != NULL)
+    {
+        Connection_t *connection = connections;
+        if (!connection->closed)
+            close(connection->fd);
+        freeConnection(connection);
+    }
+
+    if (listener >= 0)
+    {
+        close(listener);
+        unlink(path);
+    }
+    if (signal_fd >= 0)
+        close(signal_fd);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    if (done_fd >= 0)
+        close(done_fd);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return ok ? 0 : 1;
+}
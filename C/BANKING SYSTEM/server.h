@@ -0,0 +1,29 @@
+#pragma once
+
+// Daemon mode: owns the account store and serves many clients at once over
+// a Unix domain socket. The protocol is line based, one request per line in
+// the batch syntax (see batch.h) plus
+//   get;ID
+//   search;account|name|surname|address|pesel;KEY
+//   search;name|surname;PREFIX*|=NAME;OFFSET;LIMIT
+//   complete;name|surname;PREFIX[;LIMIT]
+//   top;COUNT;COLUMN[:asc]
+//   metrics
+// where KEY follows indexSearch (a leading '=' or trailing '*' narrows it).
+// The second form of search pages through a name search in name order
+// and answers "OK <count> <total>", total counting every match. complete
+// answers "OK <count>" and a NAME;ACCOUNTS line for each of the first
+// LIMIT (10 by default) names starting with PREFIX. top lists the COUNT
+// accounts largest in COLUMN (a listing column, see listing.h), or
+// smallest with :asc.
+// Every request is answered by "OK" or "ERR <reason>"; get, search and top
+// answer "OK <count>" followed by that many lines of
+//   ID;ACCOUNT NUMBER;FIRST NAME;LAST NAME;ADDRESS;PESEL;BALANCE;DEBT
+// and metrics answers "OK <count>" followed by that many lines of the
+// Prometheus text format (see metrics.h).
+// A change is answered once it is durable. Requests of one connection are
+// answered in order. SIGINT or SIGTERM stop the server, SIGUSR1 dumps the
+// metrics to metricsPath().
+// argv[1] is the socket path (SOCKET_FILE by default), argv[2] the number
+// of worker threads.
+int runServer(int argc, char *argv[]);
@@ -0,0 +1,1912 @@
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ibanset.h"
+#include "journal.h"
+#include "metrics.h"
+#include "peselmap.h"
+#include "store.h"
+#include "util.h"
+#include "wal.h"
+
+#define INDEX_MIN_CAPACITY 1024
+#define EMPTY_KEY 0
+#define WAL_CHECKPOINT_SIZE (64u << 20)
+#define STORE_MAGIC 0x4B4E4142u
+#define STORE_VERSION 3
+// Account locks; a power of two so the stripe is the top bits of the id hash
+#define STORE_STRIPES 1024
+#define STRIPE_SHIFT 22
+// How long a commit leader lets other busy threads stage their changes into
+// its group before syncing
+#define COMMIT_DELAY_NS 100000
+// Slots the address space reserved for the columns holds at least
+#define STORE_MIN_RESERVE (1u << 24)
+#define SNAPSHOT_MAGIC 0x50414E53u
+#define SNAPSHOT_VERSION 2
+#define FINGERPRINT_SAMPLES 1024
+// Clean records between two dirty ones are written along with them when
+// they take up no more than this, to save a write call
+#define FLUSH_GAP_BYTES 4096
+// Memory the private copies of changed pages may take before a checkpoint
+// writes them back and lets them go, in MiB unless BANK_STORE_BUDGET says
+#define STORE_DEFAULT_BUDGET 32
+
+// Leading block of the data file, the cold records follow it back to back.
+// It is rewritten at the checkpoint after a commit appends, so opening the
+// file and handing out the next id never have to look at the records
+// themselves; the checksum covers the fields before it and catches a torn
+// or foreign header
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t layout;
+    uint32_t slots;
+    uint32_t record_count;
+    uint32_t next_id;
+    uint32_t hot_size;
+    uint32_t checksum;
+    uint8_t reserved[28];
+} StoreHeader_t;
+
+// Older formats, only read to upgrade them. Versions 0 (bare records) and 1
+// (records behind a header) kept whole accounts with amounts in doubles;
+// version 2 split them, but its hot column still held doubles
+typedef struct
+{
+    uint32_t id;
+    IBAN account_number;
+    Fixed_string first_name;
+    Fixed_string last_name;
+    Address address;
+    PESEL pesel_number;
+    double balance;
+    double debt;
+} LegacyAccount_t;
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t reserved;
+    double balance;
+    double debt;
+} LegacyHot_t;
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t slot;
+} IndexEntry_t;
+
+// What opening derives from the records below covered, saved so the next
+// open only has to scan the records appended since: the live bitmap, then
+// the id index of a packed file and the set of account numbers. The count
+// is of the live records below covered
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t layout;
+    uint32_t covered;
+    uint32_t count;
+    uint32_t index_capacity;
+    uint32_t index_used;
+    uint32_t reserved;
+    uint64_t fingerprint;
+} SnapshotHeader_t;
+
+// A staged change that is in the WAL buffer but not yet committed; the
+// before-image lets a failed group commit be rolled back in memory
+typedef struct
+{
+    uint32_t slot;
+    bool created;
+    bool cold_changed;
+    AccountHot_t hot_before;
+    AccountCold_t cold_before;
+} Pending_t;
+
+// The changes one thread staged since its last storeSync, waiting for the
+// group commit that makes them durable. They may span several groups, and
+// durable stays false once any of them failed.
+typedef struct Waiter
+{
+    bool queued;
+    bool done;
+    bool durable;
+    struct Waiter *next;
+} Waiter_t;
+
+typedef struct
+{
+    bool opened;
+    int fd;
+    int hot_fd;
+    StoreLayout_t layout;
+    AccountHot_t *hot;
+    // The image of the data file, header included; cold points past it
+    char *cold_map;
+    AccountCold_t *cold;
+    // Bytes at the start of each column that are mapped from its file; the
+    // rest is anonymous memory, as are the pages changed in memory
+    size_t hot_mapped;
+    size_t cold_mapped;
+    uint64_t *live;
+    // Committed records not written to the files yet, see flushDirty
+    uint64_t *dirty_hot;
+    uint64_t *dirty_cold;
+    uint32_t dirty_first;
+    uint32_t dirty_end;
+    // Pages holding dirty records, against the budget in pages
+    size_t dirty_pages;
+    size_t budget_pages;
+    uint32_t slots;
+    uint32_t capacity;
+    // Slots of the address space reserved for the columns
+    uint32_t reserved;
+    uint32_t count;
+    IndexEntry_t *index;
+    uint32_t index_capacity;
+    uint32_t index_used;
+    uint32_t last_id;
+    bool autocommit;
+    bool write_failed;
+    // Set from a failed checkpoint until one succeeds, to report it once
+    bool checkpoint_failing;
+    Pending_t *pending;
+    uint32_t pending_count;
+    uint32_t pending_capacity;
+    uint32_t committed_slots;
+    uint32_t committed_last_id;
+    bool header_dirty;
+    bool loading;
+    Waiter_t *waiters;
+    bool committing;
+    char snapshot_path[BUFFER];
+    char snapshot_tmp_path[BUFFER + 8];
+    pid_t snapshot_writer;
+    // What the newest snapshot covers, to tell whether it is out of date
+    uint32_t snapshot_covered;
+    uint32_t snapshot_count;
+} Store_t;
+
+static Store_t store = { .fd = -1, .hot_fd = -1 };
+
+// Count the changes to the records in memory. They are never reset, so what
+// was derived from one store is not taken for current after another opens.
+static struct
+{
+    uint64_t hot;
+    uint64_t cold;
+} versions;
+
+// store_lock guards everything in store; it is recursive so the public
+// functions can call each other and a caller can hold it across several.
+// The stripes only order read-modify-write cycles on the same accounts.
+static pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t store_lock;
+static pthread_cond_t store_committed = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t stripes[STORE_STRIPES];
+static _Thread_local Waiter_t thread_waiter;
+
+static uint32_t hashID(uint32_t id)
+{
+    return id * 2654435761u;
+}
+
+// Returns the index bucket holding id, or the empty bucket where it belongs
+static IndexEntry_t *indexProbe(IndexEntry_t *index, uint32_t capacity, uint32_t id)
+{
+    uint32_t mask = capacity - 1;
+    uint32_t pos = hashID(id) & mask;
+    while (index[pos].id != EMPTY_KEY && index[pos].id != id)
+        pos = (pos + 1) & mask;
+    return &index[pos];
+}
+
+static bool indexGrow()
+{
+    uint32_t new_capacity = store.index_capacity ? store.index_capacity * 2 : INDEX_MIN_CAPACITY;
+    IndexEntry_t *new_index = calloc(new_capacity, sizeof(IndexEntry_t));
+    if (new_index == NULL)
+        return false;
+
+    for (uint32_t i = 0; i < store.index_capacity; i++)
+    {
+        if (store.index[i].id != EMPTY_KEY)
+            *indexProbe(new_index, new_capacity, store.index[i].id) = store.index[i];
+    }
+    free(store.index);
+    store.index = new_index;
+    store.index_capacity = new_capacity;
+    return true;
+}
+
+static bool indexReserve()
+{
+    return (store.index_used + 1) * 2 <= store.index_capacity || indexGrow();
+}
+
+static bool indexInsert(uint32_t id, uint32_t slot)
+{
+    if (!indexReserve())
+        return false;
+
+    IndexEntry_t *entry = indexProbe(store.index, store.index_capacity, id);
+    if (entry->id == EMPTY_KEY)
+        store.index_used++;
+    entry->id = id;
+    entry->slot = slot;
+    return true;
+}
+
+static bool isLive(uint32_t slot)
+{
+    return (store.live[slot / 64] >> (slot % 64)) & 1;
+}
+
+static void setLive(uint32_t slot)
+{
+    store.live[slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+static void clearLive(uint32_t slot)
+{
+    store.live[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+}
+
+static size_t hotBytes(uint32_t slots)
+{
+    return (size_t)slots * sizeof(AccountHot_t);
+}
+
+static size_t coldBytes(uint32_t slots)
+{
+    return sizeof(StoreHeader_t) + (size_t)slots * sizeof(AccountCold_t);
+}
+
+static char *reserveSpace(size_t size)
+{
+    void *space = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return space == MAP_FAILED ? NULL : space;
+}
+
+// Snapshot writers are forked and need none of the columns, so they are
+// not inherited and forking copies no page tables for them
+static void keepFromChildren()
+{
+    madvise(store.hot, hotBytes(store.reserved), MADV_DONTFORK);
+    madvise(store.cold_map, coldBytes(store.reserved), MADV_DONTFORK);
+}
+
+static void releaseSpace()
+{
+    if (store.hot != NULL)
+        munmap(store.hot, hotBytes(store.reserved));
+    if (store.cold_map != NULL)
+        munmap(store.cold_map, coldBytes(store.reserved));
+}
+
+// Moves the columns to a larger reservation once they outgrow theirs. The
+// first one at open is twice the store's size, so only a store that more
+// than doubles while open gets here again, and only then are records copied
+static bool moveSpace(uint32_t capacity)
+{
+    uint32_t reserved = capacity < (1u << 30) ? capacity * 2 : 1u << 31;
+    if (reserved < STORE_MIN_RESERVE)
+        reserved = STORE_MIN_RESERVE;
+    char *hot = reserveSpace(hotBytes(reserved)), *cold = reserveSpace(coldBytes(reserved));
+    if (hot == NULL || cold == NULL || mprotect(hot, hotBytes(store.capacity), PROT_READ | PROT_WRITE) != 0 ||
+        mprotect(cold, coldBytes(store.capacity), PROT_READ | PROT_WRITE) != 0)
+    {
+        if (hot != NULL)
+            munmap(hot, hotBytes(reserved));
+        if (cold != NULL)
+            munmap(cold, coldBytes(reserved));
+        return false;
+    }
+    if (store.hot != NULL)
+    {
+        memcpy(hot, store.hot, hotBytes(store.slots));
+        memcpy(cold, store.cold_map, coldBytes(store.slots));
+    }
+    releaseSpace();
+    store.hot = (AccountHot_t *)hot;
+    store.cold_map = cold;
+    store.cold = (AccountCold_t *)(cold + sizeof(StoreHeader_t));
+    store.reserved = reserved;
+    store.hot_mapped = 0;
+    store.cold_mapped = 0;
+    keepFromChildren();
+    return true;
+}
+
+static bool growBitmap(uint64_t **bitmap, uint32_t new_capacity)
+{
+    uint64_t *grown = realloc(*bitmap, (new_capacity / 64) * sizeof(uint64_t));
+    if (grown == NULL)
+        return false;
+    memset(grown + store.capacity / 64, 0, ((new_capacity - store.capacity) / 64) * sizeof(uint64_t));
+    *bitmap = grown;
+    return true;
+}
+
+// The columns live in address space reserved up front, so growing them
+// only makes more of it accessible and they stay where they are
+static bool reserveSlots(uint32_t needed)
+{
+    if (needed <= store.capacity)
+        return true;
+    if (needed > UINT32_MAX / 2)
+        return false;
+    uint32_t new_capacity = store.capacity ? store.capacity : INDEX_MIN_CAPACITY;
+    while (new_capacity < needed)
+        new_capacity *= 2;
+
+    if ((new_capacity > store.reserved && !moveSpace(new_capacity)) ||
+        mprotect(store.hot, hotBytes(new_capacity), PROT_READ | PROT_WRITE) != 0 ||
+        mprotect(store.cold_map, coldBytes(new_capacity), PROT_READ | PROT_WRITE) != 0)
+        return false;
+
+    if (!growBitmap(&store.live, new_capacity) || !growBitmap(&store.dirty_hot, new_capacity) ||
+        !growBitmap(&store.dirty_cold, new_capacity))
+        return false;
+    store.capacity = new_capacity;
+    return true;
+}
+
+static bool readAll(int fd, void *buffer, size_t size, off_t offset, Metric_t metric)
+{
+    if (!readFullyAt(fd, buffer, size, offset))
+        return false;
+    metricRead(metric, size);
+    return true;
+}
+
+static bool readNext(int fd, void *buffer, size_t size)
+{
+    if (!readFully(fd, buffer, size))
+        return false;
+    metricRead(METRIC_STORE_OPEN, size);
+    return true;
+}
+
+static bool writeAllAt(int fd, const void *buffer, size_t size, off_t offset, Metric_t metric)
+{
+    if (!writeFullyAt(fd, buffer, size, offset))
+        return false;
+    metricWritten(metric, size);
+    return true;
+}
+
+static uint32_t headerChecksum(const StoreHeader_t *header, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)header;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static StoreHeader_t makeHeader(StoreLayout_t layout, uint32_t slots, uint32_t count, uint32_t last_id)
+{
+    StoreHeader_t header = {
+        STORE_MAGIC, STORE_VERSION, sizeof(AccountCold_t), layout, slots, count, last_id + 1, sizeof(AccountHot_t)
+    };
+    header.checksum = headerChecksum(&header, offsetof(StoreHeader_t, checksum));
+    return header;
+}
+
+static void splitAccount(const Account_t *account, AccountHot_t *hot, AccountCold_t *cold)
+{
+    memset(hot, 0, sizeof(*hot));
+    hot->id = account->id;
+    hot->instalments_paid = account->instalments_paid;
+    hot->charged_month = account->charged_month;
+    hot->balance = account->balance;
+    hot->debt = account->debt;
+    memcpy(cold->account_number, account->account_number, sizeof(IBAN));
+    memcpy(cold->first_name, account->first_name, sizeof(Fixed_string));
+    memcpy(cold->last_name, account->last_name, sizeof(Fixed_string));
+    memcpy(cold->address, account->address, sizeof(Address));
+    memcpy(cold->pesel_number, account->pesel_number, sizeof(PESEL));
+}
+
+static void joinAccount(const AccountHot_t *hot, const AccountCold_t *cold, Account_t *account)
+{
+    account->id = hot->id;
+    account->instalments_paid = hot->instalments_paid;
+    account->charged_month = hot->charged_month;
+    account->balance = hot->balance;
+    account->debt = hot->debt;
+    memcpy(account->account_number, cold->account_number, sizeof(IBAN));
+    memcpy(account->first_name, cold->first_name, sizeof(Fixed_string));
+    memcpy(account->last_name, cold->last_name, sizeof(Fixed_string));
+    memcpy(account->address, cold->address, sizeof(Address));
+    memcpy(account->pesel_number, cold->pesel_number, sizeof(PESEL));
+}
+
+static bool writeHeader()
+{
+    StoreHeader_t header = makeHeader(store.layout, store.slots, store.count, store.last_id);
+    if (pwrite(store.fd, &header, sizeof(header), 0) != sizeof(header))
+        return false;
+    metricWritten(METRIC_STORE_CHECKPOINT, sizeof(header));
+    store.header_dirty = false;
+    return true;
+}
+
+// A file is direct-addressed when every record sits at offset (id - 1) or is
+// a zeroed gap; anything else (hand-edited or reordered files) keeps the
+// packed layout and goes through the id hash index
+static StoreLayout_t detectLayout(const AccountHot_t *hot, uint32_t slots)
+{
+    for (uint32_t slot = 0; slot < slots; slot++)
+    {
+        uint32_t id = hot[slot].id;
+        if (id != EMPTY_KEY && id != slot + 1)
+            return STORE_PACKED;
+    }
+    return STORE_DIRECT;
+}
+
+static int64_t slotOf(uint32_t id)
+{
+    if (id == EMPTY_KEY)
+        return -1;
+    if (store.layout == STORE_DIRECT)
+        return id <= store.slots && isLive(id - 1) ? (int64_t)id - 1 : -1;
+    if (store.index_capacity == 0)
+        return -1;
+    // Entries of rolled back creates stay behind, and their slot may have
+    // been taken by another account since
+    IndexEntry_t *entry = indexProbe(store.index, store.index_capacity, id);
+    if (entry->id == EMPTY_KEY || entry->slot >= store.slots || !isLive(entry->slot) ||
+        store.hot[entry->slot].id != id)
+        return -1;
+    return entry->slot;
+}
+
+// The map's candidates may be left from a rolled back create or a changed
+// PESEL, or merely share the hash
+static int64_t nextPESELSlot(const char *pesel, PeselCursor_t *cursor)
+{
+    for (uint32_t id = peselMapNext(cursor); id != EMPTY_KEY; id = peselMapNext(cursor))
+    {
+        int64_t slot = slotOf(id);
+        if (slot >= 0 && strncmp(store.cold[slot].pesel_number, pesel, sizeof(PESEL)) == 0)
+            return slot;
+    }
+    return -1;
+}
+
+static int64_t peselSlot(const char *pesel)
+{
+    PeselCursor_t cursor;
+    peselMapFind(pesel, &cursor);
+    return nextPESELSlot(pesel, &cursor);
+}
+
+// Scans the records from slot first on
+static bool buildIndex(uint32_t first)
+{
+    if (store.layout == STORE_PACKED && store.index_capacity == 0 && !indexGrow())
+        return false;
+    for (uint32_t slot = first; slot < store.slots; slot++)
+    {
+        uint32_t id = store.hot[slot].id;
+        if (id == EMPTY_KEY)
+            continue;
+        // Keeps the first record for a duplicated id, like the old sequential scan did
+        if (store.layout == STORE_PACKED && slotOf(id) < 0 && !indexInsert(id, slot))
+            return false;
+        if (!ibanSetAdd(store.cold[slot].account_number))
+            return false;
+        if (!peselMapPut(store.cold[slot].pesel_number, id))
+            return false;
+        setLive(slot);
+        store.count++;
+    }
+    return true;
+}
+
+static size_t pageSize()
+{
+    static size_t size;
+    if (size == 0)
+        size = (size_t)sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+// One column as it is laid out in memory and in its file: the records
+// start header bytes into both
+typedef struct
+{
+    int fd;
+    char *base;
+    size_t header;
+    size_t record;
+    uint64_t *dirty;
+    size_t *mapped;
+} Column_t;
+
+static Column_t hotColumn()
+{
+    Column_t column = { store.hot_fd, (char *)store.hot, 0, sizeof(AccountHot_t), store.dirty_hot, &store.hot_mapped };
+    return column;
+}
+
+static Column_t coldColumn()
+{
+    Column_t column = { store.fd, store.cold_map, sizeof(StoreHeader_t), sizeof(AccountCold_t), store.dirty_cold,
+                        &store.cold_mapped };
+    return column;
+}
+
+// Whether a record other than slot on the page starting at offset is dirty
+static bool pageDirty(const Column_t *column, size_t offset, uint32_t slot)
+{
+    size_t first = offset > column->header ? (offset - column->header) / column->record : 0;
+    size_t end = (offset + pageSize() - column->header + column->record - 1) / column->record;
+    if (end > store.capacity)
+        end = store.capacity;
+    for (size_t other = first; other < end; other++)
+    {
+        if (other != slot && (column->dirty[other / 64] >> (other % 64) & 1))
+            return true;
+    }
+    return false;
+}
+
+// Counts the pages the record is the first dirty one on
+static void markColumn(const Column_t *column, uint32_t slot)
+{
+    uint64_t bit = (uint64_t)1 << (slot % 64);
+    if (column->dirty[slot / 64] & bit)
+        return;
+    size_t page = pageSize();
+    size_t end = column->header + (size_t)(slot + 1) * column->record;
+    for (size_t offset = (column->header + (size_t)slot * column->record) & ~(page - 1); offset < end; offset += page)
+        store.dirty_pages += !pageDirty(column, offset, slot);
+    column->dirty[slot / 64] |= bit;
+}
+
+static void markDirty(uint32_t slot, bool cold)
+{
+    Column_t hot = hotColumn();
+    markColumn(&hot, slot);
+    if (cold)
+    {
+        Column_t cold_column = coldColumn();
+        markColumn(&cold_column, slot);
+    }
+    if (store.dirty_first >= store.dirty_end)
+        store.dirty_first = slot;
+    else if (slot < store.dirty_first)
+        store.dirty_first = slot;
+    if (slot >= store.dirty_end)
+        store.dirty_end = slot + 1;
+}
+
+static bool writeRun(const Column_t *column, uint32_t first, uint32_t end)
+{
+    size_t offset = column->header + (size_t)first * column->record;
+    return writeAllAt(column->fd, column->base + offset, (size_t)(end - first) * column->record, (off_t)offset,
+                      METRIC_STORE_CHECKPOINT);
+}
+
+// A run that could not be written stays dirty for the next checkpoint
+static bool flushRun(const Column_t *column, uint32_t first, uint32_t end)
+{
+    if (writeRun(column, first, end))
+        return true;
+    for (uint32_t slot = first; slot < end; slot++)
+        column->dirty[slot / 64] |= (uint64_t)1 << (slot % 64);
+    return false;
+}
+
+// Writes the dirty records of a column in slot order and clears their
+// bits. Each run goes out in one write, clean records in short gaps
+// included: nothing is staged while this runs, so they hold what the file
+// does. Scattered changes so reach the file in a few sequential writes.
+static bool flushColumn(const Column_t *column, uint32_t first, uint32_t end)
+{
+    uint32_t gap = FLUSH_GAP_BYTES / column->record;
+    uint32_t run_first = 0, run_end = 0;
+    bool written = true;
+    for (uint32_t word = first / 64; word < (end + 63) / 64; word++)
+    {
+        uint64_t bits = column->dirty[word];
+        column->dirty[word] = 0;
+        for (; bits != 0; bits &= bits - 1)
+        {
+            uint32_t slot = word * 64 + __builtin_ctzll(bits);
+            if (run_end > run_first && slot - run_end > gap)
+            {
+                written = flushRun(column, run_first, run_end) && written;
+                run_end = run_first;
+            }
+            if (run_end == run_first)
+                run_first = slot;
+            run_end = slot + 1;
+        }
+    }
+    return (run_end == run_first || flushRun(column, run_first, run_end)) && written;
+}
+
+// Committed changes reach the files here rather than one pwrite each as
+// they commit; the log holds them until then. Sets first and end to the
+// slots written. What fails to be written stays dirty.
+static bool flushDirty(uint32_t *first, uint32_t *end)
+{
+    bool written = true;
+    *first = store.dirty_first;
+    *end = store.dirty_end;
+    store.dirty_first = store.dirty_end = 0;
+    if (*first < *end)
+    {
+        Column_t hot = hotColumn(), cold = coldColumn();
+        written = flushColumn(&hot, *first, *end);
+        written = flushColumn(&cold, *first, *end) && written;
+        if (!written)
+        {
+            store.dirty_first = *first;
+            store.dirty_end = *end;
+        }
+    }
+    // A header written mid-load would count records not in the files yet
+    if (store.header_dirty && !store.loading && !writeHeader())
+        written = false;
+    if (!written)
+        store.write_failed = true;
+    return written;
+}
+
+// Drops the private copies of the pages holding slots first to end where
+// the column is mapped, so they are read from the page cache again
+static void dropCopies(const Column_t *column, uint32_t first, uint32_t end)
+{
+    size_t page = pageSize();
+    size_t from = (column->header + (size_t)first * column->record) & ~(page - 1);
+    size_t to = (column->header + (size_t)end * column->record + page - 1) & ~(page - 1);
+    if (to > *column->mapped)
+        to = *column->mapped;
+    if (from < to)
+        madvise(column->base + from, to - from, MADV_DONTNEED);
+}
+
+// Maps the whole pages of committed records past the mapped part from the
+// file, over the anonymous memory holding the same bytes. Should the
+// mapping fail, the range is read back into anonymous memory, as a failed
+// fixed mapping may already have removed what was there.
+static void mapCommitted(const Column_t *column)
+{
+    size_t to = (column->header + (size_t)store.committed_slots * column->record) & ~(pageSize() - 1);
+    size_t from = *column->mapped;
+    if (to <= from)
+        return;
+    char *start = column->base + from;
+    if (mmap(start, to - from, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, column->fd, (off_t)from) ==
+        MAP_FAILED)
+    {
+        if (mmap(start, to - from, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) ==
+                MAP_FAILED ||
+            !readAll(column->fd, start, to - from, (off_t)from, METRIC_STORE_CHECKPOINT))
+        {
+            fprintf(stderr, "Lost the mapping of the store, its files hold every committed change\n");
+            abort();
+        }
+    }
+    else
+    {
+        *column->mapped = to;
+    }
+    madvise(start, to - from, MADV_DONTFORK);
+}
+
+// Once records are written back, their pages can be the file's again: the
+// anonymous memory the store holds is then only what changed since the
+// last write-back, and the kernel evicts the rest like any cached file.
+// Nothing may be staged or loaded, and nothing dirty, when this runs.
+static void releaseWritten(uint32_t first, uint32_t end)
+{
+    if (store.write_failed)
+        return;
+    store.dirty_pages = 0;
+    Column_t hot = hotColumn(), cold = coldColumn();
+    if (first < end)
+    {
+        dropCopies(&hot, first, end);
+        dropCopies(&cold, first, end);
+    }
+    mapCommitted(&hot);
+    mapCommitted(&cold);
+}
+
+static uint32_t slotForNew(uint32_t id)
+{
+    return store.layout == STORE_DIRECT ? id - 1 : store.slots;
+}
+
+static bool reserveNew(uint32_t id)
+{
+    if (!reserveSlots(slotForNew(id) + 1) || !ibanSetReserve() || !peselMapReserve(1))
+        return false;
+    return store.layout == STORE_DIRECT || indexReserve();
+}
+
+static void changed(bool cold)
+{
+    versions.hot++;
+    versions.cold += cold;
+}
+
+// Memory must already be reserved with reserveNew, so this cannot fail
+static uint32_t placeNew(const Account_t *new)
+{
+    uint32_t slot = slotForNew(new->id);
+    changed(true);
+    if (store.layout == STORE_PACKED)
+        indexInsert(new->id, slot);
+    ibanSetAdd(new->account_number);
+
+    // Skipped ids stay zeroed on disk, the same tombstones the loader expects
+    if (slot > store.slots)
+    {
+        memset(&store.hot[store.slots], 0, (size_t)(slot - store.slots) * sizeof(AccountHot_t));
+        memset(&store.cold[store.slots], 0, (size_t)(slot - store.slots) * sizeof(AccountCold_t));
+    }
+    splitAccount(new, &store.hot[slot], &store.cold[slot]);
+    if (slot >= store.slots)
+        store.slots = slot + 1;
+    setLive(slot);
+    store.count++;
+    if (new->id > store.last_id)
+        store.last_id = new->id;
+    store.header_dirty = true;
+    return slot;
+}
+
+// The state before a replayed change: the account's last journal entry if
+// it has one, as the data files may already hold the change, or else the
+// files' state. A transfer side without entries mirrors the other side.
+static void replayedBefore(WalType_t type, const Account_t *images, uint32_t count, AccountHot_t *before,
+                           bool *known)
+{
+    bool journaled[WAL_MAX_IMAGES] = { false };
+    for (uint32_t i = 0; i < count; i++)
+    {
+        int64_t slot = slotOf(images[i].id);
+        journaled[i] = journalLastState(images[i].id, &before[i]);
+        known[i] = journaled[i] || slot >= 0;
+        if (!journaled[i] && slot >= 0)
+            before[i] = store.hot[slot];
+    }
+    if (type == WAL_TRANSFER && journaled[0] != journaled[1])
+    {
+        int from = journaled[0] ? 0 : 1, to = 1 - from;
+        before[to].balance = images[to].balance + (images[from].balance - before[from].balance);
+    }
+}
+
+// Records newer than the journal get their entries again
+static bool applyReplayed(uint64_t lsn, int64_t made, WalType_t type, const Account_t *images, uint32_t count)
+{
+    AccountHot_t before[WAL_MAX_IMAGES];
+    bool known[WAL_MAX_IMAGES];
+    uint64_t journaled = journalLastLSN();
+    bool missing = journalIsOpen() && (journaled == JOURNAL_NO_LSN || lsn > journaled);
+    if (missing)
+        replayedBefore(type, images, count, before, known);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        int64_t slot = slotOf(images[i].id);
+        bool mapped = slot >= 0 && strncmp(store.cold[slot].pesel_number, images[i].pesel_number, sizeof(PESEL)) == 0;
+        if (slot < 0)
+        {
+            if (images[i].id == EMPTY_KEY || !reserveNew(images[i].id))
+                return false;
+            slot = placeNew(&images[i]);
+        }
+        splitAccount(&images[i], &store.hot[slot], &store.cold[slot]);
+        if (!mapped && !peselMapPut(images[i].pesel_number, images[i].id))
+            return false;
+        markDirty((uint32_t)slot, true);
+
+        if (missing)
+            journalRecord(lsn, made ? made : (int64_t)time(NULL), known[i] ? &before[i] : NULL, &store.hot[slot],
+                          type == WAL_TRANSFER ? images[1 - i].id : 0);
+    }
+    return !missing || journalWrite();
+}
+
+static bool recover(const char *wal_path)
+{
+    if (!walOpen(wal_path))
+        return false;
+    long replayed = walReplay(applyReplayed);
+    if (replayed < 0)
+    {
+        fprintf(stderr, "Failed to replay %s\n", wal_path);
+        return false;
+    }
+    uint32_t first, end;
+    if (replayed == 0)
+        return true;
+    if (!flushDirty(&first, &end) || fdatasync(store.hot_fd) != 0 || fdatasync(store.fd) != 0 || !journalSync() ||
+        !walTruncate())
+        return false;
+    store.committed_slots = store.slots;
+    releaseWritten(first, end);
+    return true;
+}
+
+static int openLocked(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return -1;
+
+    // The file is cached in memory from now on, a second writer would corrupt it
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        fprintf(stderr, "%s is in use by another process\n", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool validHeader(const StoreHeader_t *header, off_t file_size)
+{
+    return header->magic == STORE_MAGIC &&
+           header->checksum == headerChecksum(header, offsetof(StoreHeader_t, checksum)) &&
+           header->version == STORE_VERSION && header->record_size == sizeof(AccountCold_t) &&
+           header->hot_size == sizeof(AccountHot_t) && header->layout <= STORE_PACKED &&
+           file_size >= (off_t)sizeof(*header) + (off_t)header->slots * (off_t)sizeof(AccountCold_t);
+}
+
+static void upgradePaths(const char *path, const char *hot_path, char *temp_path, char *temp_hot_path)
+{
+    snprintf(temp_path, BUFFER, "%s.upgrade", path);
+    snprintf(temp_hot_path, BUFFER, "%s.upgrade", hot_path);
+}
+
+// An upgrade writes the new hot column and then the new data file next to
+// the originals before renaming them over, so a complete new data file
+// means both are ready and only the renames may be missing. The lock moves
+// over to the new data file before the old one is let go
+static bool finishUpgrade(const char *path, const char *hot_path)
+{
+    char temp_path[BUFFER], temp_hot_path[BUFFER];
+    upgradePaths(path, hot_path, temp_path, temp_hot_path);
+    int fd = open(temp_path, O_RDONLY);
+    if (fd < 0)
+        return true;
+
+    StoreHeader_t header;
+    struct stat st;
+    bool complete = pread(fd, &header, sizeof(header), 0) == sizeof(header) && fstat(fd, &st) == 0 &&
+                    validHeader(&header, st.st_size);
+    close(fd);
+    if (!complete)
+    {
+        unlink(temp_hot_path);
+        unlink(temp_path);
+        return true;
+    }
+    if ((rename(temp_hot_path, hot_path) != 0 && access(temp_hot_path, F_OK) == 0) ||
+        rename(temp_path, path) != 0)
+        return false;
+
+    int upgraded = openLocked(path);
+    if (upgraded < 0)
+        return false;
+    close(store.fd);
+    store.fd = upgraded;
+    fprintf(stderr, "Upgraded %s to format version %d\n", path, STORE_VERSION);
+    return true;
+}
+
+static bool writeUpgrade(const char *path, const char *hot_path, uint32_t slots,
+                         const AccountHot_t *hot, const AccountCold_t *cold, StoreLayout_t layout)
+{
+    uint32_t count = 0, last_id = 0;
+    for (uint32_t slot = 0; slot < slots; slot++)
+    {
+        if (hot[slot].id == EMPTY_KEY)
+            continue;
+        count++;
+        if (hot[slot].id > last_id)
+            last_id = hot[slot].id;
+    }
+    StoreHeader_t header = makeHeader(layout, slots, count, last_id);
+
+    char temp_path[BUFFER], temp_hot_path[BUFFER];
+    upgradePaths(path, hot_path, temp_path, temp_hot_path);
+    int fd = open(temp_hot_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && writeFully(fd, hot, (size_t)slots * sizeof(AccountHot_t)) && fsync(fd) == 0;
+    if (fd >= 0)
+        close(fd);
+    fd = ok ? open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    ok = fd >= 0 && writeFully(fd, &header, sizeof(header)) &&
+         writeFully(fd, cold, (size_t)slots * sizeof(AccountCold_t)) && fsync(fd) == 0;
+    if (fd >= 0)
+        close(fd);
+    return ok && finishUpgrade(path, hot_path);
+}
+
+static Money_t fromLegacy(double amount)
+{
+    return llround(amount * 100);
+}
+
+static bool readLegacyAccounts(uint32_t slots, off_t offset, AccountHot_t *hot, AccountCold_t *cold)
+{
+    LegacyAccount_t *records = malloc(slots ? (size_t)slots * sizeof(LegacyAccount_t) : 1);
+    if (records == NULL || !readAll(store.fd, records, (size_t)slots * sizeof(LegacyAccount_t), offset, METRIC_STORE_OPEN))
+    {
+        free(records);
+        return false;
+    }
+    for (uint32_t slot = 0; slot < slots; slot++)
+    {
+        const LegacyAccount_t *record = &records[slot];
+        if (record->id == EMPTY_KEY)
+            continue;
+        hot[slot].id = record->id;
+        hot[slot].balance = fromLegacy(record->balance);
+        hot[slot].debt = fromLegacy(record->debt);
+        memcpy(cold[slot].account_number, record->account_number, sizeof(IBAN));
+        memcpy(cold[slot].first_name, record->first_name, sizeof(Fixed_string));
+        memcpy(cold[slot].last_name, record->last_name, sizeof(Fixed_string));
+        memcpy(cold[slot].address, record->address, sizeof(Address));
+        memcpy(cold[slot].pesel_number, record->pesel_number, sizeof(PESEL));
+    }
+    free(records);
+    return true;
+}
+
+static bool readLegacyHot(const char *hot_path, uint32_t slots, AccountHot_t *hot, AccountCold_t *cold)
+{
+    LegacyHot_t *records = malloc(slots ? (size_t)slots * sizeof(LegacyHot_t) : 1);
+    int fd = open(hot_path, O_RDONLY);
+    bool ok = records != NULL && fd >= 0 &&
+              readAll(fd, records, (size_t)slots * sizeof(LegacyHot_t), 0, METRIC_STORE_OPEN) &&
+              readAll(store.fd, cold, (size_t)slots * sizeof(AccountCold_t), sizeof(StoreHeader_t),
+                      METRIC_STORE_OPEN);
+    if (fd >= 0)
+        close(fd);
+    for (uint32_t slot = 0; ok && slot < slots; slot++)
+    {
+        hot[slot].id = records[slot].id;
+        hot[slot].balance = fromLegacy(records[slot].balance);
+        hot[slot].debt = fromLegacy(records[slot].debt);
+    }
+    free(records);
+    return ok;
+}
+
+// Brings a file of an older version to the current one. Version 1 headers
+// had their checksum where hot_size is now
+static bool upgradeIfLegacy(const char *path, const char *hot_path, const char *wal_path,
+                            StoreHeader_t *header, ssize_t got)
+{
+    struct stat st;
+    if (fstat(store.fd, &st) != 0)
+        return false;
+
+    uint32_t version, slots = header->slots;
+    if (got < (ssize_t)sizeof(*header) || header->magic != STORE_MAGIC)
+    {
+        // Only bare records fill a whole number of them; anything else is
+        // a torn or foreign header, left for the caller to reject
+        if (header->magic == STORE_MAGIC || st.st_size % sizeof(LegacyAccount_t) != 0)
+            return true;
+        version = 0;
+        slots = (uint32_t)(st.st_size / sizeof(LegacyAccount_t));
+    }
+    else if (header->version == 1 && header->hot_size == headerChecksum(header, offsetof(StoreHeader_t, hot_size)) &&
+             st.st_size >= (off_t)sizeof(*header) + (off_t)slots * (off_t)sizeof(LegacyAccount_t))
+        version = 1;
+    else if (header->version == 2 && header->checksum == headerChecksum(header, offsetof(StoreHeader_t, checksum)))
+        version = 2;
+    else
+        return true;
+
+    if (walHoldsOlderRecords(wal_path))
+    {
+        fprintf(stderr, "%s holds changes of the previous version, run it once to apply them before upgrading\n",
+                wal_path);
+        return false;
+    }
+
+    AccountHot_t *hot = calloc(slots ? slots : 1, sizeof(AccountHot_t));
+    AccountCold_t *cold = calloc(slots ? slots : 1, sizeof(AccountCold_t));
+    bool ok = hot != NULL && cold != NULL;
+    if (ok && version < 2)
+        ok = readLegacyAccounts(slots, version == 0 ? 0 : sizeof(*header), hot, cold);
+    else if (ok)
+        ok = readLegacyHot(hot_path, slots, hot, cold);
+    StoreLayout_t layout = version == 2 ? (StoreLayout_t)header->layout : detectLayout(hot, slots);
+    ok = ok && writeUpgrade(path, hot_path, slots, hot, cold, layout);
+    free(hot);
+    free(cold);
+
+    if (!ok || pread(store.fd, header, sizeof(*header), 0) != sizeof(*header))
+    {
+        fprintf(stderr, "Failed to upgrade %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+static bool readHeader(const char *path, const char *hot_path, const char *wal_path, StoreHeader_t *header)
+{
+    if (!finishUpgrade(path, hot_path))
+        return false;
+    memset(header, 0, sizeof(*header));
+    ssize_t got = pread(store.fd, header, sizeof(*header), 0);
+    if (got == 0)
+    {
+        *header = makeHeader(STORE_DIRECT, 0, 0, 0);
+        return pwrite(store.fd, header, sizeof(*header), 0) == sizeof(*header);
+    }
+    if (got < 0 || !upgradeIfLegacy(path, hot_path, wal_path, header, got))
+        return false;
+
+    struct stat st;
+    if (fstat(store.fd, &st) != 0 || !validHeader(header, st.st_size))
+    {
+        fprintf(stderr, "%s has a damaged or incompatible header\n", path);
+        return false;
+    }
+    return true;
+}
+
+static bool openHot(const char *hot_path, uint32_t slots)
+{
+    struct stat st;
+    store.hot_fd = open(hot_path, O_RDWR | O_CREAT, 0644);
+    if (store.hot_fd < 0 || fstat(store.hot_fd, &st) != 0)
+        return false;
+    if (st.st_size < (off_t)slots * (off_t)sizeof(AccountHot_t))
+    {
+        fprintf(stderr, "%s is shorter than its data file\n", hot_path);
+        return false;
+    }
+    return true;
+}
+
+static void initLocks()
+{
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&store_lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+    for (uint32_t i = 0; i < STORE_STRIPES; i++)
+        pthread_mutex_init(&stripes[i], NULL);
+}
+
+// Maps the records of both files over the start of the reserved space, so
+// opening reads none of them and pages come in as they are first touched.
+// The mappings are private: changes stay out of the files until they are
+// written back, and the pages they touch become anonymous memory until
+// releaseWritten hands them back to the page cache
+static bool mapFiles()
+{
+    if (!reserveSlots(store.slots))
+        return false;
+    if (store.slots == 0)
+        return true;
+    if (mmap(store.hot, hotBytes(store.slots), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, store.hot_fd,
+             0) == MAP_FAILED ||
+        mmap(store.cold_map, coldBytes(store.slots), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, store.fd,
+             0) == MAP_FAILED)
+        return false;
+    store.hot_mapped = (hotBytes(store.slots) + pageSize() - 1) & ~(pageSize() - 1);
+    store.cold_mapped = (coldBytes(store.slots) + pageSize() - 1) & ~(pageSize() - 1);
+    keepFromChildren();
+    return true;
+}
+
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Records never move, so a sample of their ids and account numbers tells
+// which data file saved structures were derived from
+uint64_t storeFingerprint(uint32_t covered)
+{
+    uint64_t hash = hashBytes(14695981039346656037ull, &covered, sizeof(covered));
+    uint32_t step = covered / FINGERPRINT_SAMPLES + 1;
+    for (uint32_t slot = 0; slot < covered; slot += step)
+    {
+        hash = hashBytes(hash, &store.hot[slot].id, sizeof(store.hot[slot].id));
+        hash = hashBytes(hash, store.cold[slot].account_number, sizeof(IBAN));
+    }
+    if (covered > 0)
+        hash = hashBytes(hash, store.cold[covered - 1].account_number, sizeof(IBAN));
+    return hash;
+}
+
+static uint32_t countLive(uint32_t covered)
+{
+    uint32_t count = 0;
+    for (uint32_t word = 0; word < covered / 64; word++)
+        count += __builtin_popcountll(store.live[word]);
+    if (covered % 64)
+        count += __builtin_popcountll(store.live[covered / 64] & (((uint64_t)1 << (covered % 64)) - 1));
+    return count;
+}
+
+static void resetDerived()
+{
+    if (store.live != NULL)
+        memset(store.live, 0, (store.capacity / 64) * sizeof(uint64_t));
+    free(store.index);
+    store.index = NULL;
+    store.index_capacity = 0;
+    store.index_used = 0;
+    ibanSetFree();
+    peselMapFree();
+    store.count = 0;
+}
+
+static bool loadIndex(int fd, const SnapshotHeader_t *header)
+{
+    uint32_t capacity = header->index_capacity;
+    if (capacity < INDEX_MIN_CAPACITY || (capacity & (capacity - 1)) != 0 || header->index_used * 2 > capacity)
+        return false;
+    IndexEntry_t *index = malloc((size_t)capacity * sizeof(IndexEntry_t));
+    if (index == NULL || !readNext(fd, index, (size_t)capacity * sizeof(IndexEntry_t)))
+    {
+        free(index);
+        return false;
+    }
+    free(store.index);
+    store.index = index;
+    store.index_capacity = capacity;
+    store.index_used = header->index_used;
+    return true;
+}
+
+// Takes what the snapshot holds if it was made from these files, and
+// returns the slots it covers; the rest have to be scanned
+static uint32_t loadSnapshot()
+{
+    int fd = open(store.snapshot_path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    SnapshotHeader_t header;
+    bool ok = readNext(fd, &header, sizeof(header)) && header.magic == SNAPSHOT_MAGIC &&
+              header.version == SNAPSHOT_VERSION && header.layout == store.layout && header.covered <= store.slots &&
+              header.count <= header.covered && header.fingerprint == storeFingerprint(header.covered) &&
+              readNext(fd, store.live, (((size_t)header.covered + 63) / 64) * sizeof(uint64_t)) &&
+              (store.layout == STORE_DIRECT || loadIndex(fd, &header)) && ibanSetLoad(fd) && peselMapLoad(fd);
+    close(fd);
+    if (!ok)
+    {
+        resetDerived();
+        return 0;
+    }
+    store.count = header.count;
+    store.snapshot_covered = header.covered;
+    store.snapshot_count = header.count;
+    return header.covered;
+}
+
+// Covers the committed slots only; records loaded past them are left out
+// of the live bits, and their index entries fail slotOf's checks
+static SnapshotHeader_t snapshotHeader()
+{
+    uint32_t covered = store.committed_slots;
+    SnapshotHeader_t header = {
+        SNAPSHOT_MAGIC, SNAPSHOT_VERSION, store.layout, covered, countLive(covered),
+        store.layout == STORE_PACKED ? store.index_capacity : 0, store.layout == STORE_PACKED ? store.index_used : 0,
+        0, storeFingerprint(covered)
+    };
+    return header;
+}
+
+// Makes nothing but system calls, as it also runs in a child forked from a
+// threaded process
+static bool writeSnapshot(const SnapshotHeader_t *header)
+{
+    int fd = open(store.snapshot_tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    uint64_t last = 0;
+    if (header->covered % 64)
+        last = store.live[header->covered / 64] & (((uint64_t)1 << (header->covered % 64)) - 1);
+    bool ok = writeFully(fd, header, sizeof(*header)) &&
+              writeFully(fd, store.live, (header->covered / 64) * sizeof(uint64_t)) &&
+              (header->covered % 64 == 0 || writeFully(fd, &last, sizeof(last))) &&
+              writeFully(fd, store.index, (size_t)header->index_capacity * sizeof(IndexEntry_t)) &&
+              ibanSetSave(fd) && peselMapSave(fd) && fdatasync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(store.snapshot_tmp_path, store.snapshot_path) != 0)
+    {
+        unlink(store.snapshot_tmp_path);
+        return false;
+    }
+    return true;
+}
+
+static bool snapshotStale(const SnapshotHeader_t *header)
+{
+    return header->covered != store.snapshot_covered || header->count != store.snapshot_count;
+}
+
+// A writer that failed leaves the snapshot to be written again
+static void reapSnapshot(bool wait)
+{
+    int status = -1;
+    if (store.snapshot_writer <= 0 || waitpid(store.snapshot_writer, &status, wait ? 0 : WNOHANG) == 0)
+        return;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        store.snapshot_count = UINT32_MAX;
+    store.snapshot_writer = 0;
+}
+
+// A forked child writes the snapshot from its copy-on-write image while the
+// store carries on; one that is still busy makes this checkpoint skip it
+static void startSnapshot()
+{
+    reapSnapshot(false);
+    if (store.snapshot_writer > 0)
+        return;
+    SnapshotHeader_t header = snapshotHeader();
+    if (!snapshotStale(&header))
+        return;
+    pid_t writer = fork();
+    if (writer == 0)
+        _exit(writeSnapshot(&header) ? 0 : 1);
+    if (writer < 0)
+        return;
+    store.snapshot_writer = writer;
+    store.snapshot_covered = header.covered;
+    store.snapshot_count = header.count;
+}
+
+static void saveSnapshot()
+{
+    reapSnapshot(true);
+    SnapshotHeader_t header = snapshotHeader();
+    if (snapshotStale(&header) && !writeSnapshot(&header))
+        fprintf(stderr, "Could not save %s, the next start scans the whole store\n", store.snapshot_path);
+}
+
+static bool openStore(const char *path, const char *hot_path, const char *wal_path, const char *snapshot_path)
+{
+    StoreHeader_t header;
+    const char *budget = getenv("BANK_STORE_BUDGET");
+    size_t megabytes = budget != NULL && atol(budget) > 0 ? (size_t)atol(budget) : STORE_DEFAULT_BUDGET;
+    store.budget_pages = (megabytes << 20) / pageSize();
+    store.fd = openLocked(path);
+    if (store.fd < 0 || !readHeader(path, hot_path, wal_path, &header) || !openHot(hot_path, header.slots))
+    {
+        storeClose();
+        return false;
+    }
+
+    // Bytes past the header's slot count belong to an append whose commit
+    // did not finish; the log still holds it and replay writes it again
+    store.slots = header.slots;
+    store.layout = (StoreLayout_t)header.layout;
+    store.last_id = header.next_id - 1;
+    snprintf(store.snapshot_path, sizeof(store.snapshot_path), "%s", snapshot_path);
+    snprintf(store.snapshot_tmp_path, sizeof(store.snapshot_tmp_path), "%s.tmp", snapshot_path);
+    if (!mapFiles())
+    {
+        storeClose();
+        return false;
+    }
+    uint32_t covered = loadSnapshot();
+    bool built = buildIndex(covered);
+    // Records are never removed, so a count short of the header's means
+    // some were placed in gaps below the snapshot's end after it was made
+    if (built && covered > 0 && store.count != header.record_count)
+    {
+        resetDerived();
+        built = buildIndex(0);
+    }
+    if (!built)
+    {
+        storeClose();
+        return false;
+    }
+    if (store.count != header.record_count)
+    {
+        fprintf(stderr, "%s holds %u records, its header says %u\n", path, store.count, header.record_count);
+        storeClose();
+        return false;
+    }
+    if (!recover(wal_path))
+    {
+        storeClose();
+        return false;
+    }
+
+    store.autocommit = true;
+    store.committed_slots = store.slots;
+    store.committed_last_id = store.last_id;
+    store.opened = true;
+    return true;
+}
+
+bool storeOpen(const char *path, const char *hot_path, const char *wal_path, const char *snapshot_path)
+{
+    pthread_once(&locks_once, initLocks);
+    uint64_t start = metricStart();
+    bool opened = openStore(path, hot_path, wal_path, snapshot_path);
+    metricEnd(METRIC_STORE_OPEN, start, opened);
+    return opened;
+}
+
+static bool checkpoint();
+
+void storeClose()
+{
+    if (store.opened && !checkpoint())
+        fprintf(stderr, "Checkpoint failed, changes will be replayed from the log on next start\n");
+    else if (store.opened)
+        saveSnapshot();
+    reapSnapshot(true);
+    walClose();
+    if (store.fd >= 0)
+        close(store.fd);
+    if (store.hot_fd >= 0)
+        close(store.hot_fd);
+    releaseSpace();
+    free(store.live);
+    free(store.dirty_hot);
+    free(store.dirty_cold);
+    free(store.index);
+    free(store.pending);
+    ibanSetFree();
+    peselMapFree();
+    memset(&store, 0, sizeof(store));
+    changed(true);
+    store.fd = -1;
+    store.hot_fd = -1;
+}
+
+StoreLayout_t storeLayout()
+{
+    return store.layout;
+}
+
+uint32_t storeSlots()
+{
+    return store.slots;
+}
+
+// Slots below this hold only records whose log group is durable
+uint32_t storeCommittedSlots()
+{
+    return store.committed_slots;
+}
+
+uint32_t storeCount()
+{
+    return store.count;
+}
+
+uint64_t storeHotVersion()
+{
+    return versions.hot;
+}
+
+uint64_t storeColdVersion()
+{
+    return versions.cold;
+}
+
+const AccountHot_t *storeHot(uint32_t slot)
+{
+    return slot < store.slots && isLive(slot) ? &store.hot[slot] : NULL;
+}
+
+const AccountCold_t *storeCold(uint32_t slot)
+{
+    return slot < store.slots && isLive(slot) ? &store.cold[slot] : NULL;
+}
+
+const AccountHot_t *storeHotColumn()
+{
+    return store.hot;
+}
+
+bool storeRead(uint32_t slot, Account_t *account)
+{
+    pthread_mutex_lock(&store_lock);
+    bool live = slot < store.slots && isLive(slot);
+    if (live)
+        joinAccount(&store.hot[slot], &store.cold[slot], account);
+    pthread_mutex_unlock(&store_lock);
+    return live;
+}
+
+bool storeGet(uint32_t id, Account_t *account)
+{
+    uint64_t start = metricStart();
+    pthread_mutex_lock(&store_lock);
+    int64_t slot = slotOf(id);
+    bool found = slot >= 0 && storeRead((uint32_t)slot, account);
+    pthread_mutex_unlock(&store_lock);
+    metricEnd(METRIC_STORE_GET, start, found);
+    return found;
+}
+
+uint32_t storeLastID()
+{
+    return store.last_id;
+}
+
+// A number stays taken after its create is rolled back, which only means it
+// is not handed out again until the next start
+bool storeHasIBAN(const char *iban)
+{
+    return ibanSetContains(iban);
+}
+
+uint32_t storeIBANCount()
+{
+    return ibanSetCount();
+}
+
+// An account may have more than one entry, after a rolled back create of
+// its id with the same PESEL
+uint32_t storeFindPESEL(const char *pesel, uint32_t *slots, uint32_t capacity)
+{
+    uint32_t found = 0;
+    PeselCursor_t cursor;
+    pthread_mutex_lock(&store_lock);
+    peselMapFind(pesel, &cursor);
+    for (int64_t slot = nextPESELSlot(pesel, &cursor); slot >= 0; slot = nextPESELSlot(pesel, &cursor))
+    {
+        uint32_t seen = 0;
+        while (seen < found && seen < capacity && slots[seen] != slot)
+            seen++;
+        if (seen < found && seen < capacity)
+            continue;
+        if (found < capacity)
+            slots[found] = (uint32_t)slot;
+        found++;
+    }
+    pthread_mutex_unlock(&store_lock);
+    return found;
+}
+
+// A create, or an update giving the account another PESEL, must not take
+// one that belongs to a different account
+static bool peselFree(const Account_t *image, int64_t slot)
+{
+    if (slot >= 0 && strncmp(store.cold[slot].pesel_number, image->pesel_number, sizeof(PESEL)) == 0)
+        return true;
+    int64_t owner = peselSlot(image->pesel_number);
+    return owner < 0 || store.hot[owner].id == image->id;
+}
+
+static bool reservePending(uint32_t count)
+{
+    uint32_t needed = store.pending_count + count;
+    if (needed <= store.pending_capacity)
+        return true;
+    uint32_t new_capacity = store.pending_capacity ? store.pending_capacity * 2 : 64;
+    while (new_capacity < needed)
+        new_capacity *= 2;
+    Pending_t *pending = realloc(store.pending, new_capacity * sizeof(Pending_t));
+    if (pending == NULL)
+        return false;
+    store.pending = pending;
+    store.pending_capacity = new_capacity;
+    return true;
+}
+
+static void rollback()
+{
+    walDiscard();
+    journalDiscard();
+    changed(store.pending_count > 0);
+    while (store.pending_count > 0)
+    {
+        Pending_t *pending = &store.pending[--store.pending_count];
+        // The slot is zeroed like the file's, which write-back may fill in
+        // when it writes the slots around it
+        if (pending->created)
+        {
+            clearLive(pending->slot);
+            memset(&store.hot[pending->slot], 0, sizeof(AccountHot_t));
+            memset(&store.cold[pending->slot], 0, sizeof(AccountCold_t));
+            store.count--;
+        }
+        else
+        {
+            store.hot[pending->slot] = pending->hot_before;
+            if (pending->cold_changed)
+                store.cold[pending->slot] = pending->cold_before;
+        }
+    }
+    store.slots = store.committed_slots;
+    store.last_id = store.committed_last_id;
+}
+
+// Logs the after-images and applies them in memory; the files are only
+// written once the log record is durable, at the next checkpoint
+static bool stage(WalType_t type, const Account_t *images, uint32_t count)
+{
+    int64_t slots[WAL_MAX_IMAGES];
+    if (store.loading)
+        return false;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        slots[i] = slotOf(images[i].id);
+        if ((type == WAL_CREATE ? slots[i] >= 0 || images[i].id == EMPTY_KEY : slots[i] < 0) ||
+            !peselFree(&images[i], slots[i]))
+            return false;
+    }
+    if (type == WAL_CREATE ? !reserveNew(images[0].id) : !peselMapReserve(count))
+        return false;
+    uint64_t lsn = walNextLSN();
+    int64_t now = time(NULL);
+    if (!reservePending(count) || !walAppend(type, now, images, count))
+        return false;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        Pending_t *pending = &store.pending[store.pending_count++];
+        pending->created = type == WAL_CREATE;
+        if (pending->created)
+        {
+            pending->slot = placeNew(&images[i]);
+            peselMapPut(images[i].pesel_number, images[i].id);
+        }
+        else
+        {
+            pending->slot = (uint32_t)slots[i];
+            pending->hot_before = store.hot[slots[i]];
+            // Balance changes do not store into the cold record at all, so
+            // its page stays the file's
+            AccountCold_t cold;
+            splitAccount(&images[i], &store.hot[slots[i]], &cold);
+            pending->cold_changed = memcmp(&cold, &store.cold[slots[i]], sizeof(AccountCold_t)) != 0;
+            changed(pending->cold_changed);
+            if (pending->cold_changed)
+            {
+                pending->cold_before = store.cold[slots[i]];
+                store.cold[slots[i]] = cold;
+                if (strcmp(pending->cold_before.pesel_number, images[i].pesel_number) != 0)
+                    peselMapPut(images[i].pesel_number, images[i].id);
+            }
+        }
+        journalRecord(lsn, now, pending->created ? NULL : &pending->hot_before, &store.hot[pending->slot],
+                      type == WAL_TRANSFER ? images[1 - i].id : 0);
+    }
+
+    if (!thread_waiter.queued || thread_waiter.done)
+    {
+        bool durable = !thread_waiter.queued || thread_waiter.durable;
+        thread_waiter = (Waiter_t){ true, false, durable, store.waiters };
+        store.waiters = &thread_waiter;
+    }
+    return !store.autocommit || storeCommit();
+}
+
+static bool stageLocked(WalType_t type, const Account_t *images, uint32_t count)
+{
+    uint64_t start = metricStart();
+    pthread_mutex_lock(&store_lock);
+    bool staged = stage(type, images, count);
+    pthread_mutex_unlock(&store_lock);
+    metricEnd(METRIC_STORE_STAGE, start, staged);
+    return staged;
+}
+
+bool storeUpdate(const Account_t *updated)
+{
+    return stageLocked(WAL_UPDATE, updated, 1);
+}
+
+bool storeTransfer(const Account_t *source, const Account_t *destination)
+{
+    Account_t images[] = { *source, *destination };
+    return source->id != destination->id && stageLocked(WAL_TRANSFER, images, 2);
+}
+
+bool storeAppend(const Account_t *new)
+{
+    return stageLocked(WAL_CREATE, new, 1);
+}
+
+bool storeLoad(const Account_t *new)
+{
+    pthread_mutex_lock(&store_lock);
+    bool placed = store.pending_count == 0 && new->id != EMPTY_KEY && slotOf(new->id) < 0 &&
+                  peselSlot(new->pesel_number) < 0 && reserveNew(new->id);
+    if (placed)
+    {
+        placeNew(new);
+        peselMapPut(new->pesel_number, new->id);
+        store.loading = true;
+    }
+    pthread_mutex_unlock(&store_lock);
+    return placed;
+}
+
+// Drops the loaded records from memory; their account numbers stay taken
+// until the next start, as after a rollback
+static void unload()
+{
+    changed(true);
+    for (uint32_t slot = store.committed_slots; slot < store.slots; slot++)
+    {
+        if (isLive(slot))
+        {
+            clearLive(slot);
+            store.count--;
+        }
+    }
+    store.slots = store.committed_slots;
+    store.last_id = store.committed_last_id;
+    store.header_dirty = false;
+}
+
+// Loaded records all sit past the committed slots, so each file takes one
+// sequential write; they become part of the store when the header counting
+// them is durable, and a crash before that leaves the old header in charge
+bool storeLoadCommit()
+{
+    uint64_t start = metricStart();
+    pthread_mutex_lock(&store_lock);
+    bool written = true;
+    if (store.loading)
+    {
+        uint32_t first = store.committed_slots, count = store.slots - first, flushed_first, flushed_end;
+        written = flushDirty(&flushed_first, &flushed_end) &&
+                  writeAllAt(store.hot_fd, &store.hot[first], (size_t)count * sizeof(AccountHot_t),
+                             (off_t)first * sizeof(AccountHot_t), METRIC_STORE_LOAD) &&
+                  writeAllAt(store.fd, &store.cold[first], (size_t)count * sizeof(AccountCold_t),
+                             sizeof(StoreHeader_t) + (off_t)first * sizeof(AccountCold_t), METRIC_STORE_LOAD) &&
+                  fdatasync(store.hot_fd) == 0 && fdatasync(store.fd) == 0 && writeHeader() &&
+                  fdatasync(store.fd) == 0;
+        if (written)
+        {
+            store.committed_slots = store.slots;
+            store.committed_last_id = store.last_id;
+            releaseWritten(flushed_first, flushed_end);
+            releaseWritten(first, store.slots);
+        }
+        else
+        {
+            unload();
+        }
+        store.loading = false;
+    }
+    pthread_mutex_unlock(&store_lock);
+    metricEnd(METRIC_STORE_LOAD, start, written);
+    return written;
+}
+
+bool storeLoadFull()
+{
+    pthread_mutex_lock(&store_lock);
+    size_t loaded = (size_t)(store.slots - store.committed_slots) * (sizeof(AccountHot_t) + sizeof(AccountCold_t));
+    bool full = store.dirty_pages + loaded / pageSize() >= store.budget_pages;
+    pthread_mutex_unlock(&store_lock);
+    return full;
+}
+
+void storeSetAutocommit(bool enabled)
+{
+    pthread_mutex_lock(&store_lock);
+    store.autocommit = enabled;
+    pthread_mutex_unlock(&store_lock);
+}
+
+// Tells every thread whose changes were in the group how it went
+static void releaseWaiters(bool durable)
+{
+    for (Waiter_t *waiter = store.waiters; waiter != NULL; waiter = waiter->next)
+    {
+        waiter->done = true;
+        waiter->durable = waiter->durable && durable;
+    }
+    store.waiters = NULL;
+    pthread_cond_broadcast(&store_committed);
+}
+
+static bool overBudget()
+{
+    return store.dirty_pages >= store.budget_pages;
+}
+
+static bool writePending()
+{
+    if (!walCommit())
+    {
+        rollback();
+        releaseWaiters(false);
+        return false;
+    }
+
+    // Once logged, a failed data write is repaired by replay on next start,
+    // which also writes the journal entries a failed journal write lost
+    if (!journalWrite())
+        store.write_failed = true;
+
+    // Balance changes leave the cold part alone and only touch the hot file
+    for (uint32_t i = 0; i < store.pending_count; i++)
+    {
+        const Pending_t *pending = &store.pending[i];
+        markDirty(pending->slot, pending->created || pending->cold_changed);
+    }
+    store.pending_count = 0;
+    store.committed_slots = store.slots;
+    store.committed_last_id = store.last_id;
+    releaseWaiters(true);
+    return true;
+}
+
+static bool commit()
+{
+    if (store.pending_count == 0)
+        return true;
+    uint64_t start = metricStart();
+    bool written = writePending();
+    metricEnd(METRIC_STORE_COMMIT, start, written);
+    // Logged changes are durable whatever becomes of their write-back. Until
+    // a checkpoint makes a failed write good, each commit tries another; the
+    // failures show in the checkpoint metric.
+    if (written && (walSize() >= WAL_CHECKPOINT_SIZE || store.write_failed || overBudget()) && !storeCheckpoint() &&
+        !store.checkpoint_failing)
+    {
+        store.checkpoint_failing = true;
+        fprintf(stderr, "Checkpoint failed, committed changes stay in the log until one succeeds\n");
+    }
+    return written;
+}
+
+bool storeCommit()
+{
+    pthread_mutex_lock(&store_lock);
+    bool committed = commit();
+    pthread_mutex_unlock(&store_lock);
+    return committed;
+}
+
+static bool checkpoint()
+{
+    uint32_t first, end;
+    if (!commit() || !flushDirty(&first, &end) || fdatasync(store.hot_fd) != 0 || fdatasync(store.fd) != 0 ||
+        !journalSync() || !walTruncate())
+        return false;
+    // The files and the journal now hold every committed change, so writes
+    // that failed before (a full disk since cleared, say) are made good
+    store.write_failed = false;
+    store.checkpoint_failing = false;
+    // Loaded records are not written until their load commits
+    if (!store.loading)
+        releaseWritten(first, end);
+    return true;
+}
+
+bool storeCheckpoint()
+{
+    uint64_t start = metricStart();
+    pthread_mutex_lock(&store_lock);
+    bool synced = checkpoint();
+    if (synced)
+        startSnapshot();
+    pthread_mutex_unlock(&store_lock);
+    metricEnd(METRIC_STORE_CHECKPOINT, start, synced);
+    return synced;
+}
+
+bool storeSync(bool wait_for_others)
+{
+    pthread_mutex_lock(&store_lock);
+    while (thread_waiter.queued && !thread_waiter.done)
+    {
+        if (store.committing)
+        {
+            pthread_cond_wait(&store_committed, &store_lock);
+            continue;
+        }
+
+        store.committing = true;
+        if (wait_for_others)
+        {
+            struct timespec delay = { 0, COMMIT_DELAY_NS };
+            pthread_mutex_unlock(&store_lock);
+            nanosleep(&delay, NULL);
+            pthread_mutex_lock(&store_lock);
+        }
+        commit();
+        store.committing = false;
+        pthread_cond_broadcast(&store_committed);
+    }
+    bool durable = !thread_waiter.queued || thread_waiter.durable;
+    thread_waiter.queued = false;
+    pthread_mutex_unlock(&store_lock);
+    return durable;
+}
+
+void storeLock()
+{
+    pthread_mutex_lock(&store_lock);
+}
+
+void storeUnlock()
+{
+    pthread_mutex_unlock(&store_lock);
+}
+
+static uint32_t stripeOf(uint32_t id)
+{
+    return hashID(id) >> STRIPE_SHIFT;
+}
+
+// Stripes are always taken in ascending order, so two threads locking
+// overlapping pairs cannot wait on each other. Id 0 stands for no account.
+static uint32_t orderStripes(uint32_t first, uint32_t second, uint32_t *ordered)
+{
+    uint32_t count = 0;
+    if (first != 0)
+        ordered[count++] = stripeOf(first);
+    if (second != 0)
+    {
+        uint32_t stripe = stripeOf(second);
+        if (count == 0 || stripe > ordered[0])
+            ordered[count++] = stripe;
+        else if (stripe < ordered[0])
+        {
+            ordered[1] = ordered[0];
+            ordered[0] = stripe;
+            count++;
+        }
+    }
+    return count;
+}
+
+void storeLockAccounts(uint32_t first, uint32_t second)
+{
+    uint32_t ordered[2];
+    uint32_t count = orderStripes(first, second, ordered);
+    for (uint32_t i = 0; i < count; i++)
+        pthread_mutex_lock(&stripes[ordered[i]]);
+}
+
+void storeUnlockAccounts(uint32_t first, uint32_t second)
+{
+    uint32_t ordered[2];
+    uint32_t count = orderStripes(first, second, ordered);
+    while (count > 0)
+        pthread_mutex_unlock(&stripes[ordered[--count]]);
+}
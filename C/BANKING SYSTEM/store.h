@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bank.h"
+
+// Record placement in the data file. DIRECT keeps account id at slot
+// (id - 1), so offsets are computed, and zeroed slots are tombstones;
+// PACKED files are in arbitrary order and located through a hash index.
+typedef enum {
+    STORE_DIRECT = 0,
+    STORE_PACKED = 1
+} StoreLayout_t;
+
+// Accounts are stored split in two. The hot part holds what balance
+// operations and scans touch, densely packed in its own column file; the
+// cold part holds the identity strings and is only rewritten when those
+// change. A slot is the same position in both.
+typedef struct
+{
+    uint32_t id;
+    uint16_t instalments_paid;
+    uint16_t charged_month;
+    Money_t balance;
+    Money_t debt;
+} AccountHot_t;
+
+typedef struct
+{
+    IBAN account_number;
+    Fixed_string first_name;
+    Fixed_string last_name;
+    Address address;
+    PESEL pesel_number;
+} AccountCold_t;
+
+// Account store: the data and hot column files are mapped into memory
+// copy-on-write, through descriptors that stay open. Changes are logged to
+// the write-ahead log first; the records they touch stay marked dirty in
+// memory and are written back in slot order at the next checkpoint, after
+// which their pages are the files' again and the kernel may evict them, so
+// the memory the store holds is bounded by what changed since. A commit
+// that leaves more changed pages than BANK_STORE_BUDGET MiB (32 by
+// default) allows checkpoints at once. A leftover log is replayed on open.
+// The data file starts with a versioned header carrying the layout, record
+// count and next id; files in an older format are upgraded in place on
+// first open.
+// Checkpoints also leave a snapshot of what opening derives from the
+// records (which slots are live, the id index, the account numbers and
+// PESELs in use), written in the background by a forked child, so that the
+// next open only scans the records appended after it instead of the whole
+// file.
+// The store may be used from several threads. Reads and changes lock it
+// internally; the slot accessors, counts and scans below return shared
+// state, so a threaded caller holds storeLock across them.
+bool storeOpen(const char *path, const char *hot_path, const char *wal_path, const char *snapshot_path);
+void storeClose();
+StoreLayout_t storeLayout();
+
+uint32_t storeSlots();
+uint32_t storeCommittedSlots();
+uint32_t storeCount();
+// Move with every change to the records in memory, staged, rolled back or
+// loaded, so views derived from them can tell they are out of date. The
+// cold version only moves when accounts come or go or their identity
+// fields change.
+uint64_t storeHotVersion();
+uint64_t storeColdVersion();
+// These return NULL (or false) for tombstones
+const AccountHot_t *storeHot(uint32_t slot);
+const AccountCold_t *storeCold(uint32_t slot);
+bool storeRead(uint32_t slot, Account_t *account);
+// The whole hot column, storeSlots() entries long, for scans; tombstones
+// are zeroed
+const AccountHot_t *storeHotColumn();
+bool storeGet(uint32_t id, Account_t *account);
+uint32_t storeLastID();
+bool storeHasIBAN(const char *iban);
+uint32_t storeIBANCount();
+// The number of accounts carrying pesel, with the slots of up to capacity
+// of them. Creates, loads and updates that would give an account a PESEL
+// another one has are refused, so only stores older than that rule have
+// more than one.
+uint32_t storeFindPESEL(const char *pesel, uint32_t *slots, uint32_t capacity);
+// Identifies the data file by its records below covered, for files of
+// structures built from them
+uint64_t storeFingerprint(uint32_t covered);
+
+bool storeUpdate(const Account_t *updated);
+bool storeTransfer(const Account_t *source, const Account_t *destination);
+bool storeAppend(const Account_t *new);
+
+// Bulk loading: storeLoad places a new account in memory without logging
+// it, and storeLoadCommit writes everything loaded since the last one in a
+// single pass per file, durable all at once. Commit staged changes before
+// loading; other changes are refused until the load is committed.
+bool storeLoad(const Account_t *new);
+bool storeLoadCommit();
+// Whether what was loaded since the last storeLoadCommit has used up the
+// memory budget, so the caller should commit it before loading more
+bool storeLoadFull();
+
+// With autocommit on (the default) every change is synced on its own;
+// otherwise changes accumulate until storeCommit syncs them as one group
+void storeSetAutocommit(bool enabled);
+bool storeCommit();
+bool storeCheckpoint();
+// Returns once the changes the calling thread staged are durable, and
+// whether they are. Threads syncing together share one commit, whose leader
+// waits briefly for the others to stage first when wait_for_others is set.
+// A thread that staged changes must sync before it exits.
+bool storeSync(bool wait_for_others);
+
+void storeLock();
+void storeUnlock();
+// Per-account locks for a read-modify-write cycle: hold them from storeGet
+// to the change that writes the result. Pass 0 for an unused second id.
+void storeLockAccounts(uint32_t first, uint32_t second);
+void storeUnlockAccounts(uint32_t first, uint32_t second);
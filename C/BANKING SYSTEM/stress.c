@@ -0,0 +1,193 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bank.h"
+#include "batch.h"
+#include "money.h"
+#include "operations.h"
+#include "scratch.h"
+#include "store.h"
+#include "stress.h"
+#include "util.h"
+
+#define STRESS_ACCOUNTS 4096
+#define STRESS_BALANCE 100000
+#define STRESS_MAX_AMOUNT 500
+#define STRESS_DEFAULT_THREADS 8
+#define STRESS_MAX_THREADS 64
+#define STRESS_DEFAULT_TRANSFERS 20000
+// Each worker waits for durability after this many transfers, as a client
+// pipelining its requests would
+#define STRESS_SYNC_EVERY 64
+
+typedef struct
+{
+    uint32_t first_id;
+    uint32_t accounts;
+    unsigned long transfers;
+    unsigned int seed;
+    unsigned long rejected;
+    bool failed;
+} Worker_t;
+
+static bool createAccounts()
+{
+    storeSetAutocommit(false);
+    for (uint32_t i = 0; i < STRESS_ACCOUNTS; i++)
+    {
+        Account_t new;
+        memset(&new, 0, sizeof(Account_t));
+        new.id = storeLastID() + 1;
+        strcpy(new.first_name, "Stress");
+        snprintf(new.last_name, CHARBUFFER, "Account%u", new.id);
+        snprintf(new.pesel_number, PESEL_LENGTH + 1, "%011u", new.id);
+        strcpy(new.address, "Scratch");
+        new.balance = STRESS_BALANCE;
+        if (!generateIBAN(&new) || !storeAppend(&new))
+            return false;
+    }
+    return storeCommit();
+}
+
+// Compares the sum of all balances with what was deposited
+static bool balancesHold(const char *when)
+{
+    int64_t total = 0;
+    uint32_t negative = 0;
+    storeLock();
+    const AccountHot_t *hot = storeHotColumn();
+    for (uint32_t slot = 0; slot < storeSlots(); slot++)
+    {
+        total += hot[slot].balance;
+        negative += hot[slot].balance < 0;
+    }
+    uint32_t count = storeCount();
+    storeUnlock();
+
+    int64_t expected = (int64_t)STRESS_ACCOUNTS * STRESS_BALANCE;
+    if (total == expected && negative == 0 && count == STRESS_ACCOUNTS)
+        return true;
+    char actual_text[MONEY_BUFFER], expected_text[MONEY_BUFFER];
+    formatMoney(total, actual_text);
+    formatMoney(expected, expected_text);
+    fprintf(stderr, "Invariant broken %s: total %s, expected %s, %u negative balances, %u accounts\n", when,
+            actual_text, expected_text, negative, count);
+    return false;
+}
+
+static void *workerMain(void *argument)
+{
+    Worker_t *worker = argument;
+    char line[BUFFER], error_msg[BUFFER];
+    for (unsigned long i = 1; i <= worker->transfers; i++)
+    {
+        uint32_t source = worker->first_id + rand_r(&worker->seed) % worker->accounts;
+        uint32_t destination = worker->first_id + rand_r(&worker->seed) % (worker->accounts - 1);
+        if (destination >= source)
+            destination++;
+        int amount = 1 + rand_r(&worker->seed) % STRESS_MAX_AMOUNT;
+        snprintf(line, sizeof(line), "transfer;%u;%u;%d.%02d", source, destination, amount / 100, amount % 100);
+        if (!batchApplyLine(line, error_msg))
+            worker->rejected++;
+        if ((i % STRESS_SYNC_EVERY == 0 || i == worker->transfers) && !storeSync(true))
+            worker->failed = true;
+    }
+    return NULL;
+}
+
+// Every worker gets its own slice of the accounts when disjoint is set and
+// all of them otherwise
+static bool runRound(bool disjoint, int threads, unsigned long transfers)
+{
+    pthread_t ids[STRESS_MAX_THREADS];
+    Worker_t workers[STRESS_MAX_THREADS];
+    uint32_t slice = STRESS_ACCOUNTS / threads;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int started = 0;
+    for (; started < threads; started++)
+    {
+        Worker_t *worker = &workers[started];
+        worker->first_id = disjoint ? 1 + started * slice : 1;
+        worker->accounts = disjoint ? slice : STRESS_ACCOUNTS;
+        worker->transfers = transfers;
+        worker->seed = (unsigned int)time(NULL) * 31 + started;
+        worker->rejected = 0;
+        worker->failed = false;
+        if (pthread_create(&ids[started], NULL, workerMain, worker) != 0)
+            break;
+    }
+    bool ok = started == threads;
+    unsigned long rejected = 0;
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(ids[i], NULL);
+        rejected += workers[i].rejected;
+        ok = ok && !workers[i].failed;
+    }
+    double seconds = elapsedSince(&start);
+    unsigned long total = transfers * started;
+    printf("%-9s %8d %12lu %10lu %10.3f %14.0f\n", disjoint ? "disjoint" : "shared", started, total, rejected,
+           seconds, seconds > 0 ? total / seconds : 0.0);
+    if (!ok)
+        fprintf(stderr, "A worker could not start or a commit failed\n");
+    return balancesHold("after the round") && ok;
+}
+
+int runStress(int argc, char *argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : STRESS_DEFAULT_THREADS;
+    long transfers = argc > 2 ? atol(argv[2]) : STRESS_DEFAULT_TRANSFERS;
+    if (max_threads < 1 || max_threads > STRESS_MAX_THREADS || transfers < 1)
+    {
+        fprintf(stderr, "Usage: stress [THREADS (1-%d) [TRANSFERS PER THREAD]]\n", STRESS_MAX_THREADS);
+        return 1;
+    }
+
+    ScratchFiles_t files;
+    if (!scratchCreate(&files, "stress"))
+    {
+        fprintf(stderr, "Cannot create a scratch directory\n");
+        return 1;
+    }
+    if (!storeOpen(files.data, files.hot, files.wal, files.snapshot))
+    {
+        fprintf(stderr, "Error opening %s\n", files.data);
+        scratchRemove(&files);
+        return 1;
+    }
+    if (!createAccounts())
+    {
+        fprintf(stderr, "Error creating the scratch accounts\n");
+        storeClose();
+        scratchRemove(&files);
+        return 1;
+    }
+
+    printf("%-9s %8s %12s %10s %10s %14s\n", "Round", "Threads", "Transfers", "Rejected", "Seconds",
+           "Transfers/s");
+    bool ok = true;
+    for (int threads = 1; ok; threads = threads * 2 < max_threads ? threads * 2 : max_threads)
+    {
+        ok = runRound(true, threads, (unsigned long)transfers) &&
+             runRound(false, threads, (unsigned long)transfers);
+        if (threads == max_threads)
+            break;
+    }
+    storeSetAutocommit(true);
+    storeClose();
+
+    // What reached the files (and the log) must add up as well
+    if (ok)
+    {
+        ok = storeOpen(files.data, files.hot, files.wal, files.snapshot) && balancesHold("after reopening");
+        storeClose();
+    }
+    scratchRemove(&files);
+    printf("%s\n", ok ? "Balance invariant held" : "FAILED");
+    return ok ? 0 : 1;
+}
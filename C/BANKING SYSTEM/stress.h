@@ -0,0 +1,11 @@
+#pragma once
+
+// Concurrency check for the account locks and the group commit. It builds
+// a scratch store, then has worker threads run random transfers through
+// the batch code path, first between disjoint sets of accounts (which
+// should scale with the threads) and then all over the store (which
+// exercises lock ordering). After each round and again after reopening
+// the store, the sum of all balances must equal what was deposited.
+// argv[1] is the highest thread count (rounds double up to it), argv[2] the
+// transfers per thread. The bank's own files are not touched.
+int runStress(int argc, char *argv[]);
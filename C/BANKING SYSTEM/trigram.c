@@ -0,0 +1,207 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bank.h"
+#include "store.h"
+#include "trigram.h"
+
+#define TRIGRAM_MIN_CAPACITY 4096
+#define POSTING_MIN_CAPACITY 4
+
+typedef struct
+{
+    uint32_t key;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *slots;
+} Posting_t;
+
+typedef struct
+{
+    Posting_t *table;
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t covered;
+} TrigramIndex_t;
+
+static TrigramIndex_t trigrams;
+
+static const struct
+{
+    SearchField_t field;
+    size_t offset;
+} indexed_fields[] = {
+    { SEARCH_NAME, offsetof(AccountCold_t, first_name) },
+    { SEARCH_SURNAME, offsetof(AccountCold_t, last_name) },
+    { SEARCH_ADDRESS, offsetof(AccountCold_t, address) },
+};
+
+#define INDEXED_FIELDS_COUNT (sizeof(indexed_fields) / sizeof(indexed_fields[0]))
+
+// The field goes in the top byte, which also keeps every key non-zero so 0
+// can mark an empty bucket
+static uint32_t trigramKey(SearchField_t field, const char *text)
+{
+    const unsigned char *bytes = (const unsigned char *)text;
+    return ((uint32_t)field << 24) | ((uint32_t)bytes[0] << 16) | ((uint32_t)bytes[1] << 8) | bytes[2];
+}
+
+static Posting_t *probe(Posting_t *table, uint32_t capacity, uint32_t key)
+{
+    uint32_t pos = (key * 2654435761u) & (capacity - 1);
+    while (table[pos].key != 0 && table[pos].key != key)
+        pos = (pos + 1) & (capacity - 1);
+    return &table[pos];
+}
+
+static bool grow()
+{
+    uint32_t new_capacity = trigrams.capacity ? trigrams.capacity * 2 : TRIGRAM_MIN_CAPACITY;
+    Posting_t *table = calloc(new_capacity, sizeof(Posting_t));
+    if (table == NULL)
+        return false;
+    for (uint32_t i = 0; i < trigrams.capacity; i++)
+    {
+        if (trigrams.table[i].key != 0)
+            *probe(table, new_capacity, trigrams.table[i].key) = trigrams.table[i];
+    }
+    free(trigrams.table);
+    trigrams.table = table;
+    trigrams.capacity = new_capacity;
+    return true;
+}
+
+static bool addPosting(uint32_t key, uint32_t slot)
+{
+    if ((trigrams.used + 1) * 2 > trigrams.capacity && !grow())
+        return false;
+
+    Posting_t *posting = probe(trigrams.table, trigrams.capacity, key);
+    if (posting->key == 0)
+    {
+        posting->key = key;
+        trigrams.used++;
+    }
+    // Slots arrive in ascending order, so a repeated trigram within one
+    // field is always the last entry
+    if (posting->count > 0 && posting->slots[posting->count - 1] == slot)
+        return true;
+
+    if (posting->count == posting->capacity)
+    {
+        uint32_t new_capacity = posting->capacity ? posting->capacity * 2 : POSTING_MIN_CAPACITY;
+        uint32_t *slots = realloc(posting->slots, new_capacity * sizeof(uint32_t));
+        if (slots == NULL)
+            return false;
+        posting->slots = slots;
+        posting->capacity = new_capacity;
+    }
+    posting->slots[posting->count++] = slot;
+    return true;
+}
+
+static bool sync()
+{
+    uint32_t end = storeCommittedSlots();
+    for (uint32_t slot = trigrams.covered; slot < end; slot++)
+    {
+        const AccountCold_t *account = storeCold(slot);
+        if (account == NULL)
+            continue;
+        for (size_t f = 0; f < INDEXED_FIELDS_COUNT; f++)
+        {
+            const char *text = (const char *)account + indexed_fields[f].offset;
+            size_t length = strlen(text);
+            for (size_t i = 0; i + 3 <= length; i++)
+            {
+                if (!addPosting(trigramKey(indexed_fields[f].field, text + i), slot))
+                    return false;
+            }
+        }
+        // A record indexed before a failed allocation is simply redone,
+        // repeats of its own slot are skipped by addPosting
+        trigrams.covered = slot + 1;
+    }
+    trigrams.covered = end;
+    return true;
+}
+
+static bool contains(const uint32_t *slots, uint32_t count, uint32_t slot)
+{
+    uint32_t low = 0, high = count;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (slots[mid] < slot)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low < count && slots[low] == slot;
+}
+
+static int compareLength(const void *a, const void *b)
+{
+    const Posting_t *x = *(const Posting_t *const *)a;
+    const Posting_t *y = *(const Posting_t *const *)b;
+    return (x->count > y->count) - (x->count < y->count);
+}
+
+bool trigramSearch(SearchField_t field, const char *key, SlotList_t *matches)
+{
+    size_t offset = 0;
+    bool indexed = false;
+    for (size_t f = 0; f < INDEXED_FIELDS_COUNT; f++)
+    {
+        if (indexed_fields[f].field == field)
+        {
+            offset = indexed_fields[f].offset;
+            indexed = true;
+        }
+    }
+    size_t length = strlen(key);
+    if (!indexed || length < 3 || length > ADDRBUFFER || !sync())
+        return false;
+
+    // Posting lists of the key's distinct trigrams, shortest first
+    const Posting_t *lists[ADDRBUFFER];
+    size_t list_count = 0;
+    for (size_t i = 0; i + 3 <= length; i++)
+    {
+        uint32_t trigram = trigramKey(field, key + i);
+        const Posting_t *posting = trigrams.capacity ? probe(trigrams.table, trigrams.capacity, trigram) : NULL;
+        if (posting == NULL || posting->key == 0)
+            return true;
+
+        bool seen = false;
+        for (size_t j = 0; j < list_count && !seen; j++)
+            seen = lists[j] == posting;
+        if (!seen)
+            lists[list_count++] = posting;
+    }
+    qsort(lists, list_count, sizeof(lists[0]), compareLength);
+
+    for (uint32_t i = 0; i < lists[0]->count; i++)
+    {
+        uint32_t slot = lists[0]->slots[i];
+        bool candidate = true;
+        for (size_t j = 1; j < list_count && candidate; j++)
+            candidate = contains(lists[j]->slots, lists[j]->count, slot);
+
+        // Trigrams do not fix their relative positions, so confirm the match
+        const AccountCold_t *account = storeCold(slot);
+        if (candidate && account != NULL && strstr((const char *)account + offset, key) != NULL &&
+            !slotListAppend(matches, slot))
+            return false;
+    }
+    return true;
+}
+
+void trigramClose()
+{
+    for (uint32_t i = 0; i < trigrams.capacity; i++)
+        free(trigrams.table[i].slots);
+    free(trigrams.table);
+    memset(&trigrams, 0, sizeof(trigrams));
+}
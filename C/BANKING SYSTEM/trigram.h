@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "index.h"
+
+// Inverted index from every 3-byte substring of the first name, last name
+// and address to the (ascending) slots containing it. A substring query
+// intersects the posting lists of the key's trigrams and verifies only the
+// surviving candidates with strstr. Built on the first substring query and
+// kept up to date with appended records afterwards.
+//
+// Returns false when the index cannot answer (a key shorter than three
+// characters or a field that is not indexed), so the caller has to scan.
+bool trigramSearch(SearchField_t field, const char *key, SlotList_t *matches);
+void trigramClose();
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "money.h"
+#include "util.h"
+
+double elapsedSince(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+bool copyField(char *dest, size_t size, const char *field, const char *what, char *error_msg)
+{
+    if (strlen(field) >= size)
+    {
+        sprintf(error_msg, "%s is too long", what);
+        return false;
+    }
+    strcpy(dest, field);
+    return true;
+}
+
+bool parseAmount(const char *field, Money_t *value, char *error_msg)
+{
+    if (!parseMoney(field, value))
+    {
+        sprintf(error_msg, "Invalid amount '%.*s'", CHARBUFFER, field);
+        return false;
+    }
+    return true;
+}
+
+bool parseCount(const char *text, uint32_t max, uint32_t *value)
+{
+    char *endptr;
+    unsigned long parsed = strtoul(text, &endptr, 10);
+    if (*text < '0' || *text > '9' || *endptr != '\0' || parsed > max)
+        return false;
+    *value = (uint32_t)parsed;
+    return true;
+}
+
+bool readFully(int fd, void *buffer, size_t size)
+{
+    char *pos = buffer;
+    while (size > 0)
+    {
+        ssize_t got = read(fd, pos, size);
+        if (got <= 0)
+            return false;
+        pos += got;
+        size -= got;
+    }
+    return true;
+}
+
+bool writeFully(int fd, const void *buffer, size_t size)
+{
+    const char *pos = buffer;
+    while (size > 0)
+    {
+        ssize_t put = write(fd, pos, size);
+        if (put <= 0)
+            return false;
+        pos += put;
+        size -= put;
+    }
+    return true;
+}
+
+bool readFullyAt(int fd, void *buffer, size_t size, off_t offset)
+{
+    char *pos = buffer;
+    while (size > 0)
+    {
+        ssize_t got = pread(fd, pos, size, offset);
+        if (got <= 0)
+            return false;
+        pos += got;
+        offset += got;
+        size -= got;
+    }
+    return true;
+}
+
+bool writeFullyAt(int fd, const void *buffer, size_t size, off_t offset)
+{
+    const char *pos = buffer;
+    while (size > 0)
+    {
+        ssize_t put = pwrite(fd, pos, size, offset);
+        if (put <= 0)
+            return false;
+        pos += put;
+        offset += put;
+        size -= put;
+    }
+    return true;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "bank.h"
+
+// Seconds on the monotonic clock since start
+double elapsedSince(const struct timespec *start);
+
+// Field checks shared by the line and CSV readers: both leave a message
+// naming the field in error_msg (BUFFER bytes) when they refuse it
+bool copyField(char *dest, size_t size, const char *field, const char *what, char *error_msg);
+bool parseAmount(const char *field, Money_t *value, char *error_msg);
+// A whole decimal number from 0 to max, no sign and nothing after it
+bool parseCount(const char *text, uint32_t max, uint32_t *value);
+
+// Transfer all size bytes, carrying on after short reads and writes; false
+// on an error or an early end of file. The At forms leave the file offset
+// where it was.
+bool readFully(int fd, void *buffer, size_t size);
+bool writeFully(int fd, const void *buffer, size_t size);
+bool readFullyAt(int fd, void *buffer, size_t size, off_t offset);
+bool writeFullyAt(int fd, const void *buffer, size_t size, off_t offset);
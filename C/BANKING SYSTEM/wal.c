@@ -0,0 +1,255 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "wal.h"
+
+#define WAL_MAGIC 0x4C415742u
+#define WAL_RECORD_MAGIC 0x52434552u
+#define WAL_VERSION 3
+#define WAL_BUFFER_MIN 4096
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t image_size;
+    uint32_t reserved;
+    uint64_t base_lsn;
+} WalHeader_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t type;
+    uint16_t count;
+    uint64_t lsn;
+    uint32_t checksum;
+    // Seconds since the epoch, 0 in records of older builds
+    uint32_t time;
+} WalRecord_t;
+
+typedef struct
+{
+    int fd;
+    uint64_t next_lsn;
+    uint64_t size;
+    char *buffer;
+    size_t buffered;
+    size_t capacity;
+    uint32_t pending;
+} Wal_t;
+
+static Wal_t wal = { .fd = -1 };
+
+static uint32_t checksum(uint32_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t recordChecksum(const WalRecord_t *record, const Account_t *images)
+{
+    WalRecord_t copy = *record;
+    copy.checksum = 0;
+    uint32_t hash = checksum(2166136261u, &copy, sizeof(copy));
+    return checksum(hash, images, record->count * sizeof(Account_t));
+}
+
+// The header is rewritten in place before the records are cut off, so a
+// crash in between only leaves already-applied records to replay again
+static bool writeHeader()
+{
+    WalHeader_t header = { WAL_MAGIC, WAL_VERSION, sizeof(Account_t), 0, wal.next_lsn };
+    if (pwrite(wal.fd, &header, sizeof(header), 0) != sizeof(header))
+        return false;
+    if (ftruncate(wal.fd, sizeof(header)) != 0 || fdatasync(wal.fd) != 0)
+        return false;
+    wal.size = sizeof(header);
+    return true;
+}
+
+bool walOpen(const char *path)
+{
+    wal.fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (wal.fd < 0)
+        return false;
+
+    WalHeader_t header;
+    ssize_t got = pread(wal.fd, &header, sizeof(header), 0);
+    if (got >= 0 && got < (ssize_t)sizeof(header))
+        return writeHeader();
+    if (got < 0 || header.magic != WAL_MAGIC)
+    {
+        fprintf(stderr, "%s is not a write-ahead log\n", path);
+        walClose();
+        return false;
+    }
+    // A log of an older version without records has nothing to lose
+    if (header.version != WAL_VERSION && !walHoldsOlderRecords(path))
+        return writeHeader();
+    if (header.version != WAL_VERSION || header.image_size != sizeof(Account_t))
+    {
+        fprintf(stderr, "%s was written by an incompatible version\n", path);
+        walClose();
+        return false;
+    }
+    wal.next_lsn = header.base_lsn;
+
+    struct stat st;
+    if (fstat(wal.fd, &st) != 0)
+    {
+        walClose();
+        return false;
+    }
+    wal.size = st.st_size;
+    return true;
+}
+
+bool walHoldsOlderRecords(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    WalHeader_t header;
+    struct stat st;
+    bool older = pread(fd, &header, sizeof(header), 0) == sizeof(header) && fstat(fd, &st) == 0 &&
+                 header.magic == WAL_MAGIC && header.version != WAL_VERSION && st.st_size > (off_t)sizeof(header);
+    close(fd);
+    return older;
+}
+
+void walClose()
+{
+    if (wal.fd >= 0)
+        close(wal.fd);
+    free(wal.buffer);
+    memset(&wal, 0, sizeof(wal));
+    wal.fd = -1;
+}
+
+long walReplay(bool (*apply)(uint64_t lsn, int64_t time, WalType_t type, const Account_t *images, uint32_t count))
+{
+    size_t size = wal.size - sizeof(WalHeader_t);
+    char *data = malloc(size ? size : 1);
+    if (data == NULL || pread(wal.fd, data, size, sizeof(WalHeader_t)) != (ssize_t)size)
+    {
+        free(data);
+        return -1;
+    }
+
+    long applied = 0;
+    size_t pos = 0;
+    while (pos + sizeof(WalRecord_t) <= size)
+    {
+        WalRecord_t record;
+        memcpy(&record, data + pos, sizeof(record));
+        size_t images_size = record.count * sizeof(Account_t);
+        if (record.magic != WAL_RECORD_MAGIC || record.count == 0 || record.count > WAL_MAX_IMAGES ||
+            pos + sizeof(record) + images_size > size)
+            break;
+
+        Account_t images[WAL_MAX_IMAGES];
+        memcpy(images, data + pos + sizeof(record), images_size);
+        if (recordChecksum(&record, images) != record.checksum)
+            break;
+        if (!apply(record.lsn, record.time, (WalType_t)record.type, images, record.count))
+        {
+            free(data);
+            return -1;
+        }
+        wal.next_lsn = record.lsn + 1;
+        applied++;
+        pos += sizeof(record) + images_size;
+    }
+    free(data);
+
+    // Whatever follows the last intact record is a torn write, cut it off
+    // so new records are not appended after garbage
+    if (pos < size)
+    {
+        if (ftruncate(wal.fd, sizeof(WalHeader_t) + pos) != 0)
+            return -1;
+        wal.size = sizeof(WalHeader_t) + pos;
+    }
+    return applied;
+}
+
+bool walAppend(WalType_t type, int64_t time, const Account_t *images, uint32_t count)
+{
+    size_t needed = sizeof(WalRecord_t) + count * sizeof(Account_t);
+    if (count == 0 || count > WAL_MAX_IMAGES)
+        return false;
+    if (wal.buffered + needed > wal.capacity)
+    {
+        size_t new_capacity = wal.capacity ? wal.capacity : WAL_BUFFER_MIN;
+        while (new_capacity < wal.buffered + needed)
+            new_capacity *= 2;
+        char *buffer = realloc(wal.buffer, new_capacity);
+        if (buffer == NULL)
+            return false;
+        wal.buffer = buffer;
+        wal.capacity = new_capacity;
+    }
+
+    WalRecord_t record = { WAL_RECORD_MAGIC, (uint16_t)type, (uint16_t)count, wal.next_lsn++, 0, (uint32_t)time };
+    record.checksum = recordChecksum(&record, images);
+    memcpy(wal.buffer + wal.buffered, &record, sizeof(record));
+    memcpy(wal.buffer + wal.buffered + sizeof(record), images, count * sizeof(Account_t));
+    wal.buffered += needed;
+    wal.pending++;
+    return true;
+}
+
+bool walCommit()
+{
+    if (wal.buffered == 0)
+        return true;
+    uint64_t start = metricStart();
+    bool written = pwrite(wal.fd, wal.buffer, wal.buffered, wal.size) == (ssize_t)wal.buffered &&
+                   fdatasync(wal.fd) == 0;
+    metricEnd(METRIC_WAL_COMMIT, start, written);
+    if (!written)
+        return false;
+    metricWritten(METRIC_WAL_COMMIT, wal.buffered);
+    wal.size += wal.buffered;
+    wal.buffered = 0;
+    wal.pending = 0;
+    return true;
+}
+
+void walDiscard()
+{
+    wal.buffered = 0;
+    wal.pending = 0;
+}
+
+uint32_t walPending()
+{
+    return wal.pending;
+}
+
+uint64_t walNextLSN()
+{
+    return wal.next_lsn;
+}
+
+uint64_t walSize()
+{
+    return wal.size;
+}
+
+bool walTruncate()
+{
+    walDiscard();
+    return writeHeader();
+}
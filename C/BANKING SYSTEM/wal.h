@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bank.h"
+
+// Write-ahead log of account after-images. Records are buffered by
+// walAppend and made durable together by walCommit, one write and one
+// fdatasync per batch (group commit). A transfer is a single record holding
+// both accounts, so replay applies it entirely or not at all.
+typedef enum {
+    WAL_CREATE = 1,
+    WAL_UPDATE = 2,
+    WAL_TRANSFER = 3
+} WalType_t;
+
+#define WAL_MAX_IMAGES 2
+
+bool walOpen(const char *path);
+void walClose();
+
+// True when the log at path still holds records of an older version, which
+// that version has to replay before the data files can be upgraded
+bool walHoldsOlderRecords(const char *path);
+
+// Calls apply for every intact record in order with its sequence number and
+// time (0 when unknown), and returns how many were applied, or -1 on error;
+// a torn record at the tail ends the replay
+long walReplay(bool (*apply)(uint64_t lsn, int64_t time, WalType_t type, const Account_t *images, uint32_t count));
+
+// time is when the change was made, in seconds since the epoch
+bool walAppend(WalType_t type, int64_t time, const Account_t *images, uint32_t count);
+bool walCommit();
+void walDiscard();
+uint32_t walPending();
+// The sequence number the next appended record gets
+uint64_t walNextLSN();
+uint64_t walSize();
+
+// Drops every record, the caller must have synced the data file first
+bool walTruncate();